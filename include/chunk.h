@@ -33,21 +33,116 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
+
+    /* Superinstructions emitted by the compiler in place of common
+     * opcode sequences (see DEBUG_PROFILE_OPCODES). */
+    OP_GET_LOCALS,          // OP_GET_LOCAL a; OP_GET_LOCAL b
+    OP_SET_LOCAL_POP,       // OP_SET_LOCAL; OP_POP
+    OP_SET_GLOBAL_POP,      // OP_SET_GLOBAL; OP_POP
+    OP_POP_JUMP_IF_FALSE,   // OP_JUMP_IF_FALSE; OP_POP on both paths
+    OP_JUMP_IF_NOT_LESS,    // OP_LESS; OP_POP_JUMP_IF_FALSE
+    OP_JUMP_IF_NOT_GREATER, // OP_GREATER; OP_POP_JUMP_IF_FALSE
+    OP_FOR_LOOP,            // increment, test and OP_LOOP of a counted for
+
+    /* Fused by the peephole pass. The negation is kept, so a NaN
+     * operand makes these true just like the pairs they replace. */
+    OP_NOT_EQUAL,           // OP_EQUAL; OP_NOT
+    OP_GREATER_EQUAL,       // OP_LESS; OP_NOT
+    OP_LESS_EQUAL,          // OP_GREATER; OP_NOT
+
+    /* String building. The operand counts the values taken off the
+     * stack, and a result made of strings only is allocated once. */
+    OP_ADD_N,               // OP_ADD n - 1 times
+    OP_INTERPOLATE,         // joins n values as print shows them
+
+    /* Calls natives[a], which replaces its arguments on top of the
+     * stack with its result. */
+    OP_NATIVE,
+
+    /* Quickened forms. run() rewrites a generic instruction into one
+     * of these the first time it executes, based on the operand types
+     * it saw, and rewrites it back if the guard ever fails. */
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_MULTIPLY_NUM,
+
+    /* Typed forms. The compiler emits these where it has proven every
+     * operand is a number, so unlike the quickened forms they check
+     * nothing at all. */
+    OP_NEGATE_UNCHECKED,
+    OP_ADD_UNCHECKED,
+    OP_SUBTRACT_UNCHECKED,
+    OP_MULTIPLY_UNCHECKED,
+    OP_DIVIDE_UNCHECKED,
+    OP_LESS_UNCHECKED,
+    OP_GREATER_UNCHECKED,
+    OP_JUMP_IF_NOT_LESS_UNCHECKED,
+    OP_JUMP_IF_NOT_GREATER_UNCHECKED,
+
+    /* Inverted branches. Only profile-guided layout emits these, where
+     * turning a branch around lets its more frequent side fall
+     * through. */
+    OP_POP_JUMP_IF_TRUE,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_LESS_UNCHECKED,
+    OP_JUMP_IF_GREATER_UNCHECKED,
+
+    /* Long forms, emitted only where an operand does not fit the
+     * regular one: a slot past 255 takes two bytes, and a jump
+     * farther than 65535 bytes takes three. */
+    OP_DEFINE_GLOBAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_JUMP_LONG,
+    OP_LOOP_LONG,
+    OP_POP_JUMP_IF_FALSE_LONG,
 } OpCode;
 
+/* OP_FOR_LOOP slot, step, limit kind, limit, offset (2 bytes) adds the
+ * constant step to local slot and loops back by offset while it is
+ * still below the limit. The kind says where the limit comes from, and
+ * with FOR_INCLUSIVE the loop also runs when they are equal. */
+typedef enum {
+    FOR_CONSTANT,
+    FOR_LOCAL,
+    FOR_GLOBAL,
+    FOR_INCLUSIVE = 4,
+} ForLimit;
+
+/* Lines are kept run-length encoded: a run starts at the first byte
+ * written on a new line and covers every byte up to the next run. */
+typedef struct {
+    int offset;
+    int line;
+} LineRun;
+
 typedef struct {
     int count;
     int capacity;
-    size_t* lines;
     uint8_t* code;
+    int line_count;
+    int line_capacity;
+    LineRun* lines;
+    int line_cache;     /* run get_line() last landed in */
     ValueArray constants;
+    int constant_capacity;
+    int* constant_slots;    /* hash of constants, -1 where empty */
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
 void free_chunk(Chunk* chunk);
+void truncate_chunk(Chunk* chunk, int count);
 size_t get_line(Chunk* chunk, size_t offset);
 void write_constant(Chunk* chunk, Value value, int line);
 size_t add_constant(Chunk* chunk, Value value);
+int instruction_length(uint8_t opcode);
+int stack_effect(uint8_t* code);
+int long_form(uint8_t opcode);
+uint8_t short_form(uint8_t opcode);
 
 #endif
\ No newline at end of file
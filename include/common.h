@@ -6,9 +6,35 @@
 #include <assert.h>
 #include <stdint.h>
 
+/* Release builds such as `make bench` define NDEBUG to turn off the
+ * tracing below. */
+#ifndef NDEBUG
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
+#endif
+/* Count executed opcode n-grams and report the best superinstruction
+ * candidates on exit. */
+// #define DEBUG_PROFILE_OPCODES
 
+/* Count which way every jump goes, so --profile-generate can record a
+ * branch profile. Off by default to keep the jumps in run() free of
+ * the check. */
+// #define PROFILE_BRANCHES
+
+/* Dispatch instructions through a table of label addresses instead
+ * of a switch. Needs GCC's labels-as-values extension; other compilers
+ * always get the portable switch. */
+#define COMPUTED_GOTO
+
+/* Pack every Value into one 64-bit word using the spare payload bits
+ * of a quiet NaN. Assumes pointers fit in 48 bits. */
+#define NAN_BOXING
+
+/* Keep the top of the VM stack in a local of run() across dispatch
+ * instead of in memory. */
+// #define TOS_CACHING
+
+#define UINT24_MAX 0xFFFFFF
 #define UINT16_COUNT (UINT16_MAX + 1)
 #define UINT8_COUNT (UINT8_MAX + 1)
 
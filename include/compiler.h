@@ -15,6 +15,9 @@ typedef struct {
     Token previous;
     bool had_error;
     bool panic_mode;
+    bool long_jumps;        /* emit forward jumps in their long form */
+    bool jump_overflow;     /* a short forward jump could not reach */
+    Table constants;        /* global constants declared by this source */
 } Parser;
 
 typedef enum {
@@ -40,13 +43,23 @@ typedef struct {
 typedef struct {
   Token name;
   int depth;
+  int type;             // type variable of its current value
+  bool constant;        // declared with const
+  Value value;          // of a constant known at compile time, or undefined
+  int shadowed;         // index of the local of the same name it hides, or -1
 } Local;
 
 typedef struct {
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int local_count;
+  int local_capacity;
+  Table local_names;    // name -> index of the innermost local called that
   int scope_depth;
-  
+  int last_instruction;
+  int last_label;
+  int expr_type;        // type variable of the last expression compiled
+  bool expr_constant;   // the last expression is known to be expr_value
+  Value expr_value;
 } Compiler;
 
 bool compile(const char* source, Chunk* chunk);
@@ -3,9 +3,13 @@
 
 #include <stdio.h>
 #include "chunk.h"
+#include "regvm.h"
 #include "value.h"
 
 void disassemble_chunk(Chunk *chunk, const char *name);
 int disassemble_instruction(Chunk *chunk, int offset);
+const char* opcode_name(uint8_t opcode);
+void disassemble_reg_chunk(RegChunk* chunk, const char* name);
+int disassemble_reg_instruction(RegChunk* chunk, int index);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef jit_h
+#define jit_h
+
+#include "chunk.h"
+#include "common.h"
+#include "stack.h"
+#include "x64.h"
+
+/* Baseline JIT. A whole chunk is translated into x86-64 machine code,
+ * one fixed template per opcode, with bytecode jumps turned into
+ * native branches. The templates work on NaN-boxed values and follow
+ * the System V calling convention, so everywhere else the JIT is left
+ * out and --jit runs the interpreter.
+ */
+#if defined(X64_NATIVE) && defined(NAN_BOXING)
+#define JIT_SUPPORTED
+#endif
+
+StackBody jit_compile(Chunk* chunk);
+void jit_free();
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "chunk.h"
+#include "profile.h"
+
+/* Profile-guided block layout. Reorders the basic blocks of a finished
+ * chunk so that the successor each block went on to more often in the
+ * training run comes right after it, inverting conditional jumps where
+ * that is their target, and moves code that never ran behind the rest.
+ * Leaves the chunk as it was if a jump would no longer fit its
+ * encoding.
+ */
+void layout_blocks(Chunk* chunk, BranchProfile* profile);
+
+#endif
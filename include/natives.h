@@ -0,0 +1,34 @@
+#ifndef NATIVES_H
+#define NATIVES_H
+
+#include "common.h"
+#include "value.h"
+
+/* Native string functions. There are no function values, so a call is
+ * resolved by name when it is compiled and OP_NATIVE names the native
+ * by its index in natives[]. Strings they return are slices of their
+ * argument where they can be, not copies.
+ *
+ *   substr(s, start, length)   length characters of s from start on
+ *   indexOf(s, needle)         where needle first starts in s, or -1
+ *   startsWith(s, prefix)      whether s starts with prefix
+ *   trim(s)                    s without surrounding whitespace
+ *   split(s, separator, n)     the nth field of s, from 0, or nil
+ */
+
+/* Sets result from the arguments, or returns false if they are not
+ * what the native takes. */
+typedef bool (*NativeFn)(Value* args, Value* result);
+
+typedef struct {
+    const char* name;
+    int arity;
+    const char* signature;  /* shown when the arguments are wrong */
+    NativeFn function;
+} Native;
+
+extern const Native natives[];
+
+int find_native(const char* name, int length);
+
+#endif
@@ -6,13 +6,21 @@
 #include "value.h"
 
 #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
-#define IS_STRING(value)        is_obj_type(value, OBJ_STRING)
+/* Any kind of string, short ones included. */
+#define IS_STRING(value) \
+    (IS_SHORT_STRING(value) || (IS_OBJ(value) && OBJ_TYPE(value) <= OBJ_SLICE))
+#define IS_ROPE(value)          is_obj_type(value, OBJ_ROPE)
+#define IS_SLICE(value)         is_obj_type(value, OBJ_SLICE)
 
-#define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
+/* Strings on the heap only. A rope or slice is copied out flat the
+ * first time an ObjString is asked for. */
+#define AS_STRING(value)        as_string(AS_OBJ(value))
+#define AS_CSTRING(value)       (AS_STRING(value)->chars)
 
 typedef enum {
   OBJ_STRING,
+  OBJ_ROPE,
+  OBJ_SLICE,
 } ObjType;
 
 struct Obj {
@@ -23,14 +31,66 @@ struct Obj {
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    bool hashed;
+    bool interned;
+    char chars[];
 };
 
-ObjString* take_string(char* chars, int length);
+/* A string built by + or * whose characters are not copied until they
+ * are needed. It holds left followed by right, or left repeated up to
+ * length when right is nil. Flattening copies the characters into flat
+ * and the rope forwards to it from then on. */
+typedef struct {
+    Obj obj;
+    int length;
+    Value left;
+    Value right;
+    ObjString* flat;
+} ObjRope;
+
+/* The length characters of parent from start on, shared rather than
+ * copied. flat is only made for callers that need an ObjString. */
+typedef struct {
+    Obj obj;
+    int length;
+    ObjString* parent;
+    int start;
+    ObjString* flat;
+} ObjSlice;
+
+/* Longest string +, * and interpolation build. Lengths are ints, so
+ * this leaves room to add any two of them without overflowing. */
+#define MAX_STRING_LENGTH (1 << 30)
+
+uint32_t hash_string(const char* key, int length);
+ObjString* allocate_string(int length);
+ObjString* intern_string(ObjString* string);
 ObjString* copy_string(const char* chars, int length);
+ObjString* flatten_string(Obj* string);
+Value string_value(const char* chars, int length);
+int string_length(Value string);
+const char* string_chars(Value string, char* buffer);
+Value string_slice(Value string, int start, int length);
+bool concatenate_strings(Value a, Value b, Value* result);
+bool repeat_string(Value string, double times, Value* result);
+bool join_values(Value* values, int count, Value* result);
 void print_object(Value value);
 
+static inline uint32_t string_hash(ObjString* string) {
+    if (!string->hashed) {
+        string->hash = hash_string(string->chars, string->length);
+        string->hashed = true;
+    }
+    return string->hash;
+}
+
+static inline ObjString* as_string(Obj* object) {
+    if (object->type == OBJ_STRING)
+        return (ObjString*)object;
+    return flatten_string(object);
+}
+
 static inline bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
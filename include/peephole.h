@@ -0,0 +1,14 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "chunk.h"
+
+/* Rewrites a finished chunk in place: jumps to jumps are threaded,
+ * values pushed only to be popped are dropped, and pairs the compiler
+ * emits for !=, >= and <= become single instructions. Jump offsets and
+ * line numbers are rebuilt to match. Leaves the chunk as it was if the
+ * result would not fit the 16-bit jump offsets.
+ */
+void optimize_peephole(Chunk* chunk);
+
+#endif
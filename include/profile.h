@@ -0,0 +1,43 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "chunk.h"
+#include "common.h"
+
+/* Branch counts for profile-guided block layout. A training run
+ * (--profile-generate, in a build with PROFILE_BRANCHES) counts, for
+ * every jump, how often it was taken and how often it fell through,
+ * and saves the counts to a file. A later run (--profile-use) reads
+ * them back for layout_blocks().
+ *
+ * A jump is identified by the offset just past it, so the counts only
+ * apply to the exact code they were recorded on. The file stores a
+ * hash of that code and is ignored if it does not match.
+ */
+typedef struct {
+    uint32_t hash;          /* of the code the counts belong to */
+    int count;              /* bytes of that code */
+    uint64_t* taken;
+    uint64_t* fallen;
+} BranchProfile;
+
+void init_branch_profile(BranchProfile* profile, Chunk* chunk);
+void free_branch_profile(BranchProfile* profile);
+void count_branch(BranchProfile* profile, int offset, bool taken);
+bool write_branch_profile(BranchProfile* profile, const char* path);
+bool read_branch_profile(BranchProfile* profile, const char* path);
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+/* Opcode n-gram profiler used to pick superinstructions. */
+
+#define PROFILE_MAX_NGRAM 4
+#define PROFILE_TABLE_SIZE 4096
+#define PROFILE_REPORT_COUNT 10
+
+void profile_instruction(uint8_t* code, uint8_t* ip);
+void print_profile();
+
+#endif
+
+#endif
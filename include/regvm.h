@@ -0,0 +1,69 @@
+#ifndef regvm_h
+#define regvm_h
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+/* Register-based backend. A compiled chunk is translated into
+ * three-operand instructions that read and write slots of a frame
+ * instead of pushing and popping a stack.
+ *
+ * The frame starts with the chunk's constants followed by nil, true
+ * and false, and the registers come after them, so every operand is a
+ * plain frame index and an instruction never has to ask whether it
+ * was given a constant or a register. Register n holds what stack
+ * slot n would hold, which puts each local in a fixed register.
+ */
+typedef enum {
+    ROP_MOVE,
+    ROP_NEGATE,
+    ROP_NOT,
+    ROP_ADD,
+    ROP_SUBTRACT,
+    ROP_MULTIPLY,
+    ROP_DIVIDE,
+    ROP_EQUAL,
+    ROP_GREATER,
+    ROP_LESS,
+    ROP_NOT_EQUAL,
+    ROP_GREATER_EQUAL,      /* !(b < c), as NaN needs */
+    ROP_LESS_EQUAL,         /* !(b > c) */
+    ROP_GET_GLOBAL,
+    ROP_SET_GLOBAL,
+    ROP_DEFINE_GLOBAL,
+    ROP_PRINT,
+    ROP_JUMP,
+    ROP_JUMP_IF_FALSE,
+    ROP_JUMP_IF_NOT_LESS,
+    ROP_JUMP_IF_NOT_GREATER,
+    ROP_RETURN,
+} RegOpCode;
+
+/* a is the destination: a frame index, a global slot, or for jumps
+ * the index of the target instruction. b and c are source frame
+ * indexes. */
+typedef struct {
+    uint8_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} RegInstruction;
+
+typedef struct {
+    int count;
+    int capacity;
+    Chunk* source;          /* the bytecode this was translated from */
+    RegInstruction* code;
+    int* offsets;           /* offset of the bytecode each came from */
+    int constant_count;     /* frame slots before the first register */
+    int register_count;
+} RegChunk;
+
+void init_reg_chunk(RegChunk* chunk);
+void free_reg_chunk(RegChunk* chunk);
+Value frame_constant(RegChunk* chunk, int index);
+bool compile_registers(Chunk* chunk, RegChunk* reg_chunk);
+InterpretResult run_registers(RegChunk* chunk);
+
+#endif
@@ -17,11 +17,13 @@ typedef enum {
     TOKEN_GREATER, TOKEN_GREATER_EQUAL,
     TOKEN_LESS, TOKEN_LESS_EQUAL,
 
-    // Literals.
-    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+    // Literals. A string with ${expression} in it is scanned as an
+    // interpolation token for each part ending in ${, then the tokens
+    // of the expression, with the closing } starting the next part.
+    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER, TOKEN_INTERPOLATION,
 
     // Keywords.
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
+    TOKEN_AND, TOKEN_CLASS, TOKEN_CONST, TOKEN_ELSE, TOKEN_FALSE,
     TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_BREAK,
@@ -33,6 +35,7 @@ typedef struct {
     const char *start;
     const char *current;
     int line;
+    int interpolations;     // ${ still waiting for their }
 } Scanner;
 
 typedef struct {
@@ -4,21 +4,54 @@
 
 
 #define STACK_MAX 0xFFFF
-#define DEFAULT_STACK_SIZE 8
-#define STACK_GROWTH_FACTOR 2
 
 #include "value.h"
 
+/* On POSIX systems the stack is a fixed mmap() reservation followed by
+ * an inaccessible guard page, so push() needs no capacity check: a
+ * push past the end faults, and the fault is turned into a runtime
+ * error by stack_guarded_call(). Elsewhere the stack is a plain
+ * STACK_MAX allocation, and push() checks it is not full.
+ *
+ * data[-1] is always a valid scratch slot, so an interpreter that
+ * caches the top of the stack in a register can spill that cache
+ * without first checking whether the stack is empty. */
+#if defined(__unix__) || defined(__APPLE__)
+#define STACK_GUARD_PAGE
+#endif
+
 typedef struct Stack {
     Value *data;
     Value *top;
-    int size;
+    size_t reserved;   // bytes, including the data[-1] scratch slot
 } Stack;
 
+typedef int (*StackBody)();
+
 void init_stack(Stack* stack);
 void free_stack(Stack* stack);
-void push(Stack* stack, Value value);
-Value pop(Stack* stack);
-Value peek(Stack *stack, int depth);
+void reset_stack(Stack* stack);
+int stack_capacity(Stack* stack);
+bool stack_guarded_call(Stack* stack, StackBody body, int* result);
+
+#ifndef STACK_GUARD_PAGE
+void stack_overflow();
+#endif
+
+static inline void push(Stack* stack, Value value) {
+#ifndef STACK_GUARD_PAGE
+    if (stack->top == stack->data + STACK_MAX)
+        stack_overflow();
+#endif
+    *stack->top++ = value;
+}
+
+static inline Value pop(Stack* stack) {
+    return *--stack->top;
+}
+
+static inline Value peek(Stack* stack, int depth) {
+    return stack->top[-1 - depth];
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,25 @@
+#ifndef trace_h
+#define trace_h
+
+#include "common.h"
+#include "x64.h"
+
+/* Tracing JIT for loops. Every back-edge bumps a counter for its loop,
+ * and once a loop is hot one iteration is recorded as a linear trace.
+ * The trace is compiled to x86-64 code that keeps the loop's variables
+ * as unboxed doubles in registers, with a guard wherever the recorded
+ * path could go another way. A failing guard leaves the loop through a
+ * side exit that hands the interpreter back the stack it would have had
+ * at that point.
+ *
+ * Values only cross into or out of native code through the C entry
+ * and exit handlers, so traces work with either Value representation.
+ */
+#ifdef X64_NATIVE
+#define TRACING_SUPPORTED
+#endif
+
+uint8_t* trace_loop(uint8_t* header);
+void trace_free();
+
+#endif
@@ -10,19 +10,101 @@ typedef struct ObjString ObjString;
 #define MAX_REPRESENTABLE_CONST 0xFFFF // 16-bits
 #define INITIAL_VAL_ARRAY_SIZE 8
 
+#ifdef NAN_BOXING
+
+/* Every Value is a single 64-bit word. Numbers are stored as plain
+ * doubles; everything else hides in the payload of a quiet NaN.
+ * Objects additionally set the sign bit and keep their pointer in
+ * the low 48 bits, while singletons use the small tags below.
+ */
+#define SIGN_BIT    ((uint64_t)0x8000000000000000)
+#define QNAN        ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL     1 // 01.
+#define TAG_FALSE   2 // 10.
+#define TAG_TRUE    3 // 11.
+#define TAG_UNDEFINED 4 // 100.
+
+/* Strings of up to six characters live in the payload itself, one per
+ * byte from the lowest up, under the top payload bit. The first zero
+ * byte ends them. */
+#define SHORT_STRING_BIT ((uint64_t)1 << 49)
+#define SHORT_STRING_MAX 6
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_SHORT_STRING(value) \
+    (((value) & (SIGN_BIT | QNAN | SHORT_STRING_BIT)) == (QNAN | SHORT_STRING_BIT))
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    value_to_num(value)
+#define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define BOOL_VAL(value)     ((Value)(FALSE_VAL | (uint64_t)!!(value)))
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(value)   num_to_value(value)
+#define OBJ_VAL(object)     ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+
+static inline double value_to_num(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value num_to_value(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+static inline Value short_string_val(const char* chars, int length) {
+    Value value = QNAN | SHORT_STRING_BIT;
+    for (int i = 0; i < length; i++)
+        value |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+    return value;
+}
+
+static inline int short_string_length(Value value) {
+    int length = 0;
+    while (length < SHORT_STRING_MAX && ((value >> (8 * length)) & 0xFF) != 0)
+        length++;
+    return length;
+}
+
+/* Fills all SHORT_STRING_MAX bytes, with zeroes past the end. */
+static inline void short_string_chars(Value value, char* chars) {
+    for (int i = 0; i < SHORT_STRING_MAX; i++)
+        chars[i] = (char)(value >> (8 * i));
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_SHORT_STRING,
+    VAL_UNDEFINED
 } ValueType;
 
+/* Strings of up to eight characters are kept in chars, padded with
+ * zeroes, which also end them. */
+#define SHORT_STRING_MAX 8
+
 typedef struct {
     ValueType type;
     union {
         bool boolean;
         double number;
         Obj* obj;
+        char chars[SHORT_STRING_MAX];
     } as;
 } Value;
 
@@ -30,6 +112,8 @@ typedef struct {
 #define IS_NIL(value)      ((value).type == VAL_NIL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_SHORT_STRING(value) ((value).type == VAL_SHORT_STRING)
 #define AS_BOOL(value)      ((value).as.boolean)
 #define AS_NUMBER(value)    ((value).as.number)
 #define AS_OBJ(value)       ((value).as.obj)
@@ -37,6 +121,39 @@ typedef struct {
 #define NIL_VAL            ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)      ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL      ((Value){VAL_UNDEFINED, {.number = 0}})
+
+static inline Value short_string_val(const char* chars, int length) {
+    Value value;
+    value.type = VAL_SHORT_STRING;
+    memset(value.as.chars, 0, SHORT_STRING_MAX);
+    memcpy(value.as.chars, chars, length);
+    return value;
+}
+
+static inline int short_string_length(Value value) {
+    int length = 0;
+    while (length < SHORT_STRING_MAX && value.as.chars[length] != '\0')
+        length++;
+    return length;
+}
+
+/* Fills all SHORT_STRING_MAX bytes, with zeroes past the end. */
+static inline void short_string_chars(Value value, char* chars) {
+    memcpy(chars, value.as.chars, SHORT_STRING_MAX);
+}
+
+#endif
+
+/* A string can be short if it fits and has no zero byte, which would
+ * read as its end. Every string that can be short is, so two strings
+ * of which one is short are equal only if their bits are. */
+static inline bool fits_short_string(const char* chars, int length) {
+    return length <= SHORT_STRING_MAX && memchr(chars, '\0', length) == NULL;
+}
+
+/* UNDEFINED_VAL never reaches Lox code. It marks a global slot that the
+ * compiler has handed out but no declaration has filled yet. */
 
 typedef struct {
     int capacity;
@@ -48,7 +165,56 @@ void init_value_array(ValueArray *array);
 void write_value_array(ValueArray *array, Value value);
 void free_value_array(ValueArray *array);
 void print_value(Value value);
-bool values_equal(Value a, Value b);
-bool is_falsey(Value value);
+bool objects_equal(Obj* a, Obj* b);
+
+#ifdef NAN_BOXING
+
+/* Everything but numbers and strings is equal exactly when the bits
+ * are, so only a pair of numbers needs a floating point compare
+ * (NaN != NaN) and only a pair of objects a closer look. */
+static inline bool values_equal(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    if (a == b)
+        return true;
+    return IS_OBJ(a) && IS_OBJ(b) && objects_equal(AS_OBJ(a), AS_OBJ(b));
+}
+
+/* nil and false sit next to each other, and both zeroes are all
+ * payload bits clear once the sign is shifted out. */
+static inline bool is_falsey(Value value) {
+    return (value - NIL_VAL) <= (FALSE_VAL - NIL_VAL) || (value << 1) == 0;
+}
+
+#else
+
+static inline bool values_equal(Value a, Value b) {
+    if (a.type != b.type)
+        return false;
+    
+    switch (a.type) {
+        case VAL_BOOL:
+            return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL:
+            return true;
+        case VAL_NUMBER:
+            return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b) ||
+                objects_equal(AS_OBJ(a), AS_OBJ(b));
+        case VAL_SHORT_STRING:
+            return memcmp(a.as.chars, b.as.chars, SHORT_STRING_MAX) == 0;
+        default:
+            return false;
+    }
+}
+
+static inline bool is_falsey(Value value) {
+    return IS_NIL(value) || 
+        (IS_BOOL(value) && !AS_BOOL(value)) ||
+        (IS_NUMBER(value) && AS_NUMBER(value) == 0);
+}
+
+#endif
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define vm_h
 
 #include "object.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 #include "stack.h"
@@ -18,8 +19,22 @@ typedef struct {
     uint8_t *ip;
     Stack stack;
     Table strings;
-    Table globals;
+    /* Globals are resolved to dense slots at compile time. global_slots
+     * maps each name to its slot index, global_names maps it back for
+     * error messages, and globals holds the values themselves. */
+    Table global_slots;
+    ValueArray global_names;
+    ValueArray globals;
+    /* Each global declared with const, mapped to its value, or to
+     * UNDEFINED_VAL where that is only known at run time. */
+    Table global_constants;
     Obj* objects;
+    bool use_registers;     /* run through the register backend */
+    bool use_jit;           /* run as machine code where supported */
+    bool jit_perf_map;      /* describe JIT code in /tmp/perf-<pid>.map */
+    const char* profile_out;    /* record branch counts into this file */
+    const char* profile_in;     /* lay out code by the counts in this file */
+    BranchProfile* branches;    /* counts being recorded, or NULL */
 } VM;
 
 extern VM vm;
@@ -27,4 +42,6 @@ extern VM vm;
 void init_vm();
 void free_vm();
 InterpretResult interpret(const char* source);
+int global_slot(ObjString* name);
+void runtime_error(const char* format, ...);
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef x64_h
+#define x64_h
+
+#include "common.h"
+
+/* A growable buffer of x86-64 machine code, shared by the JITs. Code
+ * is emitted as raw bytes, mostly through EMIT() with the instruction
+ * spelled out in a comment next to it, and is position independent:
+ * branches are rel32 and anything absolute is loaded as an imm64.
+ */
+#if defined(__x86_64__) && defined(__linux__)
+#define X64_NATIVE
+#endif
+
+typedef struct {
+    uint8_t* bytes;
+    int count;
+    int capacity;
+} CodeBuffer;
+
+/* General purpose registers by encoding. */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+
+/* Second opcode byte of the rel32 form of jcc. */
+#define JB  0x82
+#define JAE 0x83
+#define JE  0x84
+#define JNE 0x85
+#define JBE 0x86
+#define JA  0x87
+
+void init_code_buffer(CodeBuffer* buffer);
+void free_code_buffer(CodeBuffer* buffer);
+void emit_code(CodeBuffer* buffer, const uint8_t* bytes, int count);
+void emit_u32(CodeBuffer* buffer, uint32_t value);
+void emit_u64(CodeBuffer* buffer, uint64_t value);
+void emit_mov_imm64(CodeBuffer* buffer, int reg, uint64_t value);
+int emit_jcc(CodeBuffer* buffer, uint8_t condition);
+int emit_jmp(CodeBuffer* buffer);
+void patch_rel32(CodeBuffer* buffer, int position, int target);
+void patch_here(CodeBuffer* buffer, int position);
+uint8_t* map_code(CodeBuffer* buffer, size_t* size);
+void unmap_code(uint8_t* code, size_t size);
+
+#define EMIT(buffer, ...) \
+    emit_code(buffer, (const uint8_t[]){ __VA_ARGS__ }, \
+        sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+#endif
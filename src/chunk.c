@@ -1,4 +1,6 @@
 #include "chunk.h"
+#include "natives.h"
+#include "table.h"
 
 
 /* Initialize an empty chunk with a default size of
@@ -7,18 +9,30 @@ void init_chunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = INITIAL_CHUNK_SIZE;
 
-    /* Initializes the chunk code array (and line array). */
+    /* Initializes the chunk code array. Line runs are allocated on the
+       first write. */
     chunk->code = GROW_ARRAY(uint8_t, NULL, 0, INITIAL_CHUNK_SIZE);
-    chunk->lines = GROW_ARRAY(size_t, NULL, 0, INITIAL_CHUNK_SIZE);
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
+    chunk->lines = NULL;
+    chunk->line_cache = 0;
     init_value_array(&chunk->constants);
+    chunk->constant_capacity = 0;
+    chunk->constant_slots = NULL;
 }
 
 void free_chunk(Chunk* chunk) {
     chunk->code = FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    chunk->lines = FREE_ARRAY(size_t, chunk->lines, chunk->capacity);
+    chunk->lines = FREE_ARRAY(LineRun, chunk->lines, chunk->line_capacity);
     chunk->count = 0;
     chunk->capacity = 0;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
+    chunk->line_cache = 0;
     free_value_array(&chunk->constants);
+    chunk->constant_slots = FREE_ARRAY(int, chunk->constant_slots,
+                                       chunk->constant_capacity);
+    chunk->constant_capacity = 0;
 }
 
 void write_chunk(Chunk* chunk, uint8_t byte, int line) {
@@ -26,34 +40,302 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line) {
         int old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(size_t, chunk->lines, old_capacity, chunk->capacity);
+    }
+
+    if (chunk->line_count == 0 ||
+        chunk->lines[chunk->line_count - 1].line != line) {
+        if (chunk->line_capacity < chunk->line_count + 1) {
+            int old_capacity = chunk->line_capacity;
+            chunk->line_capacity = GROW_CAPACITY(old_capacity);
+            chunk->lines = GROW_ARRAY(LineRun, chunk->lines, old_capacity,
+                                      chunk->line_capacity);
+        }
+        LineRun* run = &chunk->lines[chunk->line_count++];
+        run->offset = chunk->count;
+        run->line = line;
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
+/* Drops every byte from count on, along with the line runs that only
+   covered them. */
+void truncate_chunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    while (chunk->line_count > 0 &&
+           chunk->lines[chunk->line_count - 1].offset >= count)
+        chunk->line_count--;
+    if (chunk->line_cache >= chunk->line_count)
+        chunk->line_cache = 0;
+}
+
+/* Two constants are the same when they print and behave the same, so
+   0 and -0 stay apart while a NaN matches itself. Literals are short or
+   interned, which makes the bits enough for them. */
+#ifdef NAN_BOXING
+static uint64_t constant_bits(Value value) {
+    return value;
+}
+#else
+static uint64_t constant_bits(Value value) {
+    uint64_t bits = 0;
+    switch (value.type) {
+        case VAL_BOOL: bits = value.as.boolean; break;
+        case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+        case VAL_OBJ: bits = (uint64_t)(uintptr_t)value.as.obj; break;
+        case VAL_SHORT_STRING: memcpy(&bits, value.as.chars, SHORT_STRING_MAX); break;
+        default: break;
+    }
+    return (bits << 3 | bits >> 61) ^ value.type;
+}
+#endif
+
+static bool same_constant(Value a, Value b) {
+#ifndef NAN_BOXING
+    if (a.type != b.type)
+        return false;
+#endif
+    return constant_bits(a) == constant_bits(b);
+}
+
+/* Object pointers keep their low bits clear, so the bits are mixed
+   before they pick a slot. */
+static uint32_t hash_constant(Value value) {
+    uint64_t bits = constant_bits(value);
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+/* The slot holding value, or the empty slot it would go in. */
+static int* find_constant(Chunk* chunk, Value value) {
+    int mask = chunk->constant_capacity - 1;
+    int index = hash_constant(value) & mask;
+    for (;;) {
+        int* slot = &chunk->constant_slots[index];
+        if (*slot == -1 || same_constant(chunk->constants.values[*slot], value))
+            return slot;
+        index = (index + 1) & mask;
+    }
+}
+
+static void grow_constant_slots(Chunk* chunk) {
+    FREE_ARRAY(int, chunk->constant_slots, chunk->constant_capacity);
+    chunk->constant_capacity = GROW_CAPACITY(chunk->constant_capacity);
+    chunk->constant_slots = ALLOCATE(int, chunk->constant_capacity);
+    for (int i = 0; i < chunk->constant_capacity; i++)
+        chunk->constant_slots[i] = -1;
+    for (int i = 0; i < chunk->constants.count; i++)
+        *find_constant(chunk, chunk->constants.values[i]) = i;
+}
+
+/* Identical constants share one slot in the pool. */
 size_t add_constant(Chunk *chunk, Value value) {
+    if (chunk->constants.count + 1 > chunk->constant_capacity * TABLE_MAX_LOAD)
+        grow_constant_slots(chunk);
+
+    int* slot = find_constant(chunk, value);
+    if (*slot != -1)
+        return *slot;
+
     write_value_array(&chunk->constants, value);
-    return chunk->constants.count - 1; // index of constant in values
+    *slot = chunk->constants.count - 1; // index of constant in values
+    return *slot;
 }
 
 void write_constant(Chunk *chunk, Value value, int line) {
     // Add value to chunk's constant array
     // Write instruction to chunk to handle value size (CONSTANT / CONSTANT_LONG)
 
-    uint16_t index = add_constant(chunk, value);
-    uint8_t left_bits = (index & 0xFF00) >> 8;
-    if(left_bits > 0) { // CONST_LONG
+    uint32_t index = add_constant(chunk, value);
+    if(index > UINT8_MAX) { // CONST_LONG
         write_chunk(chunk, OP_CONSTANT_LONG, line);
-        write_chunk(chunk, left_bits, line);
+        write_chunk(chunk, (index >> 16) & 0xFF, line);
+        write_chunk(chunk, (index >> 8) & 0xFF, line);
     } else {
         write_chunk(chunk, OP_CONSTANT, line);
     }
     write_chunk(chunk, index & 0x00FF, line);
 }
 
+static bool run_covers(Chunk* chunk, int run, size_t offset) {
+    return (size_t)chunk->lines[run].offset <= offset &&
+           (run + 1 == chunk->line_count ||
+            (size_t)chunk->lines[run + 1].offset > offset);
+}
+
+/* Binary search over the runs. The disassembler and the tracer walk the
+   chunk front to back, so the run of the last lookup and the one after
+   it are tried first. */
 size_t get_line(Chunk* chunk, size_t offset) {
-    return chunk->lines[offset];
+    if (chunk->line_count == 0)
+        return 0;
+
+    int cache = chunk->line_cache;
+    if (run_covers(chunk, cache, offset))
+        return chunk->lines[cache].line;
+    if (cache + 1 < chunk->line_count && run_covers(chunk, cache + 1, offset)) {
+        chunk->line_cache = cache + 1;
+        return chunk->lines[cache + 1].line;
+    }
+
+    int low = 0;
+    int high = chunk->line_count - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if ((size_t)chunk->lines[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    chunk->line_cache = low;
+    return chunk->lines[low].line;
+}
+
+/* Size in bytes of an instruction, operands included. */
+int instruction_length(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_POP:
+        case OP_ADD_N:
+        case OP_INTERPOLATE:
+        case OP_NATIVE:
+            return 2;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_GET_LOCALS:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_LESS_UNCHECKED:
+        case OP_JUMP_IF_GREATER_UNCHECKED:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_LOCAL_LONG:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return 4;
+        case OP_FOR_LOOP:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+/* How many values the instruction at code leaves on the stack beyond
+ * those it takes off. A conditional jump has the same effect whether
+ * or not it is taken. */
+int stack_effect(uint8_t* code) {
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+            return 1;
+        case OP_GET_LOCALS:
+            return 2;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_MULTIPLY_NUM:
+        case OP_ADD_UNCHECKED:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_DIVIDE_UNCHECKED:
+        case OP_LESS_UNCHECKED:
+        case OP_GREATER_UNCHECKED:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_POP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_TRUE:
+            return -1;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_LESS_UNCHECKED:
+        case OP_JUMP_IF_GREATER_UNCHECKED:
+            return -2;
+        case OP_ADD_N:
+        case OP_INTERPOLATE:
+            return 1 - code[1];
+        case OP_NATIVE:
+            return 1 - natives[code[1]].arity;
+        default:
+            return 0;
+    }
+}
+
+/* The form of opcode with a wider operand, or -1 if it has none. */
+int long_form(uint8_t opcode) {
+    switch (opcode) {
+        case OP_DEFINE_GLOBAL: return OP_DEFINE_GLOBAL_LONG;
+        case OP_GET_GLOBAL: return OP_GET_GLOBAL_LONG;
+        case OP_SET_GLOBAL: return OP_SET_GLOBAL_LONG;
+        case OP_SET_LOCAL: return OP_SET_LOCAL_LONG;
+        case OP_GET_LOCAL: return OP_GET_LOCAL_LONG;
+        case OP_JUMP_IF_FALSE: return OP_JUMP_IF_FALSE_LONG;
+        case OP_JUMP: return OP_JUMP_LONG;
+        case OP_LOOP: return OP_LOOP_LONG;
+        case OP_POP_JUMP_IF_FALSE: return OP_POP_JUMP_IF_FALSE_LONG;
+        default: return -1;
+    }
+}
+
+/* The regular form of a long instruction. Anything else is returned
+ * as it is. */
+uint8_t short_form(uint8_t opcode) {
+    switch (opcode) {
+        case OP_DEFINE_GLOBAL_LONG: return OP_DEFINE_GLOBAL;
+        case OP_GET_GLOBAL_LONG: return OP_GET_GLOBAL;
+        case OP_SET_GLOBAL_LONG: return OP_SET_GLOBAL;
+        case OP_SET_LOCAL_LONG: return OP_SET_LOCAL;
+        case OP_GET_LOCAL_LONG: return OP_GET_LOCAL;
+        case OP_JUMP_IF_FALSE_LONG: return OP_JUMP_IF_FALSE;
+        case OP_JUMP_LONG: return OP_JUMP;
+        case OP_LOOP_LONG: return OP_LOOP;
+        case OP_POP_JUMP_IF_FALSE_LONG: return OP_POP_JUMP_IF_FALSE;
+        default: return opcode;
+    }
 }
\ No newline at end of file
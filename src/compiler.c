@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "compiler.h"
+#include "natives.h"
+#include "peephole.h"
 #include "value.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -13,7 +15,6 @@ static Compiler* current = NULL;
 
 static void advance();
 static void init_compiler(Compiler* compiler);
-static bool identifiers_equal(Token* a, Token* b);
 static void add_local(Token name);
 static int resolve_local(Compiler* compiler, Token* name);
 static void expression();
@@ -26,15 +27,24 @@ static void consume(TokenType token, const char* message);
 static void end_compiler();
 static void emit_byte(uint8_t byte);
 static void emit_bytes(uint8_t byte1, uint8_t byte2);
+static void emit_slot(uint8_t op, int slot);
+static void emit_op(uint8_t op);
+static int mark_label();
+static bool last_instruction_is(uint8_t op);
+static void emit_pop();
+static int emit_condition_jump();
 static Chunk* current_chunk();
 static void emit_return();
 static void emit_constant(Value value);
-static uint16_t make_constant(Value value);
+static void emit_folded(Value value);
+static void discard_code(int offset);
+static uint32_t make_constant(Value value);
 static void number(bool can_assign);
 static void grouping(bool can_assign);
 static void binary(bool can_assign);
 static void unary(bool can_assign);
 static void string(bool can_assign);
+static void interpolation(bool can_assign);
 static void declaration();
 static void statement();
 static void print_statement();
@@ -42,10 +52,11 @@ static void mark_initialized();
 static void expression_statement();
 static void synchronize();
 static void var_declaration();
-static uint8_t parse_variable(const char* error_message);
+static void const_declaration();
+static int parse_variable(const char* error_message);
 static bool match(TokenType type);
 static bool check(TokenType type);
-static uint8_t identifier_constant(Token* name);
+static int resolve_global(Token* name);
 static ParseRule* get_rule(TokenType type);
 static void variable(bool can_assign);
 static void named_variable(Token name, bool can_assign);
@@ -83,8 +94,10 @@ ParseRule rules[] = {
   [TOKEN_IDENTIFIER]    = {variable,     NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
+  [TOKEN_INTERPOLATION] = {interpolation, NULL, PREC_NONE},
   [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_CONST]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
@@ -103,15 +116,265 @@ ParseRule rules[] = {
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
+/* Type inference. Each value the compiler sees has a type variable,
+ * true while the value is proven to be a number. TYPE_UNKNOWN and
+ * TYPE_NUMBER are fixed; every other variable starts out true and
+ * depends on others through edges, each saying "to is a number only if
+ * from is". An arithmetic result depends on its operands, and a local
+ * where control flow joins depends on its value along every path.
+ *
+ * A loop's back edge is only seen after its body has been compiled, so
+ * every arithmetic instruction is recorded along with the type of its
+ * operands and nothing is decided until the chunk is finished. Then
+ * resolve_types() makes false everything that depends on something
+ * false, and rewrites the instructions whose operands are still
+ * numbers into their unchecked forms. Where inference is unsure the
+ * generic instruction, with its checks, stays.
+ */
+#define TYPE_UNKNOWN 0
+#define TYPE_NUMBER 1
+
+typedef struct {
+    int from;
+    int to;
+} TypeEdge;
+
+typedef struct {
+    int offset;         // of the arithmetic instruction
+    int type;           // of its operands
+} TypedSite;
+
+static struct {
+    bool* number;
+    int count;
+    int capacity;
+    TypeEdge* edges;
+    int edge_count;
+    int edge_capacity;
+    TypedSite* sites;
+    int site_count;
+    int site_capacity;
+    int* saved;         // stack of saved types of the locals
+    int saved_count;
+    int saved_capacity;
+} types;
+
+static void init_types() {
+    types.number = NULL;
+    types.count = types.capacity = 0;
+    types.edges = NULL;
+    types.edge_count = types.edge_capacity = 0;
+    types.sites = NULL;
+    types.site_count = types.site_capacity = 0;
+    types.saved = NULL;
+    types.saved_count = types.saved_capacity = 0;
+}
+
+static void free_types() {
+    FREE_ARRAY(bool, types.number, types.capacity);
+    FREE_ARRAY(TypeEdge, types.edges, types.edge_capacity);
+    FREE_ARRAY(TypedSite, types.sites, types.site_capacity);
+    FREE_ARRAY(int, types.saved, types.saved_capacity);
+    init_types();
+}
+
+static int new_type(bool number) {
+    if (types.capacity < types.count + 1) {
+        int old_capacity = types.capacity;
+        types.capacity = GROW_CAPACITY(old_capacity);
+        types.number = GROW_ARRAY(bool, types.number, old_capacity,
+            types.capacity);
+    }
+    types.number[types.count] = number;
+    return types.count++;
+}
+
+static void add_type_edge(int from, int to) {
+    if (from == TYPE_NUMBER || from == to)
+        return;
+    if (types.edge_capacity < types.edge_count + 1) {
+        int old_capacity = types.edge_capacity;
+        types.edge_capacity = GROW_CAPACITY(old_capacity);
+        types.edges = GROW_ARRAY(TypeEdge, types.edges, old_capacity,
+            types.edge_capacity);
+    }
+    types.edges[types.edge_count].from = from;
+    types.edges[types.edge_count].to = to;
+    types.edge_count++;
+}
+
+/* A type that holds while both a and b do: the type of the operands of
+ * a binary instruction, or of a local where two paths join. */
+static int both_types(int a, int b) {
+    if (a == TYPE_UNKNOWN || b == TYPE_UNKNOWN)
+        return TYPE_UNKNOWN;
+    if (a == TYPE_NUMBER || a == b)
+        return b;
+    if (b == TYPE_NUMBER)
+        return a;
+
+    int type = new_type(true);
+    add_type_edge(a, type);
+    add_type_edge(b, type);
+    return type;
+}
+
+/* Records that the instruction just emitted has operands of type. */
+static void add_typed_site(int type) {
+    if (type == TYPE_UNKNOWN)
+        return;
+    if (types.site_capacity < types.site_count + 1) {
+        int old_capacity = types.site_capacity;
+        types.site_capacity = GROW_CAPACITY(old_capacity);
+        types.sites = GROW_ARRAY(TypedSite, types.sites, old_capacity,
+            types.site_capacity);
+    }
+    types.sites[types.site_count].offset = current->last_instruction;
+    types.sites[types.site_count].type = type;
+    types.site_count++;
+}
+
+/* Saved types live on a stack and are named by where they start on
+ * it. A statement drops what it saved with drop_types() once done, so
+ * the locals declared inside it are gone by then and never outnumber
+ * the saved ones. */
+static int push_types() {
+    int count = current->local_count;
+    if (types.saved_capacity < types.saved_count + count) {
+        int old_capacity = types.saved_capacity;
+        while (types.saved_capacity < types.saved_count + count)
+            types.saved_capacity = GROW_CAPACITY(types.saved_capacity);
+        types.saved = GROW_ARRAY(int, types.saved, old_capacity,
+            types.saved_capacity);
+    }
+    int saved = types.saved_count;
+    types.saved_count += count;
+    return saved;
+}
+
+static void drop_types(int saved) {
+    types.saved_count = saved;
+}
+
+static int save_types() {
+    int saved = push_types();
+    for (int i = 0; i < current->local_count; i++)
+        types.saved[saved + i] = current->locals[i].type;
+    return saved;
+}
+
+static void restore_types(int saved) {
+    for (int i = 0; i < current->local_count; i++)
+        current->locals[i].type = types.saved[saved + i];
+}
+
+/* Joins the path that ended with the types in other into this one. */
+static void join_types(int other) {
+    for (int i = 0; i < current->local_count; i++)
+        current->locals[i].type = both_types(current->locals[i].type,
+            types.saved[other + i]);
+}
+
+/* Gives every local a new type at a jump target whose other incoming
+ * paths are not compiled yet, and saves them for close_loop_types() to
+ * add those paths to. Unless entered, the code before the target does
+ * not fall into it. */
+static int open_loop_types(bool entered) {
+    int header = push_types();
+    for (int i = 0; i < current->local_count; i++) {
+        int type = current->locals[i].type;
+        types.saved[header + i] = TYPE_UNKNOWN;
+        if (!entered || type != TYPE_UNKNOWN) {
+            types.saved[header + i] = new_type(true);
+            if (entered)
+                add_type_edge(type, types.saved[header + i]);
+            current->locals[i].type = types.saved[header + i];
+        }
+    }
+    return header;
+}
+
+/* Adds the path jumping back to header from here. */
+static void close_loop_types(int header) {
+    for (int i = 0; i < current->local_count; i++) {
+        if (types.saved[header + i] != TYPE_UNKNOWN)
+            add_type_edge(current->locals[i].type, types.saved[header + i]);
+    }
+}
+
+static uint8_t unchecked_form(uint8_t op) {
+    switch (op) {
+        case OP_NEGATE: return OP_NEGATE_UNCHECKED;
+        case OP_ADD: return OP_ADD_UNCHECKED;
+        case OP_SUBTRACT: return OP_SUBTRACT_UNCHECKED;
+        case OP_MULTIPLY: return OP_MULTIPLY_UNCHECKED;
+        case OP_DIVIDE: return OP_DIVIDE_UNCHECKED;
+        case OP_LESS: return OP_LESS_UNCHECKED;
+        case OP_GREATER: return OP_GREATER_UNCHECKED;
+        case OP_JUMP_IF_NOT_LESS: return OP_JUMP_IF_NOT_LESS_UNCHECKED;
+        case OP_JUMP_IF_NOT_GREATER: return OP_JUMP_IF_NOT_GREATER_UNCHECKED;
+        default: return op;
+    }
+}
+
+/* Spreads false along the edges from every type that starts out
+ * false, visiting each edge once. */
+static void resolve_types() {
+    int* first = ALLOCATE(int, types.count + 1);
+    int* targets = ALLOCATE(int, types.edge_count);
+    int* pending = ALLOCATE(int, types.count);
+    memset(first, 0, sizeof(int) * (types.count + 1));
+    for (int i = 0; i < types.edge_count; i++)
+        first[types.edges[i].from]++;
+    for (int type = 1; type < types.count; type++)
+        first[type] += first[type - 1];
+    for (int i = 0; i < types.edge_count; i++)
+        targets[--first[types.edges[i].from]] = types.edges[i].to;
+    first[types.count] = types.edge_count;
+
+    /* The edges out of type are now targets[first[type]] up to
+     * targets[first[type + 1]]. */
+    int pending_count = 0;
+    for (int type = 0; type < types.count; type++) {
+        if (!types.number[type])
+            pending[pending_count++] = type;
+    }
+    while (pending_count > 0) {
+        int from = pending[--pending_count];
+        for (int i = first[from]; i < first[from + 1]; i++) {
+            if (types.number[targets[i]]) {
+                types.number[targets[i]] = false;
+                pending[pending_count++] = targets[i];
+            }
+        }
+    }
+    FREE_ARRAY(int, first, types.count + 1);
+    FREE_ARRAY(int, targets, types.edge_count);
+    FREE_ARRAY(int, pending, types.count);
+
+    uint8_t* code = current_chunk()->code;
+    for (int i = 0; i < types.site_count; i++) {
+        TypedSite* site = &types.sites[i];
+        if (types.number[site->type])
+            code[site->offset] = unchecked_form(code[site->offset]);
+    }
+}
+
+
 /* Compiler. Takes the scanned tokens from the scanner
  * and interprets their symbols into bytecode.
  */
-bool compile(const char* source, Chunk* chunk) {
+static bool compile_chunk(const char* source, Chunk* chunk) {
     init_scanner(source);
     Compiler compiler;
     init_compiler(&compiler);
+    init_types();
+    new_type(false);    /* TYPE_UNKNOWN */
+    new_type(true);     /* TYPE_NUMBER */
     parser.compiling_chunk = chunk;
     parser.had_error = parser.panic_mode = false;
+    parser.jump_overflow = false;
+    init_table(&parser.constants);
     advance();
 
     while(!match(TOKEN_EOF)) {
@@ -119,12 +382,35 @@ bool compile(const char* source, Chunk* chunk) {
     }
 
     end_compiler();
+    /* Constants only outlive a chunk that is going to run. */
+    if (!parser.had_error && !parser.jump_overflow)
+        table_add_all(&parser.constants, &vm.global_constants);
+    free_table(&parser.constants);
+    FREE_ARRAY(Local, compiler.locals, compiler.local_capacity);
+    free_table(&compiler.local_names);
     return !parser.had_error;
 }
 
+bool compile(const char* source, Chunk* chunk) {
+    parser.long_jumps = false;
+    if (!compile_chunk(source, chunk) || !parser.jump_overflow)
+        return !parser.had_error;
+
+    /* A forward jump is emitted before the code it skips, so by the
+     * time one turns out not to fit there is no room left to widen
+     * it. The chunk is compiled again with every forward jump in its
+     * long form, and the peephole pass shortens those that fit. */
+    free_chunk(chunk);
+    init_chunk(chunk);
+    parser.long_jumps = true;
+    return compile_chunk(source, chunk);
+}
+
 static void declaration() {
     if (match(TOKEN_VAR)) {
         var_declaration();
+    } else if (match(TOKEN_CONST)) {
+        const_declaration();
     } else {
         statement();
     }
@@ -133,166 +419,327 @@ static void declaration() {
         synchronize();
 }
 
+/* The innermost local called name, or -1. Every local's name is
+ * interned when it is declared, so a name that is not interned cannot
+ * be a local. */
+static int find_local(Compiler* compiler, Token* name) {
+    ObjString* key = table_find_string(&vm.strings, name->start,
+        name->length, hash_string(name->start, name->length));
+    Value index;
+    if (key == NULL || !table_get(&compiler->local_names, key, &index))
+        return -1;
+    return (int)AS_NUMBER(index);
+}
+
 static int resolve_local(Compiler* compiler, Token* name) {
-    for (int i = compiler->local_count - 1; i >= 0; i--) {
-        Local* local = &compiler->locals[i];
-        if (identifiers_equal(name, &local->name)) {
-            if(local->depth == -1)
-                error("Can't read local variable in its own initializer.");
-            
-            return i;
-        }
-    }
+    int i = find_local(compiler, name);
+    if (i != -1 && compiler->locals[i].depth == -1)
+        error("Can't read local variable in its own initializer.");
+    return i;
+}
+/* Looks name up among the global constants, those of this source
+ * first. */
+static bool global_constant(Token* name, Value* value) {
+    if (parser.constants.count == 0 && vm.global_constants.count == 0)
+        return false;
 
-    return -1;
+    ObjString* key = copy_string(name->start, name->length);
+    return table_get(&parser.constants, key, value) ||
+        table_get(&vm.global_constants, key, value);
 }
+
 static void named_variable(Token name, bool can_assign) {
     uint8_t get_op, set_op;
+    bool constant;
+    Value value = UNDEFINED_VAL;
     int arg = resolve_local(current, &name);
     if (arg != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
+        constant = current->locals[arg].constant;
+        value = current->locals[arg].value;
     } else {
-        arg = identifier_constant(&name);
+        constant = global_constant(&name, &value);
+        /* A constant known now never needs its slot. */
+        if (IS_UNDEFINED(value))
+            arg = resolve_global(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
     if (can_assign && match(TOKEN_EQUAL)) {
+        if (constant)
+            error_at(&name, "Can't assign to a constant.");
         expression();
-        emit_bytes(set_op, (uint8_t)arg);
+        emit_slot(set_op, arg);
+        if (set_op == OP_SET_LOCAL)
+            current->locals[arg].type = current->expr_type;
+        current->expr_constant = false;
+        return;
+    }
+
+    if (!IS_UNDEFINED(value)) {
+        emit_folded(value);
+        return;
+    }
+
+    current->expr_constant = false;
+    if (get_op == OP_GET_LOCAL && arg <= UINT8_MAX &&
+        last_instruction_is(OP_GET_LOCAL)) {
+        /* Two local reads in a row become one OP_GET_LOCALS. */
+        current_chunk()->code[current->last_instruction] = OP_GET_LOCALS;
+        emit_byte((uint8_t)arg);
     } else {
-        emit_bytes(get_op, (uint8_t)arg);
+        emit_slot(get_op, arg);
+    }
+    current->expr_type = get_op == OP_GET_LOCAL
+        ? current->locals[arg].type
+        : TYPE_UNKNOWN;
+}
+
+/* Only natives can be called, and they are known by name, so nothing
+ * is pushed for the callee. */
+static void native_call(Token name) {
+    int index = find_native(name.start, name.length);
+    if (index == -1)
+        error("Can only call native functions.");
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    int count = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            expression();
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+
+    if (index != -1 && count != natives[index].arity) {
+        char message[64];
+        snprintf(message, sizeof(message),
+            "Expected %d arguments but got %d.", natives[index].arity, count);
+        error(message);
     }
+    emit_bytes(OP_NATIVE, index == -1 ? 0 : index);
+    current->expr_type = TYPE_UNKNOWN;
+    current->expr_constant = false;
 }
 
 static void variable(bool can_assign) {
+    if (check(TOKEN_LEFT_PAREN)) {
+        native_call(parser.previous);
+        return;
+    }
     named_variable(parser.previous, can_assign);
 }
 
-static uint8_t identifier_constant(Token* name) {
-    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+/* Globals live in numbered slots in the VM rather than a table keyed
+ * by name, so the name is turned into its slot here, once. */
+static int resolve_global(Token* name) {
+    int slot = global_slot(copy_string(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
 static void add_local(Token name) {
-    if (current->local_count == UINT8_COUNT) {
+    if (current->local_count == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
 
+    if (current->local_capacity < current->local_count + 1) {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(Local, current->locals, old_capacity,
+            current->local_capacity);
+    }
+    ObjString* key = copy_string(name.start, name.length);
+    Value shadowed;
     Local* local = &current->locals[current->local_count++];
     local->name = name;
     local->depth = -1;
+    local->type = TYPE_UNKNOWN;
+    local->constant = false;
+    local->value = UNDEFINED_VAL;
+    local->shadowed = table_get(&current->local_names, key, &shadowed)
+        ? (int)AS_NUMBER(shadowed)
+        : -1;
+    table_set(&current->local_names, key,
+        NUMBER_VAL(current->local_count - 1));
 }
 
-static bool identifiers_equal(Token* a, Token* b) {
-    if (a->length != b->length)
-        return false;
-
-    return memcmp(a->start, b->start, a->length) == 0;
+/* Drops the innermost local, making visible again the one it hid. */
+static void remove_local() {
+    Local* local = &current->locals[--current->local_count];
+    ObjString* key = copy_string(local->name.start, local->name.length);
+    if (local->shadowed == -1)
+        table_delete(&current->local_names, key);
+    else
+        table_set(&current->local_names, key, NUMBER_VAL(local->shadowed));
 }
+
 static void declare_variable() {
     if (current->scope_depth == 0)
         return;
 
+    /* Only the innermost local of a name can be in this scope. */
     Token* name = &parser.previous;
-    for (int i = current->local_count - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth)
-            break;
+    int i = find_local(current, name);
+    if (i != -1 && (current->locals[i].depth == -1 ||
+                    current->locals[i].depth == current->scope_depth))
+        error("Already a variable with this name in scope.");
 
-        if (identifiers_equal(name, &local->name))
-            error("Already a variable with this name in scope.");
-    }
-    
     add_local(*name);
 }
 
 static void emit_loop(int loop_start) {
-    emit_byte(OP_LOOP);
-
-    int offset = current_chunk()->count - loop_start + 2;
-    if (offset > UINT16_MAX)
-        error("Loop body too large.");
+    /* The offset counts back from the end of the OP_LOOP itself. */
+    int offset = current_chunk()->count - loop_start + 3;
+    if (offset <= UINT16_MAX) {
+        emit_op(OP_LOOP);
+    } else {
+        offset++;
+        if (offset > UINT24_MAX)
+            error("Loop body too large.");
+        emit_op(OP_LOOP_LONG);
+        emit_byte((offset >> 16) & 0xff);
+    }
 
     emit_byte((offset >> 8) & 0xff);
     emit_byte(offset & 0xff);
 }
 
 static void while_statement() {
-    int loop_start = current_chunk()->count;
+    int loop_start = mark_label();
+    int header_types = open_loop_types(true);
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     /* Create a jump point for the while loop. */
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    int exit_jump = emit_condition_jump();
+    int exit_types = save_types();
 
     /* Evaulate the loop body. */
     statement();
 
     /* Fill in loop jump index. */
     emit_loop(loop_start);
+    close_loop_types(header_types);
 
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    restore_types(exit_types);
+    drop_types(header_types);
 }
 
 static void and_(bool can_assign) {
     int end_jump = emit_jump(OP_JUMP_IF_FALSE);
+    int skip_types = save_types();
 
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     parse_precedence(PREC_AND);
 
     patch_jump(end_jump);
+    join_types(skip_types);
+    drop_types(skip_types);
+    current->expr_type = TYPE_UNKNOWN;
+    current->expr_constant = false;
 }
 
 static void or_(bool can_assign) {
     int else_jump = emit_jump(OP_JUMP_IF_FALSE);
     int end_jump = emit_jump(OP_JUMP);
+    int skip_types = save_types();
 
     patch_jump(else_jump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 
     parse_precedence(PREC_OR);
     patch_jump(end_jump);
+    join_types(skip_types);
+    drop_types(skip_types);
+    current->expr_type = TYPE_UNKNOWN;
+    current->expr_constant = false;
 }
 
-static uint8_t parse_variable(const char* error_message) {
+static int parse_variable(const char* error_message) {
     consume(TOKEN_IDENTIFIER, error_message);
 
     declare_variable();
     if (current->scope_depth > 0)
         return 0;
 
-    return identifier_constant(&parser.previous);
+    return resolve_global(&parser.previous);
 }
 
 static void mark_initialized() {
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(int global) {
     if (current->scope_depth > 0) {
         mark_initialized();
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_slot(OP_DEFINE_GLOBAL, global);
 }
 
 static void var_declaration() {
-    uint8_t global = parse_variable("Expect variable name.");
+    int global = parse_variable("Expect variable name.");
+    Value value;
+    if (current->scope_depth == 0 && global_constant(&parser.previous, &value))
+        error("Already a constant with this name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
+        current->expr_type = TYPE_UNKNOWN;
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
     define_variable(global);
+    if (current->scope_depth > 0 && current->local_count > 0)
+        current->locals[current->local_count - 1].type = current->expr_type;
+}
+
+/* A constant whose initializer folds to a value is replaced by that
+ * value wherever it is read. At the top level it then takes no global
+ * slot at all; in a block it keeps its stack slot, so the slots of the
+ * locals after it stay put. Any other initializer makes a variable
+ * that only its declaration writes. */
+static void const_declaration() {
+    consume(TOKEN_IDENTIFIER, "Expect constant name.");
+    Token name = parser.previous;
+    declare_variable();
+    Value value;
+    if (current->scope_depth == 0 && global_constant(&name, &value))
+        error("Already a constant with this name.");
+
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+    value = current->expr_constant ? current->expr_value : UNDEFINED_VAL;
+
+    if (current->scope_depth > 0) {
+        mark_initialized();
+        Local* local = &current->locals[current->local_count - 1];
+        local->type = current->expr_type;
+        local->constant = true;
+        local->value = value;
+        return;
+    }
+
+    if (IS_UNDEFINED(value))
+        emit_slot(OP_DEFINE_GLOBAL, resolve_global(&name));
+    else
+        discard_code(current->last_instruction);
+    table_set(&parser.constants, copy_string(name.start, name.length), value);
 }
 
 static void synchronize() {
@@ -306,6 +753,7 @@ static void synchronize() {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
+            case TOKEN_CONST:
             case TOKEN_FOR:
             case TOKEN_IF:
             case TOKEN_WHILE:
@@ -330,8 +778,8 @@ static void end_scope() {
 
     while (current->local_count > 0 && 
         current->locals[current->local_count - 1].depth > current->scope_depth) {
-            emit_byte(OP_POP);
-            current->local_count--;
+            emit_op(OP_POP);
+            remove_local();
         }
 }
 
@@ -343,22 +791,55 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
+/* Returns the offset of the jump's operand, for patch_jump(). */
 static int emit_jump(uint8_t instruction) {
-    emit_byte(instruction);
+    if (parser.long_jumps) {
+        emit_op(long_form(instruction));
+        emit_byte(0xff);
+    } else {
+        emit_op(instruction);
+    }
     emit_byte(0xff);
     emit_byte(0xff);
-    return current_chunk()->count - 2;
+    return current_chunk()->count - (parser.long_jumps ? 3 : 2);
 }
 
 static void patch_jump(int offset) {
-    /* -2 to adjust for the bytecode forr the jump offset itself. */
-    int jump = current_chunk()->count - offset - 2;
+    uint8_t* code = current_chunk()->code;
+    if (parser.long_jumps) {
+        /* -3 to adjust for the bytecode for the jump offset itself. */
+        int jump = current_chunk()->count - offset - 3;
+        if (jump > UINT24_MAX)
+            error("Too much code to jump over.");
+        code[offset++] = (jump >> 16) & 0xff;
+        code[offset++] = (jump >> 8) & 0xff;
+        code[offset] = jump & 0xff;
+    } else {
+        /* -2 to adjust for the bytecode forr the jump offset itself. */
+        int jump = current_chunk()->count - offset - 2;
+        if (jump > UINT16_MAX)
+            parser.jump_overflow = true;
+        code[offset] = (jump >> 8) & 0xff;
+        code[offset + 1] = jump & 0xff;
+    }
+    mark_label();
+}
 
-    if (jump > UINT16_MAX)
-        error("Too much code to jump over.");
-    
-    current_chunk()->code[offset] = (jump >> 8) & 0xff;
-    current_chunk()->code[offset + 1] = jump & 0xff;
+/* Emits the jump that skips an if body or leaves a loop. The condition
+ * is popped on both paths, and a comparison emitted right before it is
+ * folded into the branch. */
+static int emit_condition_jump() {
+    if (parser.long_jumps)
+        return emit_jump(OP_POP_JUMP_IF_FALSE);
+    if (last_instruction_is(OP_LESS)) {
+        truncate_chunk(current_chunk(), current->last_instruction);
+        return emit_jump(OP_JUMP_IF_NOT_LESS);
+    }
+    if (last_instruction_is(OP_GREATER)) {
+        truncate_chunk(current_chunk(), current->last_instruction);
+        return emit_jump(OP_JUMP_IF_NOT_GREATER);
+    }
+    return emit_jump(OP_POP_JUMP_IF_FALSE);
 }
 
 static void if_statement() {
@@ -366,17 +847,101 @@ static void if_statement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    int then_jump = emit_condition_jump();
+    int skip_types = save_types();
     statement();
 
     int else_jump = emit_jump(OP_JUMP);
     patch_jump(then_jump);
-    emit_byte(OP_POP);
+    int then_types = save_types();
+    restore_types(skip_types);
 
     if (match(TOKEN_ELSE))
         statement();
     patch_jump(else_jump);
+    join_types(then_types);
+    drop_types(skip_types);
+}
+
+/* Drops the code from offset on, along with what the type inference
+ * recorded about it. */
+static void discard_code(int offset) {
+    truncate_chunk(current_chunk(), offset);
+    while (types.site_count > 0 &&
+           types.sites[types.site_count - 1].offset >= offset)
+        types.site_count--;
+    current->last_instruction = -1;
+    mark_label();
+}
+
+/* Matches `i < limit` or `i <= limit` between start and the exit jump,
+ * and `i = i + step` from increment to the end of the chunk, where i is
+ * a local, step a number constant and limit a constant, another local
+ * or a global. On a match, fills operands with those of OP_FOR_LOOP
+ * but its offset. */
+static bool counted_loop(int start, int exit_jump, int increment,
+                         uint8_t* operands) {
+    Chunk* chunk = current_chunk();
+    uint8_t* code = chunk->code;
+    for (int offset = start; offset < chunk->count; offset++) {
+        if (get_line(chunk, offset) != get_line(chunk, start))
+            return false;
+    }
+
+    /* The increment. */
+    if (chunk->count - increment != 7 || code[increment] != OP_GET_LOCAL ||
+        code[increment + 2] != OP_CONSTANT || code[increment + 4] != OP_ADD ||
+        code[increment + 5] != OP_SET_LOCAL_POP ||
+        code[increment + 6] != code[increment + 1] ||
+        !IS_NUMBER(chunk->constants.values[code[increment + 3]]))
+        return false;
+    uint8_t slot = code[increment + 1];
+    operands[0] = slot;
+    operands[1] = code[increment + 3];
+
+    /* The test, which may be followed by a NOT for <=. */
+    int test = exit_jump - 1;
+    uint8_t kind = 0;
+    if (code[test] == OP_POP_JUMP_IF_FALSE && test - start >= 2 &&
+        code[test - 1] == OP_NOT && code[test - 2] == OP_GREATER) {
+        kind = FOR_INCLUSIVE;
+        test -= 2;
+    } else if (code[test] != OP_JUMP_IF_NOT_LESS) {
+        return false;
+    }
+
+    /* The operands being compared. */
+    if (test - start == 3 && code[start] == OP_GET_LOCALS) {
+        if (code[start + 1] != slot || code[start + 2] == slot)
+            return false;
+        kind |= FOR_LOCAL;
+    } else if (test - start == 4 && code[start] == OP_GET_LOCAL &&
+               code[start + 1] == slot) {
+        switch (code[start + 2]) {
+            case OP_CONSTANT: kind |= FOR_CONSTANT; break;
+            case OP_GET_GLOBAL: kind |= FOR_GLOBAL; break;
+            default: return false;
+        }
+    } else {
+        return false;
+    }
+    operands[2] = kind;
+    operands[3] = code[test - 1];
+    return true;
+}
+
+static void emit_for_loop(uint8_t* operands, int line, int body_start) {
+    Chunk* chunk = current_chunk();
+    int offset = chunk->count - body_start + 7;
+    if (offset > UINT16_MAX)
+        parser.jump_overflow = true;
+
+    current->last_instruction = chunk->count;
+    write_chunk(chunk, OP_FOR_LOOP, line);
+    for (int i = 0; i < 4; i++)
+        write_chunk(chunk, operands[i], line);
+    write_chunk(chunk, (offset >> 8) & 0xff, line);
+    write_chunk(chunk, offset & 0xff, line);
 }
 
 static void for_statement() {
@@ -393,28 +958,58 @@ static void for_statement() {
     }
     
     /* Condition clause. */
-    int loop_start = current_chunk()->count;
+    int loop_start = mark_label();
+    int header_types = open_loop_types(true);
     int exit_jump = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         /* Exit loop if condition is false. */
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        exit_jump = emit_condition_jump();
     }
+    int exit_types = save_types();
 
-    /* Increment clause. */
+    /* Increment clause. It runs after the body, which is compiled
+     * later, so its types come from the body's back edge. */
+    int loop_types = header_types;
     if (!match(TOKEN_RIGHT_PAREN)) {
         int body_jump = emit_jump(OP_JUMP);
-        int increment_start = current_chunk()->count;
+        int increment_start = mark_label();
+        int increment_types = open_loop_types(false);
         expression();
-        emit_byte(OP_POP);
+        emit_pop();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clause.");
 
+        /* A counted loop runs its increment and test after the body as
+         * one OP_FOR_LOOP, and only the first test stays up here. */
+        uint8_t operands[4];
+        if (exit_jump != -1 && !parser.long_jumps &&
+            counted_loop(loop_start, exit_jump, increment_start, operands)) {
+            int line = get_line(current_chunk(), increment_start);
+            discard_code(body_jump - 1);
+            restore_types(exit_types);
+            int body_start = current_chunk()->count;
+
+            /* The increment leaves the type of i as it was, so the
+             * header's types hold at the end of the body as well. */
+            statement();
+            emit_for_loop(operands, line, body_start);
+            close_loop_types(header_types);
+
+            patch_jump(exit_jump);
+            restore_types(exit_types);
+            drop_types(header_types);
+            end_scope();
+            return;
+        }
+
         emit_loop(loop_start);
+        close_loop_types(header_types);
         loop_start = increment_start;
+        loop_types = increment_types;
         patch_jump(body_jump);
+        restore_types(exit_types);
     }
 
     /* Push the exit jump index onto the stack. */
@@ -422,11 +1017,12 @@ static void for_statement() {
     //emit_byte(exit_jump && 0x00ff);
     statement();
     emit_loop(loop_start);
+    close_loop_types(loop_types);
 
-    if (exit_jump != -1) {
+    if (exit_jump != -1)
         patch_jump(exit_jump);
-        emit_byte(OP_POP);
-    }
+    restore_types(exit_types);
+    drop_types(header_types);
     end_scope();
 }
 
@@ -460,13 +1056,13 @@ static void statement() {
 static void expression_statement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+    emit_pop();
 }
 
 static void print_statement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(OP_PRINT);
+    emit_op(OP_PRINT);
 }
 
 static void consume(TokenType type, const char* message) {
@@ -521,30 +1117,189 @@ static void grouping(bool can_assign) {
 }
 
 
+/* Emits an opcode followed by its one-byte operand. */
 static void emit_bytes(uint8_t byte1, uint8_t byte2) {
-    emit_byte(byte1);
+    emit_op(byte1);
     emit_byte(byte2);
 }
 
 
+/* Emits an instruction on a local or global slot, in its long form
+ * once the slot no longer fits in a byte. */
+static void emit_slot(uint8_t op, int slot) {
+    if (slot > UINT8_MAX) {
+        emit_op(long_form(op));
+        emit_byte((slot >> 8) & 0xff);
+        emit_byte(slot & 0xff);
+    } else {
+        emit_bytes(op, (uint8_t)slot);
+    }
+}
+
+
+/* Longest string a constant `string * number` is folded into. */
+#define MAX_FOLDED_STRING 1024
+
+/* Computes a constant operation, unary ones ignoring b, unless it would
+ * fail at run time, in which case the interpreter has to report it. */
+static bool fold_constant(uint8_t op, Value a, Value b, Value* result) {
+    bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+    switch (op) {
+        case OP_NEGATE:
+            if (!IS_NUMBER(a))
+                return false;
+            *result = NUMBER_VAL(-AS_NUMBER(a));
+            return true;
+        case OP_NOT:
+            *result = BOOL_VAL(is_falsey(a));
+            return true;
+        case OP_EQUAL:
+            *result = BOOL_VAL(values_equal(a, b));
+            return true;
+        case OP_NOT_EQUAL:
+            *result = BOOL_VAL(!values_equal(a, b));
+            return true;
+        case OP_ADD:
+            if (IS_STRING(a) && IS_STRING(b))
+                return concatenate_strings(a, b, result);
+            if (!numbers)
+                return false;
+            *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            return true;
+        case OP_MULTIPLY:
+            if (IS_STRING(a) != IS_STRING(b) && !numbers &&
+                (IS_NUMBER(a) || IS_NUMBER(b))) {
+                Value string = IS_STRING(a) ? a : b;
+                double times = AS_NUMBER(IS_NUMBER(a) ? a : b);
+                if (times * string_length(string) > MAX_FOLDED_STRING)
+                    return false;
+                return repeat_string(string, times, result);
+            }
+            if (!numbers)
+                return false;
+            *result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+            return true;
+        default:
+            break;
+    }
+
+    if (!numbers)
+        return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+        case OP_DIVIDE: *result = NUMBER_VAL(x / y); return true;
+        case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+        case OP_LESS: *result = BOOL_VAL(x < y); return true;
+        case OP_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case OP_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+        default: return false;
+    }
+}
+
+
+static uint8_t binary_op(TokenType operator_type) {
+    switch (operator_type) {
+        case TOKEN_PLUS:            return OP_ADD;
+        case TOKEN_MINUS:           return OP_SUBTRACT;
+        case TOKEN_STAR:            return OP_MULTIPLY;
+        case TOKEN_SLASH:           return OP_DIVIDE;
+        case TOKEN_BANG_EQUAL:      return OP_NOT_EQUAL;
+        case TOKEN_EQUAL_EQUAL:     return OP_EQUAL;
+        case TOKEN_GREATER:         return OP_GREATER;
+        case TOKEN_GREATER_EQUAL:   return OP_GREATER_EQUAL;
+        case TOKEN_LESS:            return OP_LESS;
+        case TOKEN_LESS_EQUAL:      return OP_LESS_EQUAL;
+        default:                    return OP_RETURN;
+    }
+}
+
+
+/* The number of operands the + ending the code so far adds, if it can
+ * take one more. Those proven to be numbers stay pairs so they can be
+ * unchecked. */
+static int add_operands() {
+    if (types.site_count > 0 &&
+        types.sites[types.site_count - 1].offset == current->last_instruction)
+        return 0;
+    if (last_instruction_is(OP_ADD))
+        return 2;
+    if (last_instruction_is(OP_ADD_N) &&
+        current_chunk()->code[current->last_instruction + 1] < UINT8_MAX)
+        return current_chunk()->code[current->last_instruction + 1];
+    return 0;
+}
+
+
 static void binary(bool can_assign) {
     TokenType operator_type = parser.previous.type;
     ParseRule* rule = get_rule(operator_type);
+    int left_type = current->expr_type;
+    bool left_constant = current->expr_constant;
+    Value left = current->expr_value;
+    /* A constant is always a single instruction. */
+    int left_start = current->last_instruction;
+
+    /* a + b + c adds all three in one OP_ADD_N. */
+    int operands = operator_type == TOKEN_PLUS ? add_operands() : 0;
+    if (operands > 0)
+        discard_code(current->last_instruction);
     parse_precedence((Precedence) (rule->precedence + 1));
 
+    Value result;
+    if (operands > 0) {
+        emit_bytes(OP_ADD_N, operands + 1);
+        current->expr_type = TYPE_UNKNOWN;
+        current->expr_constant = false;
+        return;
+    } else if (left_constant && current->expr_constant &&
+        fold_constant(binary_op(operator_type), left, current->expr_value,
+            &result)) {
+        discard_code(left_start);
+        emit_folded(result);
+        return;
+    }
+
+    current->expr_constant = false;
+    int operand_type = both_types(left_type, current->expr_type);
+
+    /* Only + and * can turn anything but numbers into a result. */
+    current->expr_type = TYPE_UNKNOWN;
     switch(operator_type) {
-        case TOKEN_PLUS:            emit_byte(OP_ADD); break;
-        case TOKEN_MINUS:           emit_byte(OP_SUBTRACT); break;
-        case TOKEN_STAR:            emit_byte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:           emit_byte(OP_DIVIDE); break;
-        case TOKEN_BANG_EQUAL:      emit_bytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emit_byte(OP_EQUAL); break;
-        case TOKEN_GREATER:         emit_byte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL:   emit_bytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:            emit_byte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:      emit_bytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS:
+            emit_op(OP_ADD);
+            current->expr_type = operand_type;
+            break;
+        case TOKEN_MINUS:
+            emit_op(OP_SUBTRACT);
+            current->expr_type = TYPE_NUMBER;
+            break;
+        case TOKEN_STAR:
+            emit_op(OP_MULTIPLY);
+            current->expr_type = operand_type;
+            break;
+        case TOKEN_SLASH:
+            emit_op(OP_DIVIDE);
+            current->expr_type = TYPE_NUMBER;
+            break;
+        case TOKEN_BANG_EQUAL:      emit_op(OP_EQUAL); emit_op(OP_NOT); return;
+        case TOKEN_EQUAL_EQUAL:     emit_op(OP_EQUAL); return;
+        case TOKEN_GREATER:         emit_op(OP_GREATER); break;
+        case TOKEN_LESS:            emit_op(OP_LESS); break;
+        case TOKEN_GREATER_EQUAL:
+            emit_op(OP_LESS);
+            add_typed_site(operand_type);
+            emit_op(OP_NOT);
+            return;
+        case TOKEN_LESS_EQUAL:
+            emit_op(OP_GREATER);
+            add_typed_site(operand_type);
+            emit_op(OP_NOT);
+            return;
         default: return;
     }
+    add_typed_site(operand_type);
 }
 
 
@@ -554,9 +1309,26 @@ static void unary(bool can_assign) {
     /* Compile the operand. */
     parse_precedence(PREC_UNARY);
 
+    uint8_t op = operator_type == TOKEN_MINUS ? OP_NEGATE : OP_NOT;
+    Value result;
+    if (current->expr_constant &&
+        fold_constant(op, current->expr_value, NIL_VAL, &result)) {
+        discard_code(current->last_instruction);
+        emit_folded(result);
+        return;
+    }
+
+    current->expr_constant = false;
     switch(operator_type) {
-        case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
-        case TOKEN_BANG: emit_byte(OP_NOT); break;
+        case TOKEN_MINUS:
+            emit_op(OP_NEGATE);
+            add_typed_site(current->expr_type);
+            current->expr_type = TYPE_NUMBER;
+            break;
+        case TOKEN_BANG:
+            emit_op(OP_NOT);
+            current->expr_type = TYPE_UNKNOWN;
+            break;
         default: return;
     }
 }
@@ -572,12 +1344,57 @@ static void emit_byte(uint8_t byte) {
 }
 
 
+/* Writes an opcode and remembers where it starts, so the following
+ * code can fuse it into a superinstruction. */
+static void emit_op(uint8_t op) {
+    current->last_instruction = current_chunk()->count;
+    emit_byte(op);
+}
+
+
+/* Marks the current offset as a jump target. Instructions on either
+ * side of a label are never fused together. */
+static int mark_label() {
+    current->last_label = current_chunk()->count;
+    return current->last_label;
+}
+
+
+/* True if the last instruction emitted is op and no jump lands after
+ * its start, so it is safe to rewrite it in place. */
+static bool last_instruction_is(uint8_t op) {
+    int last = current->last_instruction;
+    return last != -1 && last >= current->last_label &&
+        current_chunk()->code[last] == op;
+}
+
+
+/* Discards the value of an expression statement, folding the pop
+ * into a preceding assignment where possible. */
+static void emit_pop() {
+    if (last_instruction_is(OP_SET_LOCAL)) {
+        current_chunk()->code[current->last_instruction] = OP_SET_LOCAL_POP;
+    } else if (last_instruction_is(OP_SET_GLOBAL)) {
+        current_chunk()->code[current->last_instruction] = OP_SET_GLOBAL_POP;
+    } else {
+        emit_op(OP_POP);
+    }
+}
+
+
 static void end_compiler() {
     emit_return();
+    /* A chunk whose jumps overflowed is about to be compiled again. */
+    bool finished = !parser.had_error && !parser.jump_overflow;
+    if (finished) {
+        resolve_types();
+        optimize_peephole(current_chunk());
+    }
+    free_types();
     #ifdef DEBUG_PRINT_CODE
-    if(!parser.had_error) {
+    if (finished) {
         disassemble_chunk(current_chunk(), "code");
-    } else {
+    } else if (parser.had_error) {
         fprintf(stderr, "Error: Could not disassemble chunk due to error.\n");
     }
     #endif
@@ -586,17 +1403,25 @@ static void end_compiler() {
 
 static void number(bool can_assign) {
     double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+    emit_folded(NUMBER_VAL(value));
 }
 
 
 static void emit_constant(Value value) {
-    uint16_t index = make_constant(value);
+    if (IS_NIL(value)) {
+        emit_op(OP_NIL);
+        return;
+    } else if (IS_BOOL(value)) {
+        emit_op(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+        return;
+    }
+
+    uint32_t index = make_constant(value);
     if(index > UINT8_MAX) {
-        /* Write 16-bit index. */
-        uint8_t left_bits = (index & 0xFF00) >> 8;
-        emit_bytes(OP_CONSTANT_LONG, left_bits);
-        emit_byte((uint8_t) (index & 0x00FF));
+        /* Write 24-bit index. */
+        emit_bytes(OP_CONSTANT_LONG, (uint8_t) ((index >> 16) & 0xFF));
+        emit_byte((uint8_t) ((index >> 8) & 0xFF));
+        emit_byte((uint8_t) (index & 0xFF));
     } else {
         emit_bytes(OP_CONSTANT, (uint8_t) (index & 0x00FF));
     }
@@ -604,17 +1429,26 @@ static void emit_constant(Value value) {
 }
 
 
-static uint16_t make_constant(Value value) {
+/* Emits an expression whose value is known at compile time. */
+static void emit_folded(Value value) {
+    emit_constant(value);
+    current->expr_type = IS_NUMBER(value) ? TYPE_NUMBER : TYPE_UNKNOWN;
+    current->expr_constant = true;
+    current->expr_value = value;
+}
+
+
+static uint32_t make_constant(Value value) {
     int constant = add_constant(current_chunk(), value);
-    if(constant > UINT16_MAX) {
+    if(constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
     }
 
-    return (uint16_t) constant;
+    return (uint32_t) constant;
 }
 
 static void emit_return() {
-    emit_byte(OP_RETURN);
+    emit_op(OP_RETURN);
 }
 
 
@@ -665,20 +1499,99 @@ static void error_at(Token* token, const char* message) {
 
 static void literal(bool can_assign) {
     switch(parser.previous.type) {
-        case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-        case TOKEN_NIL:  emit_byte(OP_NIL);  break;
-        case TOKEN_TRUE:  emit_byte(OP_TRUE);  break;
+        case TOKEN_FALSE: emit_folded(BOOL_VAL(false)); break;
+        case TOKEN_NIL:  emit_folded(NIL_VAL);  break;
+        case TOKEN_TRUE:  emit_folded(BOOL_VAL(true));  break;
         default: return;
     }
 }
 
 static void string(bool can_assign) {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1,
-        parser.previous.length - 2)));
+    emit_folded(string_value(parser.previous.start + 1,
+        parser.previous.length - 2));
+}
+
+typedef struct {
+    Value values[UINT8_MAX];    // of the parts, while all are known
+    int count;
+    bool known;
+} Parts;
+
+/* Makes room for one more part. Past the operand limit the parts so
+ * far are joined, and the result becomes the first part. */
+static void begin_part(Parts* parts) {
+    if (parts->count == UINT8_MAX) {
+        emit_bytes(OP_INTERPOLATE, parts->count);
+        parts->count = 1;
+        parts->known = false;
+    }
+}
+
+static void end_part(Parts* parts) {
+    parts->known = parts->known && current->expr_constant;
+    if (parts->known)
+        parts->values[parts->count] = current->expr_value;
+    parts->count++;
+}
+
+/* "a${x}b" compiles to "a", x, "b" and an OP_INTERPOLATE of the
+ * three, leaving out empty parts. A string of known parts is folded. */
+static void interpolation(bool can_assign) {
+    Parts parts;
+    parts.count = 0;
+    parts.known = true;
+    int start = current_chunk()->count;
+
+    for (;;) {
+        /* Each piece is quoted by one of " or } before, and one of "
+         * or ${ after. */
+        Token piece = parser.previous;
+        bool last = piece.type == TOKEN_STRING;
+        int length = piece.length - (last ? 2 : 3);
+        if (length > 0) {
+            begin_part(&parts);
+            emit_folded(string_value(piece.start + 1, length));
+            end_part(&parts);
+        }
+        if (last)
+            break;
+
+        /* The piece after an empty ${} would read as a string. */
+        if (*parser.current.start == '}' &&
+            (check(TOKEN_STRING) || check(TOKEN_INTERPOLATION))) {
+            error_at_current("Expect expression.");
+            break;
+        }
+        begin_part(&parts);
+        expression();
+        end_part(&parts);
+        if (!match(TOKEN_INTERPOLATION) && !match(TOKEN_STRING)) {
+            error_at_current("Expect '}' after interpolated expression.");
+            break;
+        }
+    }
+
+    Value joined;
+    if (parts.known && join_values(parts.values, parts.count, &joined)) {
+        discard_code(start);
+        emit_folded(joined);
+        return;
+    }
+    emit_bytes(OP_INTERPOLATE, parts.count);
+    current->expr_type = TYPE_UNKNOWN;
+    current->expr_constant = false;
 }
 
 static void init_compiler(Compiler* compiler) {
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
+    init_table(&compiler->local_names);
     compiler->scope_depth = 0;
+    compiler->last_instruction = -1;
+    compiler->last_label = 0;
+    compiler->expr_type = TYPE_UNKNOWN;
+    compiler->expr_constant = false;
+    compiler->expr_value = NIL_VAL;
     current = compiler;
 }
\ No newline at end of file
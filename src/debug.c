@@ -1,6 +1,83 @@
 #include "debug.h"
+#include "natives.h"
+#include "object.h"
+#include "vm.h"
 
 
+static const char* opcode_names[] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NOT] = "OP_NOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_NIL] = "OP_NIL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_GET_LOCALS] = "OP_GET_LOCALS",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_FOR_LOOP] = "OP_FOR_LOOP",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_ADD_N] = "OP_ADD_N",
+    [OP_INTERPOLATE] = "OP_INTERPOLATE",
+    [OP_NATIVE] = "OP_NATIVE",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_NEGATE_UNCHECKED] = "OP_NEGATE_UNCHECKED",
+    [OP_ADD_UNCHECKED] = "OP_ADD_UNCHECKED",
+    [OP_SUBTRACT_UNCHECKED] = "OP_SUBTRACT_UNCHECKED",
+    [OP_MULTIPLY_UNCHECKED] = "OP_MULTIPLY_UNCHECKED",
+    [OP_DIVIDE_UNCHECKED] = "OP_DIVIDE_UNCHECKED",
+    [OP_LESS_UNCHECKED] = "OP_LESS_UNCHECKED",
+    [OP_GREATER_UNCHECKED] = "OP_GREATER_UNCHECKED",
+    [OP_JUMP_IF_NOT_LESS_UNCHECKED] = "OP_JUMP_IF_NOT_LESS_UNCHECKED",
+    [OP_JUMP_IF_NOT_GREATER_UNCHECKED] = "OP_JUMP_IF_NOT_GREATER_UNCHECKED",
+    [OP_POP_JUMP_IF_TRUE] = "OP_POP_JUMP_IF_TRUE",
+    [OP_JUMP_IF_LESS] = "OP_JUMP_IF_LESS",
+    [OP_JUMP_IF_GREATER] = "OP_JUMP_IF_GREATER",
+    [OP_JUMP_IF_LESS_UNCHECKED] = "OP_JUMP_IF_LESS_UNCHECKED",
+    [OP_JUMP_IF_GREATER_UNCHECKED] = "OP_JUMP_IF_GREATER_UNCHECKED",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+    [OP_POP_JUMP_IF_FALSE_LONG] = "OP_POP_JUMP_IF_FALSE_LONG",
+};
+
+const char* opcode_name(uint8_t opcode) {
+    if (opcode >= sizeof(opcode_names) / sizeof(opcode_names[0]) ||
+        opcode_names[opcode] == NULL)
+        return "OP_UNKNOWN";
+    return opcode_names[opcode];
+}
+
 static int simple_instruction(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -11,6 +88,44 @@ static int byte_instruction(const char* name, Chunk* chunk, int offset) {
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
+static int byte2_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+static int short_instruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) |
+        chunk->code[offset + 2];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
+static int global_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, slot);
+    print_value(vm.global_names.values[slot]);
+    printf("'\n");
+    return offset + 2;
+}
+
+static int native_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t index = chunk->code[offset + 1];
+    printf("%-16s %4d '%s'\n", name, index, natives[index].name);
+    return offset + 2;
+}
+
+static int global_long_instruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) |
+        chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    print_value(vm.global_names.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int constant_instruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant_index = chunk->code[offset + 1];
     printf("%-16s Value array index: %4d Value: ", name, constant_index);
@@ -20,11 +135,33 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset) {
 }
 
 static int constant_long_instruction(const char *name, Chunk *chunk, int offset) {
-    uint16_t constant_index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint32_t constant_index = (chunk->code[offset + 1] << 16) |
+        (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
     printf("%-16s Index: %4d Value: ", name, constant_index);
     print_value(chunk->constants.values[constant_index]);
     printf("\n");
-    return offset + 3;
+    return offset + 4;
+}
+
+static int for_loop_instruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    uint16_t jump = (uint16_t)(code[5] << 8) | code[6];
+    printf("%-16s %4d += ", name, code[1]);
+    print_value(chunk->constants.values[code[2]]);
+    printf(" while %s ", code[3] & FOR_INCLUSIVE ? "<=" : "<");
+    switch (code[3] & ~FOR_INCLUSIVE) {
+        case FOR_CONSTANT:
+            print_value(chunk->constants.values[code[4]]);
+            break;
+        case FOR_LOCAL:
+            printf("local %d", code[4]);
+            break;
+        default:
+            print_value(vm.global_names.values[code[4]]);
+            break;
+    }
+    printf(" %4d -> %d\n", offset, offset + 7 - jump);
+    return offset + 7;
 }
 
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset) {
@@ -34,6 +171,14 @@ static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset
     return offset + 3;
 }
 
+static int jump_long_instruction(const char* name, int sign, Chunk* chunk,
+                                 int offset) {
+    uint8_t* code = &chunk->code[offset];
+    int jump = (code[1] << 16) | (code[2] << 8) | code[3];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
 void disassemble_chunk(Chunk *chunk, const char *name) {
     printf("===== %s =====\n", name);
     
@@ -54,59 +199,232 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         }
 
     uint8_t instruction = chunk->code[offset];
+    const char* name = opcode_name(instruction);
     switch (instruction) {
         case OP_RETURN:
-            return simple_instruction("OP_RETURN", offset);
+            return simple_instruction(name, offset);
         case OP_CONSTANT:
-            return constant_instruction("OP_CONSTANT", chunk, offset);
+            return constant_instruction(name, chunk, offset);
         case OP_CONSTANT_LONG:
-            return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
+            return constant_long_instruction(name, chunk, offset);
         case OP_NEGATE:
-            return simple_instruction("OP_NEGATE", offset);
+            return simple_instruction(name, offset);
         case OP_ADD:
-            return simple_instruction("OP_ADD", offset);
+            return simple_instruction(name, offset);
         case OP_SUBTRACT:
-            return simple_instruction("OP_SUBTRACT", offset);
+            return simple_instruction(name, offset);
         case OP_MULTIPLY:
-            return simple_instruction("OP_MULTIPLY", offset);
+            return simple_instruction(name, offset);
         case OP_DIVIDE:
-            return simple_instruction("OP_DIVIDE", offset);
+            return simple_instruction(name, offset);
         case OP_TRUE:
-            return simple_instruction("OP_TRUE", offset);
+            return simple_instruction(name, offset);
         case OP_FALSE:
-            return simple_instruction("OP_FALSE", offset);
+            return simple_instruction(name, offset);
         case OP_NOT:
-            return simple_instruction("OP_NOT", offset);
+            return simple_instruction(name, offset);
         case OP_EQUAL:
-            return simple_instruction("OP_EQUAL", offset);
+            return simple_instruction(name, offset);
         case OP_GREATER:
-            return simple_instruction("OP_GREATER", offset);
+            return simple_instruction(name, offset);
         case OP_LESS:
-            return simple_instruction("OP_LESS", offset);
+            return simple_instruction(name, offset);
         case OP_PRINT:
-            return simple_instruction("OP_PRINT", offset);
+            return simple_instruction(name, offset);
         case OP_POP:
-            return simple_instruction("OP_POP", offset);
+            return simple_instruction(name, offset);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return global_instruction(name, chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+            return global_instruction(name, chunk, offset);
         case OP_NIL:
-            return simple_instruction("OP_NIL", offset);
+            return simple_instruction(name, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+            return global_instruction(name, chunk, offset);
         case OP_SET_LOCAL:
-            return byte_instruction("OP_SET_LOCAL", chunk, offset);
+            return byte_instruction(name, chunk, offset);
         case OP_GET_LOCAL:
-            return byte_instruction("OP_GET_LOCAL", chunk, offset);
+            return byte_instruction(name, chunk, offset);
         case OP_JUMP:
-            return jump_instruction("OP_JUMP", 1, chunk, offset);
+            return jump_instruction(name, 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jump_instruction(name, 1, chunk, offset);
         case OP_LOOP:
-            return jump_instruction("OP_LOOP", -1, chunk, offset);
+            return jump_instruction(name, -1, chunk, offset);
+        case OP_GET_LOCALS:
+            return byte2_instruction(name, chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byte_instruction(name, chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return global_instruction(name, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            return jump_instruction(name, 1, chunk, offset);
+        case OP_FOR_LOOP:
+            return for_loop_instruction(name, chunk, offset);
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            return simple_instruction(name, offset);
+        case OP_ADD_N:
+        case OP_INTERPOLATE:
+            return byte_instruction(name, chunk, offset);
+        case OP_NATIVE:
+            return native_instruction(name, chunk, offset);
+        case OP_ADD_NUM:
+            return simple_instruction(name, offset);
+        case OP_ADD_STR:
+            return simple_instruction(name, offset);
+        case OP_MULTIPLY_NUM:
+            return simple_instruction(name, offset);
+        case OP_NEGATE_UNCHECKED:
+        case OP_ADD_UNCHECKED:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_DIVIDE_UNCHECKED:
+        case OP_LESS_UNCHECKED:
+        case OP_GREATER_UNCHECKED:
+            return simple_instruction(name, offset);
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+            return jump_instruction(name, 1, chunk, offset);
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_LESS_UNCHECKED:
+        case OP_JUMP_IF_GREATER_UNCHECKED:
+            return jump_instruction(name, 1, chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            return global_long_instruction(name, chunk, offset);
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_LOCAL_LONG:
+            return short_instruction(name, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return jump_long_instruction(name, 1, chunk, offset);
+        case OP_LOOP_LONG:
+            return jump_long_instruction(name, -1, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
+}
+
+
+static const char* reg_opcode_names[] = {
+    [ROP_MOVE] = "ROP_MOVE",
+    [ROP_NEGATE] = "ROP_NEGATE",
+    [ROP_NOT] = "ROP_NOT",
+    [ROP_ADD] = "ROP_ADD",
+    [ROP_SUBTRACT] = "ROP_SUBTRACT",
+    [ROP_MULTIPLY] = "ROP_MULTIPLY",
+    [ROP_DIVIDE] = "ROP_DIVIDE",
+    [ROP_EQUAL] = "ROP_EQUAL",
+    [ROP_GREATER] = "ROP_GREATER",
+    [ROP_LESS] = "ROP_LESS",
+    [ROP_NOT_EQUAL] = "ROP_NOT_EQUAL",
+    [ROP_GREATER_EQUAL] = "ROP_GREATER_EQUAL",
+    [ROP_LESS_EQUAL] = "ROP_LESS_EQUAL",
+    [ROP_GET_GLOBAL] = "ROP_GET_GLOBAL",
+    [ROP_SET_GLOBAL] = "ROP_SET_GLOBAL",
+    [ROP_DEFINE_GLOBAL] = "ROP_DEFINE_GLOBAL",
+    [ROP_PRINT] = "ROP_PRINT",
+    [ROP_JUMP] = "ROP_JUMP",
+    [ROP_JUMP_IF_FALSE] = "ROP_JUMP_IF_FALSE",
+    [ROP_JUMP_IF_NOT_LESS] = "ROP_JUMP_IF_NOT_LESS",
+    [ROP_JUMP_IF_NOT_GREATER] = "ROP_JUMP_IF_NOT_GREATER",
+    [ROP_RETURN] = "ROP_RETURN",
+};
+
+/* Registers print as rN, constants as their value. */
+static void print_operand(RegChunk* chunk, int index) {
+    if (index >= chunk->constant_count) {
+        printf(" r%d", index - chunk->constant_count);
+    } else {
+        printf(" k%d '", index);
+        print_value(frame_constant(chunk, index));
+        printf("'");
+    }
+}
+
+static void print_global(int slot) {
+    printf(" g%d '", slot);
+    print_value(vm.global_names.values[slot]);
+    printf("'");
+}
+
+void disassemble_reg_chunk(RegChunk* chunk, const char* name) {
+    printf("===== %s =====\n", name);
+
+    for (int index = 0; index < chunk->count; index++)
+        disassemble_reg_instruction(chunk, index);
+}
+
+int disassemble_reg_instruction(RegChunk* chunk, int index) {
+    printf("%04d ", index);
+    size_t line = get_line(chunk->source, chunk->offsets[index]);
+    if (index > 0 &&
+        line == get_line(chunk->source, chunk->offsets[index - 1])) {
+            printf(" |  ");
+        } else {
+            printf("%2lu ", (unsigned long)line);
+        }
+
+    RegInstruction* instruction = &chunk->code[index];
+    printf("%-24s", reg_opcode_names[instruction->op]);
+    switch (instruction->op) {
+        case ROP_MOVE:
+        case ROP_NEGATE:
+        case ROP_NOT:
+            print_operand(chunk, instruction->a);
+            print_operand(chunk, instruction->b);
+            break;
+        case ROP_ADD:
+        case ROP_SUBTRACT:
+        case ROP_MULTIPLY:
+        case ROP_DIVIDE:
+        case ROP_EQUAL:
+        case ROP_GREATER:
+        case ROP_LESS:
+        case ROP_NOT_EQUAL:
+        case ROP_GREATER_EQUAL:
+        case ROP_LESS_EQUAL:
+            print_operand(chunk, instruction->a);
+            print_operand(chunk, instruction->b);
+            print_operand(chunk, instruction->c);
+            break;
+        case ROP_GET_GLOBAL:
+            print_operand(chunk, instruction->a);
+            print_global(instruction->b);
+            break;
+        case ROP_SET_GLOBAL:
+        case ROP_DEFINE_GLOBAL:
+            print_global(instruction->a);
+            print_operand(chunk, instruction->b);
+            break;
+        case ROP_PRINT:
+            print_operand(chunk, instruction->b);
+            break;
+        case ROP_JUMP:
+            printf(" -> %d", instruction->a);
+            break;
+        case ROP_JUMP_IF_FALSE:
+            print_operand(chunk, instruction->b);
+            printf(" -> %d", instruction->a);
+            break;
+        case ROP_JUMP_IF_NOT_LESS:
+        case ROP_JUMP_IF_NOT_GREATER:
+            print_operand(chunk, instruction->b);
+            print_operand(chunk, instruction->c);
+            printf(" -> %d", instruction->a);
+            break;
+        case ROP_RETURN:
+            break;
+    }
+    printf("\n");
+    return index + 1;
 }
\ No newline at end of file
@@ -0,0 +1,786 @@
+#ifdef __unix__
+#define _DEFAULT_SOURCE
+#endif
+
+#include "jit.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "vm.h"
+#include "x64.h"
+
+/* Machine state while JIT code runs:
+ *
+ *   rbx  the stack top, vm.stack.top while it is in a register
+ *   r12  vm.stack.data, the base for locals
+ *   r13  vm.globals.values
+ *
+ * All three are callee-saved, so they survive calls into C. Anything
+ * that needs C, such as strings, printing or reporting an error, goes
+ * through slow_path(), which works on vm.stack like run() does. rbx is
+ * written back to vm.stack.top around those calls.
+ */
+typedef struct {
+    int position;       /* of the rel32 to patch */
+    int target;         /* bytecode offset, or EXIT_ERROR */
+} Fixup;
+
+#define EXIT_ERROR -1
+
+static CodeBuffer buffer;
+static Fixup* fixups;
+static int fixup_count;
+static int fixup_capacity;
+
+static uint8_t* native_code = NULL;
+static size_t native_size = 0;
+/* Native address of each instruction, where a trace hands back to. */
+static uint8_t** native_targets = NULL;
+static int native_target_count = 0;
+
+
+static void add_fixup(int position, int target) {
+    if (fixup_capacity < fixup_count + 1) {
+        int old_capacity = fixup_capacity;
+        fixup_capacity = GROW_CAPACITY(old_capacity);
+        fixups = GROW_ARRAY(Fixup, fixups, old_capacity, fixup_capacity);
+    }
+    fixups[fixup_count].position = position;
+    fixups[fixup_count].target = target;
+    fixup_count++;
+}
+
+
+/* Runs the instruction at offset in C. Only reached when its template
+ * cannot finish the job: the operands are not numbers, a global is
+ * undefined, or the instruction needs C anyway. Returns true if it
+ * raised a runtime error.
+ */
+static bool slow_path(int offset) {
+    uint8_t* code = vm.chunk->code + offset;
+    /* runtime_error() takes the line from the instruction before ip. */
+    vm.ip = code + 1;
+
+    switch (code[0]) {
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR: {
+            Value b = peek(&vm.stack, 0);
+            Value a = peek(&vm.stack, 1);
+            if (!IS_STRING(a) || !IS_STRING(b)) {
+                runtime_error("Operands must be two numbers or two strings.");
+                return true;
+            }
+            Value result;
+            if (!concatenate_strings(a, b, &result)) {
+                runtime_error("String too long.");
+                return true;
+            }
+            vm.stack.top -= 2;
+            push(&vm.stack, result);
+            return false;
+        }
+        case OP_ADD_N: {
+            int count = code[1];
+            Value* values = vm.stack.top - count;
+            Value result = values[0];
+            for (int i = 1; i < count; i++) {
+                Value b = values[i];
+                if (IS_NUMBER(result) && IS_NUMBER(b)) {
+                    result = NUMBER_VAL(AS_NUMBER(result) + AS_NUMBER(b));
+                } else if (IS_STRING(result) && IS_STRING(b)) {
+                    if (!concatenate_strings(result, b, &result)) {
+                        runtime_error("String too long.");
+                        return true;
+                    }
+                } else {
+                    runtime_error("Operands must be two numbers or two strings.");
+                    return true;
+                }
+            }
+            vm.stack.top = values;
+            push(&vm.stack, result);
+            return false;
+        }
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM: {
+            Value b = peek(&vm.stack, 0);
+            Value a = peek(&vm.stack, 1);
+            Value result;
+            bool repeated;
+            if (IS_STRING(a) && IS_NUMBER(b)) {
+                repeated = repeat_string(a, AS_NUMBER(b), &result);
+            } else if (IS_NUMBER(a) && IS_STRING(b)) {
+                repeated = repeat_string(b, AS_NUMBER(a), &result);
+            } else {
+                runtime_error("Operands must be two numbers or a string and a number.");
+                return true;
+            }
+            if (!repeated) {
+                runtime_error("String too long.");
+                return true;
+            }
+            vm.stack.top -= 2;
+            push(&vm.stack, result);
+            return false;
+        }
+        case OP_EQUAL:
+        case OP_NOT_EQUAL: {
+            Value b = pop(&vm.stack);
+            Value a = pop(&vm.stack);
+            push(&vm.stack, BOOL_VAL(values_equal(a, b) == (code[0] == OP_EQUAL)));
+            return false;
+        }
+        case OP_NEGATE:
+            runtime_error("Operand must be a number.");
+            return true;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            runtime_error("Undefined variable '%s'.",
+                AS_CSTRING(vm.global_names.values[code[1]]));
+            return true;
+        case OP_PRINT:
+            print_value(pop(&vm.stack));
+            printf("\n");
+            return false;
+        case OP_FOR_LOOP:
+            if (!IS_NUMBER(vm.stack.data[code[1]])) {
+                runtime_error("Operands must be two numbers or two strings.");
+            } else if ((code[3] & ~FOR_INCLUSIVE) == FOR_GLOBAL &&
+                       IS_UNDEFINED(vm.globals.values[code[4]])) {
+                runtime_error("Undefined variable '%s'.",
+                    AS_CSTRING(vm.global_names.values[code[4]]));
+            } else {
+                runtime_error("Operands must be numbers.");
+            }
+            return true;
+        default:
+            runtime_error("Operands must be numbers.");
+            return true;
+    }
+}
+
+static void emit_slow_path(int offset) {
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.stack.top);
+    EMIT(&buffer, 0x48, 0x89, 0x18);                 /* mov [rax], rbx */
+    EMIT(&buffer, 0xBF); emit_u32(&buffer, offset);           /* mov edi, offset */
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)slow_path);
+    EMIT(&buffer, 0xFF, 0xD0);                       /* call rax */
+    EMIT(&buffer, 0x84, 0xC0);                       /* test al, al */
+    add_fixup(emit_jcc(&buffer, JNE), EXIT_ERROR);
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.stack.top);
+    EMIT(&buffer, 0x48, 0x8B, 0x18);                 /* mov rbx, [rax] */
+}
+
+/* Returns a jump to patch that is taken unless reg holds a number.
+ * Expects QNAN in rcx. */
+static int emit_unless_number(int reg) {
+    EMIT(&buffer, 0x48, 0x89, 0xC0 | (reg << 3) | RSI);  /* mov rsi, reg */
+    EMIT(&buffer, 0x48, 0x21, 0xCE);                     /* and rsi, rcx */
+    EMIT(&buffer, 0x48, 0x39, 0xCE);                     /* cmp rsi, rcx */
+    return emit_jcc(&buffer, JE);
+}
+
+/* Loads the top two values into rax (a) and rdx (b), and xmm0 and
+ * xmm1 if both are numbers. Otherwise jumps to the returned patches.
+ * Unless checked, they are known to be numbers and the patches are -1.
+ */
+static void emit_number_operands(bool checked, int* not_a, int* not_b) {
+    EMIT(&buffer, 0x48, 0x8B, 0x43, 0xF0);           /* mov rax, [rbx-16] */
+    EMIT(&buffer, 0x48, 0x8B, 0x53, 0xF8);           /* mov rdx, [rbx-8] */
+    *not_a = *not_b = -1;
+    if (checked) {
+        emit_mov_imm64(&buffer, RCX, QNAN);
+        *not_a = emit_unless_number(RAX);
+        *not_b = emit_unless_number(RDX);
+    }
+    EMIT(&buffer, 0x66, 0x48, 0x0F, 0x6E, 0xC0);     /* movq xmm0, rax */
+    EMIT(&buffer, 0x66, 0x48, 0x0F, 0x6E, 0xCA);     /* movq xmm1, rdx */
+}
+
+/* Ends a template whose fast path fell through: the code after it is
+ * the slow path, and the fast path skips over it. There is none if
+ * nothing was checked. */
+static void emit_slow_tail(int offset, int not_a, int not_b) {
+    if (not_a < 0)
+        return;
+    int done = emit_jmp(&buffer);
+    patch_here(&buffer, not_a);
+    if (not_b >= 0)
+        patch_here(&buffer, not_b);
+    emit_slow_path(offset);
+    patch_here(&buffer, done);
+}
+
+/* a = a op b for the arithmetic SSE2 opcode op. */
+static void emit_arithmetic(int offset, uint8_t op, bool checked) {
+    int not_a, not_b;
+    emit_number_operands(checked, &not_a, &not_b);
+    EMIT(&buffer, 0xF2, 0x0F, op, 0xC1);             /* op xmm0, xmm1 */
+    EMIT(&buffer, 0x66, 0x48, 0x0F, 0x7E, 0xC0);     /* movq rax, xmm0 */
+    EMIT(&buffer, 0x48, 0x89, 0x43, 0xF0);           /* mov [rbx-16], rax */
+    EMIT(&buffer, 0x48, 0x83, 0xEB, 0x08);           /* sub rbx, 8 */
+    emit_slow_tail(offset, not_a, not_b);
+}
+
+/* Turns the flag in al into a bool and replaces the two operands. */
+static void emit_store_bool() {
+    EMIT(&buffer, 0x0F, 0xB6, 0xC0);                 /* movzx eax, al */
+    emit_mov_imm64(&buffer, RCX, FALSE_VAL);
+    EMIT(&buffer, 0x48, 0x01, 0xC8);                 /* add rax, rcx */
+    EMIT(&buffer, 0x48, 0x89, 0x43, 0xF0);           /* mov [rbx-16], rax */
+    EMIT(&buffer, 0x48, 0x83, 0xEB, 0x08);           /* sub rbx, 8 */
+}
+
+/* a < b, or a > b. Unordered compares as false, and so as true once
+ * negated. */
+static void emit_compare(int offset, bool less, bool negate, bool checked) {
+    int not_a, not_b;
+    emit_number_operands(checked, &not_a, &not_b);
+    if (less)
+        EMIT(&buffer, 0x66, 0x0F, 0x2E, 0xC8);       /* ucomisd xmm1, xmm0 */
+    else
+        EMIT(&buffer, 0x66, 0x0F, 0x2E, 0xC1);       /* ucomisd xmm0, xmm1 */
+    if (negate)
+        EMIT(&buffer, 0x0F, 0x96, 0xC0);             /* setbe al */
+    else
+        EMIT(&buffer, 0x0F, 0x97, 0xC0);             /* seta al */
+    emit_store_bool();
+    emit_slow_tail(offset, not_a, not_b);
+}
+
+static void emit_equal(int offset, bool negate) {
+    int not_a, not_b;
+    emit_number_operands(true, &not_a, &not_b);
+    EMIT(&buffer, 0x66, 0x0F, 0x2E, 0xC1);           /* ucomisd xmm0, xmm1 */
+    EMIT(&buffer, 0x0F, 0x94, 0xC0);                 /* sete al */
+    EMIT(&buffer, 0x0F, 0x9B, 0xC1);                 /* setnp cl */
+    EMIT(&buffer, 0x20, 0xC8);                       /* and al, cl */
+    int done = emit_jmp(&buffer);
+
+    /* Anything else is equal when the bits are. Differing objects may
+     * still be strings with the same characters, which C works out. */
+    patch_here(&buffer, not_a);
+    patch_here(&buffer, not_b);
+    EMIT(&buffer, 0x48, 0x39, 0xD0);                 /* cmp rax, rdx */
+    EMIT(&buffer, 0x0F, 0x94, 0xC0);                 /* sete al */
+    int same = emit_jcc(&buffer, JE);
+    emit_mov_imm64(&buffer, RCX, SIGN_BIT | QNAN);
+    int object = emit_unless_number(RAX);            /* jumps on an object */
+    patch_here(&buffer, same);
+    patch_here(&buffer, done);
+    if (negate)
+        EMIT(&buffer, 0x34, 0x01);                   /* xor al, 1 */
+    emit_store_bool();
+    emit_slow_tail(offset, object, -1);
+}
+
+/* Sets dl to whether the value in rax is falsey, following
+ * is_falsey(). Clobbers rcx. */
+static void emit_falsey() {
+    EMIT(&buffer, 0x48, 0x89, 0xC1);                 /* mov rcx, rax */
+    emit_mov_imm64(&buffer, RDX, NIL_VAL);
+    EMIT(&buffer, 0x48, 0x29, 0xD1);                 /* sub rcx, rdx */
+    EMIT(&buffer, 0x48, 0x83, 0xF9, FALSE_VAL - NIL_VAL); /* cmp rcx, FALSE-NIL */
+    EMIT(&buffer, 0x0F, 0x96, 0xC2);                 /* setbe dl */
+    EMIT(&buffer, 0x48, 0x89, 0xC1);                 /* mov rcx, rax */
+    EMIT(&buffer, 0x48, 0x01, 0xC9);                 /* add rcx, rcx */
+    EMIT(&buffer, 0x0F, 0x94, 0xC1);                 /* sete cl */
+    EMIT(&buffer, 0x08, 0xCA);                       /* or dl, cl */
+}
+
+static void emit_push_rax() {
+    EMIT(&buffer, 0x48, 0x89, 0x03);                 /* mov [rbx], rax */
+    EMIT(&buffer, 0x48, 0x83, 0xC3, 0x08);           /* add rbx, 8 */
+}
+
+static void emit_push_constant(Value value) {
+    emit_mov_imm64(&buffer, RAX, value);
+    emit_push_rax();
+}
+
+static void emit_get_local(uint8_t slot) {
+    EMIT(&buffer, 0x49, 0x8B, 0x84, 0x24);           /* mov rax, [r12+slot*8] */
+    emit_u32(&buffer, slot * sizeof(Value));
+    emit_push_rax();
+}
+
+static void emit_set_local(uint8_t slot) {
+    EMIT(&buffer, 0x48, 0x8B, 0x43, 0xF8);           /* mov rax, [rbx-8] */
+    EMIT(&buffer, 0x49, 0x89, 0x84, 0x24);           /* mov [r12+slot*8], rax */
+    emit_u32(&buffer, slot * sizeof(Value));
+}
+
+/* Jumps to the returned patch if global slot is undefined, with the
+ * global left in rax. */
+static int emit_unless_defined(uint8_t slot) {
+    EMIT(&buffer, 0x49, 0x8B, 0x85);                 /* mov rax, [r13+slot*8] */
+    emit_u32(&buffer, slot * sizeof(Value));
+    emit_mov_imm64(&buffer, RCX, UNDEFINED_VAL);
+    EMIT(&buffer, 0x48, 0x39, 0xC8);                 /* cmp rax, rcx */
+    return emit_jcc(&buffer, JE);
+}
+
+static void emit_set_global(int offset, uint8_t slot, bool pop) {
+    int undefined = emit_unless_defined(slot);
+    EMIT(&buffer, 0x48, 0x8B, 0x43, 0xF8);           /* mov rax, [rbx-8] */
+    EMIT(&buffer, 0x49, 0x89, 0x85);                 /* mov [r13+slot*8], rax */
+    emit_u32(&buffer, slot * sizeof(Value));
+    if (pop)
+        EMIT(&buffer, 0x48, 0x83, 0xEB, 0x08);       /* sub rbx, 8 */
+    emit_slow_tail(offset, undefined, -1);
+}
+
+/* Jumps to target unless a < b, or unless a > b. Unordered sets the
+ * carry flag, so NaN operands take the jump as !(a < b) would. */
+static void emit_jump_unless_compare(int offset, int target, bool less,
+                                     bool checked) {
+    int not_a, not_b;
+    emit_number_operands(checked, &not_a, &not_b);
+    EMIT(&buffer, 0x48, 0x83, 0xEB, 0x10);           /* sub rbx, 16 */
+    if (less)
+        EMIT(&buffer, 0x66, 0x0F, 0x2E, 0xC8);       /* ucomisd xmm1, xmm0 */
+    else
+        EMIT(&buffer, 0x66, 0x0F, 0x2E, 0xC1);       /* ucomisd xmm0, xmm1 */
+    add_fixup(emit_jcc(&buffer, JBE), target);
+    emit_slow_tail(offset, not_a, not_b);
+}
+
+static void emit_prologue() {
+    EMIT(&buffer, 0x53);                             /* push rbx */
+    EMIT(&buffer, 0x41, 0x54);                       /* push r12 */
+    EMIT(&buffer, 0x41, 0x55);                       /* push r13 */
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.stack.top);
+    EMIT(&buffer, 0x48, 0x8B, 0x18);                 /* mov rbx, [rax] */
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.stack.data);
+    EMIT(&buffer, 0x4C, 0x8B, 0x20);                 /* mov r12, [rax] */
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.globals.values);
+    EMIT(&buffer, 0x4C, 0x8B, 0x28);                 /* mov r13, [rax] */
+}
+
+static void emit_epilogue(int result) {
+    EMIT(&buffer, 0xB8); emit_u32(&buffer, result);           /* mov eax, result */
+    EMIT(&buffer, 0x41, 0x5D);                       /* pop r13 */
+    EMIT(&buffer, 0x41, 0x5C);                       /* pop r12 */
+    EMIT(&buffer, 0x5B);                             /* pop rbx */
+    EMIT(&buffer, 0xC3);                             /* ret */
+}
+
+static int jump_target(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    if (code[0] == OP_FOR_LOOP)
+        return offset + 7 - ((code[5] << 8) | code[6]);
+    uint16_t jump = (code[1] << 8) | code[2];
+    return code[0] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+/* Saves ip in vm.ip, as run() does on every jump, so a stack overflow
+ * can be put down to the instruction that caused it. */
+static void emit_save_ip(uint8_t* ip) {
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.ip);
+    emit_mov_imm64(&buffer, RCX, (uint64_t)(uintptr_t)ip);
+    EMIT(&buffer, 0x48, 0x89, 0x08);                 /* mov [rax], rcx */
+}
+
+/* Every back-edge goes through trace_loop(), which may run the loop
+ * as a trace and come back anywhere in the chunk. */
+static void emit_loop(Chunk* chunk, int offset) {
+    uint8_t* header = chunk->code + jump_target(chunk, offset);
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.stack.top);
+    EMIT(&buffer, 0x48, 0x89, 0x18);                 /* mov [rax], rbx */
+    emit_mov_imm64(&buffer, RDI, (uint64_t)(uintptr_t)header);
+    emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)trace_loop);
+    EMIT(&buffer, 0xFF, 0xD0);                       /* call rax */
+    emit_mov_imm64(&buffer, RCX, (uint64_t)(uintptr_t)&vm.ip);
+    EMIT(&buffer, 0x48, 0x89, 0x01);                 /* mov [rcx], rax */
+    emit_mov_imm64(&buffer, RCX, (uint64_t)(uintptr_t)&vm.stack.top);
+    EMIT(&buffer, 0x48, 0x8B, 0x19);                 /* mov rbx, [rcx] */
+    emit_mov_imm64(&buffer, RCX, (uint64_t)(uintptr_t)header);
+    EMIT(&buffer, 0x48, 0x39, 0xC8);                 /* cmp rax, rcx */
+    add_fixup(emit_jcc(&buffer, JE), jump_target(chunk, offset));
+    emit_mov_imm64(&buffer, RCX, (uint64_t)(uintptr_t)chunk->code);
+    EMIT(&buffer, 0x48, 0x29, 0xC8);                 /* sub rax, rcx */
+    emit_mov_imm64(&buffer, RCX, (uint64_t)(uintptr_t)native_targets);
+    EMIT(&buffer, 0xFF, 0x24, 0xC1);                 /* jmp [rcx+rax*8] */
+}
+
+/* Adds the step to the counter, leaves the loop unless it still passes
+ * the test, and otherwise takes the back-edge. Either operand failing
+ * to be a number is an error, which C reports. */
+static void emit_for_loop(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    EMIT(&buffer, 0x49, 0x8B, 0x84, 0x24);           /* mov rax, [r12+slot*8] */
+    emit_u32(&buffer, code[1] * sizeof(Value));
+    emit_mov_imm64(&buffer, RCX, QNAN);
+    int not_counter = emit_unless_number(RAX);
+    EMIT(&buffer, 0x66, 0x48, 0x0F, 0x6E, 0xC0);     /* movq xmm0, rax */
+    emit_mov_imm64(&buffer, RAX, chunk->constants.values[code[2]]);
+    EMIT(&buffer, 0x66, 0x48, 0x0F, 0x6E, 0xC8);     /* movq xmm1, rax */
+    EMIT(&buffer, 0xF2, 0x0F, 0x58, 0xC1);           /* addsd xmm0, xmm1 */
+    EMIT(&buffer, 0x66, 0x48, 0x0F, 0x7E, 0xC0);     /* movq rax, xmm0 */
+    EMIT(&buffer, 0x49, 0x89, 0x84, 0x24);           /* mov [r12+slot*8], rax */
+    emit_u32(&buffer, code[1] * sizeof(Value));
+
+    int undefined = -1;
+    switch (code[3] & ~FOR_INCLUSIVE) {
+        case FOR_CONSTANT:
+            emit_mov_imm64(&buffer, RAX, chunk->constants.values[code[4]]);
+            break;
+        case FOR_LOCAL:
+            EMIT(&buffer, 0x49, 0x8B, 0x84, 0x24);   /* mov rax, [r12+limit*8] */
+            emit_u32(&buffer, code[4] * sizeof(Value));
+            break;
+        default:
+            undefined = emit_unless_defined(code[4]);
+            break;
+    }
+    emit_mov_imm64(&buffer, RCX, QNAN);
+    int not_limit = emit_unless_number(RAX);
+    EMIT(&buffer, 0x66, 0x48, 0x0F, 0x6E, 0xC8);     /* movq xmm1, rax */
+    /* Unordered sets the carry flag, so a NaN stays in a <= loop, as
+     * !(value > limit) does, and leaves a < loop. */
+    if (code[3] & FOR_INCLUSIVE) {
+        EMIT(&buffer, 0x66, 0x0F, 0x2E, 0xC1);       /* ucomisd xmm0, xmm1 */
+        add_fixup(emit_jcc(&buffer, JA), offset + 7);
+    } else {
+        EMIT(&buffer, 0x66, 0x0F, 0x2E, 0xC8);       /* ucomisd xmm1, xmm0 */
+        add_fixup(emit_jcc(&buffer, JBE), offset + 7);
+    }
+    emit_loop(chunk, offset);
+
+    patch_here(&buffer, not_counter);
+    if (undefined >= 0)
+        patch_here(&buffer, undefined);
+    patch_here(&buffer, not_limit);
+    emit_slow_path(offset);
+}
+
+static bool emit_instruction(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            emit_push_constant(chunk->constants.values[code[1]]);
+            return true;
+        case OP_CONSTANT_LONG:
+            emit_push_constant(chunk->constants.values[
+                (code[1] << 16) | (code[2] << 8) | code[3]]);
+            return true;
+        case OP_NIL:
+            emit_push_constant(NIL_VAL);
+            return true;
+        case OP_TRUE:
+            emit_push_constant(TRUE_VAL);
+            return true;
+        case OP_FALSE:
+            emit_push_constant(FALSE_VAL);
+            return true;
+        case OP_POP:
+            EMIT(&buffer, 0x48, 0x83, 0xEB, 0x08);   /* sub rbx, 8 */
+            return true;
+        case OP_GET_LOCAL:
+            emit_get_local(code[1]);
+            return true;
+        case OP_GET_LOCALS:
+            emit_get_local(code[1]);
+            emit_get_local(code[2]);
+            return true;
+        case OP_SET_LOCAL:
+            emit_set_local(code[1]);
+            return true;
+        case OP_SET_LOCAL_POP:
+            emit_set_local(code[1]);
+            EMIT(&buffer, 0x48, 0x83, 0xEB, 0x08);   /* sub rbx, 8 */
+            return true;
+
+        case OP_GET_GLOBAL: {
+            int undefined = emit_unless_defined(code[1]);
+            emit_push_rax();
+            emit_slow_tail(offset, undefined, -1);
+            return true;
+        }
+        case OP_SET_GLOBAL:
+            emit_set_global(offset, code[1], false);
+            return true;
+        case OP_SET_GLOBAL_POP:
+            emit_set_global(offset, code[1], true);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            EMIT(&buffer, 0x48, 0x8B, 0x43, 0xF8);   /* mov rax, [rbx-8] */
+            EMIT(&buffer, 0x49, 0x89, 0x85);         /* mov [r13+slot*8], rax */
+            emit_u32(&buffer, code[1] * sizeof(Value));
+            EMIT(&buffer, 0x48, 0x83, 0xEB, 0x08);   /* sub rbx, 8 */
+            return true;
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            emit_arithmetic(offset, 0x58, true);    /* addsd */
+            return true;
+        case OP_ADD_N:
+            emit_slow_path(offset);
+            return true;
+        case OP_SUBTRACT:
+            emit_arithmetic(offset, 0x5C, true);    /* subsd */
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            emit_arithmetic(offset, 0x59, true);    /* mulsd */
+            return true;
+        case OP_DIVIDE:
+            emit_arithmetic(offset, 0x5E, true);    /* divsd */
+            return true;
+        case OP_ADD_UNCHECKED:
+            emit_arithmetic(offset, 0x58, false);
+            return true;
+        case OP_SUBTRACT_UNCHECKED:
+            emit_arithmetic(offset, 0x5C, false);
+            return true;
+        case OP_MULTIPLY_UNCHECKED:
+            emit_arithmetic(offset, 0x59, false);
+            return true;
+        case OP_DIVIDE_UNCHECKED:
+            emit_arithmetic(offset, 0x5E, false);
+            return true;
+        case OP_GREATER:
+        case OP_LESS_EQUAL:
+            emit_compare(offset, false, code[0] == OP_LESS_EQUAL, true);
+            return true;
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+            emit_compare(offset, true, code[0] == OP_GREATER_EQUAL, true);
+            return true;
+        case OP_GREATER_UNCHECKED:
+            emit_compare(offset, false, false, false);
+            return true;
+        case OP_LESS_UNCHECKED:
+            emit_compare(offset, true, false, false);
+            return true;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            emit_equal(offset, code[0] == OP_NOT_EQUAL);
+            return true;
+        case OP_NOT:
+            EMIT(&buffer, 0x48, 0x8B, 0x43, 0xF8);   /* mov rax, [rbx-8] */
+            emit_falsey();
+            EMIT(&buffer, 0x0F, 0xB6, 0xC2);         /* movzx eax, dl */
+            emit_mov_imm64(&buffer, RCX, FALSE_VAL);
+            EMIT(&buffer, 0x48, 0x01, 0xC8);         /* add rax, rcx */
+            EMIT(&buffer, 0x48, 0x89, 0x43, 0xF8);   /* mov [rbx-8], rax */
+            return true;
+        case OP_NEGATE: {
+            EMIT(&buffer, 0x48, 0x8B, 0x43, 0xF8);   /* mov rax, [rbx-8] */
+            emit_mov_imm64(&buffer, RCX, QNAN);
+            int not_number = emit_unless_number(RAX);
+            emit_mov_imm64(&buffer, RCX, SIGN_BIT);
+            EMIT(&buffer, 0x48, 0x31, 0xC8);         /* xor rax, rcx */
+            EMIT(&buffer, 0x48, 0x89, 0x43, 0xF8);   /* mov [rbx-8], rax */
+            emit_slow_tail(offset, not_number, -1);
+            return true;
+        }
+        case OP_NEGATE_UNCHECKED:
+            emit_mov_imm64(&buffer, RAX, SIGN_BIT);
+            EMIT(&buffer, 0x48, 0x31, 0x43, 0xF8);   /* xor [rbx-8], rax */
+            return true;
+        case OP_PRINT:
+            emit_slow_path(offset);
+            return true;
+
+        case OP_JUMP:
+            add_fixup(emit_jmp(&buffer), jump_target(chunk, offset));
+            return true;
+        case OP_LOOP:
+            emit_loop(chunk, offset);
+            return true;
+        case OP_FOR_LOOP:
+            emit_for_loop(chunk, offset);
+            return true;
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            EMIT(&buffer, 0x48, 0x8B, 0x43, 0xF8);   /* mov rax, [rbx-8] */
+            if (code[0] == OP_POP_JUMP_IF_FALSE)
+                EMIT(&buffer, 0x48, 0x83, 0xEB, 0x08); /* sub rbx, 8 */
+            emit_falsey();
+            EMIT(&buffer, 0x84, 0xD2);               /* test dl, dl */
+            add_fixup(emit_jcc(&buffer, JNE), jump_target(chunk, offset));
+            return true;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+            emit_jump_unless_compare(offset, jump_target(chunk, offset), true,
+                code[0] == OP_JUMP_IF_NOT_LESS);
+            return true;
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+            emit_jump_unless_compare(offset, jump_target(chunk, offset), false,
+                code[0] == OP_JUMP_IF_NOT_GREATER);
+            return true;
+
+        case OP_RETURN:
+            emit_mov_imm64(&buffer, RAX, (uint64_t)(uintptr_t)&vm.stack.top);
+            EMIT(&buffer, 0x48, 0x89, 0x18);         /* mov [rax], rbx */
+            emit_epilogue(INTERPRET_OK);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Describes the code to perf, one symbol per run of instructions from
+ * the same source line. */
+static void write_perf_map(Chunk* chunk, int* native_offsets) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE* file = fopen(path, "a");
+    if (file == NULL)
+        return;
+
+    int start = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        int next = offset + instruction_length(chunk->code[offset]);
+        if (next >= chunk->count ||
+            get_line(chunk, next) != get_line(chunk, offset)) {
+            int end = next < chunk->count
+                ? native_offsets[next]
+                : (int)buffer.count;
+            fprintf(file, "%lx %x lox_script_line_%lu\n",
+                (unsigned long)(uintptr_t)(native_code + native_offsets[start]),
+                (unsigned)(end - native_offsets[start]),
+                (unsigned long)get_line(chunk, offset));
+            start = next;
+        }
+        offset = next;
+    }
+    fclose(file);
+}
+
+/* Marks where code goes on after a forward or conditional jump, the
+ * places translate() saves vm.ip. Back-edges save it in emit_loop(). */
+static void find_jump_ends(Chunk* chunk, bool* jump_ends) {
+    for (int offset = 0; offset + 3 <= chunk->count;
+         offset += instruction_length(chunk->code[offset])) {
+        switch (chunk->code[offset]) {
+            case OP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+                jump_ends[offset + 3] = true;
+                break;
+            case OP_FOR_LOOP:
+                jump_ends[offset + 7] = true;
+                continue;
+            case OP_JUMP:
+                break;
+            default:
+                continue;
+        }
+        int target = jump_target(chunk, offset);
+        if (target >= 0 && target <= chunk->count)
+            jump_ends[target] = true;
+    }
+}
+
+static bool translate(Chunk* chunk, int* native_offsets, bool* jump_ends) {
+    emit_prologue();
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t opcode = chunk->code[offset];
+        int length = instruction_length(opcode);
+        if (offset + length > chunk->count)
+            return false;
+        native_offsets[offset] = buffer.count;
+        if (jump_ends[offset])
+            emit_save_ip(chunk->code + offset);
+        if (!emit_instruction(chunk, offset))
+            return false;
+        offset += length;
+    }
+
+    int exit_error = buffer.count;
+    emit_epilogue(INTERPRET_RUNTIME_ERROR);
+
+    for (int i = 0; i < fixup_count; i++) {
+        int target = fixups[i].target;
+        if (target == EXIT_ERROR) {
+            patch_rel32(&buffer, fixups[i].position, exit_error);
+        } else if (target >= 0 && target < chunk->count &&
+                   native_offsets[target] != -1) {
+            patch_rel32(&buffer, fixups[i].position, native_offsets[target]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Compiles chunk to machine code and returns it as a function that
+ * runs the chunk like run() does. Returns NULL if the chunk holds
+ * something the JIT cannot translate.
+ */
+StackBody jit_compile(Chunk* chunk) {
+    jit_free();
+
+    init_code_buffer(&buffer);
+    fixups = NULL;
+    fixup_count = 0;
+    fixup_capacity = 0;
+    int* native_offsets = ALLOCATE(int, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset++)
+        native_offsets[offset] = -1;
+
+    bool* jump_ends = ALLOCATE(bool, chunk->count + 1);
+    for (int offset = 0; offset <= chunk->count; offset++)
+        jump_ends[offset] = false;
+    find_jump_ends(chunk, jump_ends);
+
+    native_target_count = chunk->count;
+    native_targets = ALLOCATE(uint8_t*, native_target_count);
+
+    bool success = translate(chunk, native_offsets, jump_ends);
+    if (success) {
+        native_code = map_code(&buffer, &native_size);
+        success = native_code != NULL;
+    }
+    for (int offset = 0; success && offset < chunk->count; offset++) {
+        native_targets[offset] = native_offsets[offset] == -1
+            ? NULL
+            : native_code + native_offsets[offset];
+    }
+    if (success && vm.jit_perf_map)
+        write_perf_map(chunk, native_offsets);
+
+    FREE_ARRAY(int, native_offsets, chunk->count);
+    FREE_ARRAY(bool, jump_ends, chunk->count + 1);
+    FREE_ARRAY(Fixup, fixups, fixup_capacity);
+    free_code_buffer(&buffer);
+    return success ? (StackBody)native_code : NULL;
+}
+
+void jit_free() {
+    if (native_code != NULL)
+        unmap_code(native_code, native_size);
+    native_code = NULL;
+    native_size = 0;
+    FREE_ARRAY(uint8_t*, native_targets, native_target_count);
+    native_targets = NULL;
+    native_target_count = 0;
+}
+
+#else
+
+StackBody jit_compile(Chunk* chunk) {
+    return NULL;
+}
+
+void jit_free() {
+}
+
+#endif
@@ -0,0 +1,478 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+#include "memory.h"
+
+/* The chunk is cut into basic blocks, and blocks are chained together
+ * along the edges between them, heaviest edge first, as long as both
+ * ends are still free (Pettis and Hansen). The chains are then written
+ * out one after another: the one holding the entry first, then those
+ * that ran, then those that never did.
+ */
+
+typedef enum {
+    END_FALL,           /* runs on into the next block */
+    END_RETURN,
+    END_JUMP,           /* OP_JUMP or OP_LOOP */
+    END_BRANCH,         /* a conditional jump that can be inverted */
+    END_FIXED,          /* one that cannot, so its next block stays next */
+} BlockEnd;
+
+typedef struct {
+    int start;          /* offset of the first instruction */
+    int last;           /* offset of the last instruction */
+    int end;            /* offset past the last instruction */
+    BlockEnd kind;
+    int target;         /* block the final jump goes to, or -1 */
+    uint64_t count;     /* times the block ran */
+    uint64_t taken;     /* times the final jump was taken */
+    uint64_t fallen;    /* times it went on to the next block */
+    int prev;           /* neighbours in its chain, or -1 */
+    int next;
+} Block;
+
+typedef struct {
+    int from;
+    int to;
+    uint64_t weight;
+    bool fall;          /* to the next block rather than by a jump */
+} Edge;
+
+typedef struct {
+    uint8_t bytes[7];
+    int length;
+    size_t line;
+    int target;         /* block jumped to, or -1 */
+    int landing;        /* instruction jumped to instead, or -1 */
+} Instruction;
+
+/* The conditional jump taken exactly when op is not, or -1. */
+static int inverse(uint8_t op) {
+    switch (op) {
+        case OP_POP_JUMP_IF_FALSE: return OP_POP_JUMP_IF_TRUE;
+        case OP_POP_JUMP_IF_TRUE: return OP_POP_JUMP_IF_FALSE;
+        case OP_JUMP_IF_NOT_LESS: return OP_JUMP_IF_LESS;
+        case OP_JUMP_IF_LESS: return OP_JUMP_IF_NOT_LESS;
+        case OP_JUMP_IF_NOT_GREATER: return OP_JUMP_IF_GREATER;
+        case OP_JUMP_IF_GREATER: return OP_JUMP_IF_NOT_GREATER;
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED: return OP_JUMP_IF_LESS_UNCHECKED;
+        case OP_JUMP_IF_LESS_UNCHECKED: return OP_JUMP_IF_NOT_LESS_UNCHECKED;
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+            return OP_JUMP_IF_GREATER_UNCHECKED;
+        case OP_JUMP_IF_GREATER_UNCHECKED:
+            return OP_JUMP_IF_NOT_GREATER_UNCHECKED;
+        default: return -1;
+    }
+}
+
+static BlockEnd end_kind(uint8_t op) {
+    switch (op) {
+        case OP_RETURN:
+            return END_RETURN;
+        case OP_JUMP:
+        case OP_LOOP:
+            return END_JUMP;
+        case OP_JUMP_IF_FALSE:
+        case OP_FOR_LOOP:
+            return END_FIXED;
+        default:
+            return inverse(op) != -1 ? END_BRANCH : END_FALL;
+    }
+}
+
+static bool is_long_jump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_backward(uint8_t op) {
+    return op == OP_LOOP || op == OP_FOR_LOOP;
+}
+
+/* The offset a jump at offset goes to. Every jump keeps its offset in
+ * its last two bytes. */
+static int jump_target(Chunk* chunk, int offset) {
+    uint8_t op = chunk->code[offset];
+    int end = offset + instruction_length(op);
+    int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return is_backward(op) ? end - jump : end + jump;
+}
+
+/* Cuts the chunk into blocks. Returns the number of blocks, or -1 if
+ * the code does not decode cleanly or has long jumps, which only
+ * chunks too big to be worth laying out have. */
+static int find_blocks(Chunk* chunk, Block* blocks) {
+    bool* starts = ALLOCATE(bool, chunk->count + 1);
+    bool* leaders = ALLOCATE(bool, chunk->count + 1);
+    memset(starts, 0, sizeof(bool) * (chunk->count + 1));
+    memset(leaders, 0, sizeof(bool) * (chunk->count + 1));
+
+    bool valid = true;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        int length = instruction_length(op);
+        if (offset + length > chunk->count || is_long_jump(op)) {
+            valid = false;
+            break;
+        }
+        starts[offset] = true;
+        offset += length;
+    }
+
+    leaders[0] = true;
+    for (int offset = 0; valid && offset < chunk->count;
+         offset += instruction_length(chunk->code[offset])) {
+        BlockEnd kind = end_kind(chunk->code[offset]);
+        if (kind == END_FALL)
+            continue;
+        leaders[offset + instruction_length(chunk->code[offset])] = true;
+        if (kind == END_RETURN)
+            continue;
+
+        int target = jump_target(chunk, offset);
+        if (target < 0 || target >= chunk->count || !starts[target])
+            valid = false;
+        else
+            leaders[target] = true;
+    }
+
+    int count = 0;
+    for (int offset = 0; valid && offset < chunk->count;) {
+        Block* block = &blocks[count++];
+        block->start = offset;
+        do {
+            block->last = offset;
+            offset += instruction_length(chunk->code[offset]);
+        } while (offset < chunk->count && !leaders[offset]);
+        block->end = offset;
+        block->kind = end_kind(chunk->code[block->last]);
+        block->target = -1;
+        block->count = block->taken = block->fallen = 0;
+        block->prev = block->next = -1;
+    }
+
+    FREE_ARRAY(bool, starts, chunk->count + 1);
+    FREE_ARRAY(bool, leaders, chunk->count + 1);
+    return valid ? count : -1;
+}
+
+static int find_block(Block* blocks, int count, int offset) {
+    int low = 0, high = count - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (blocks[middle].start <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+/* Fills in how often each block ran and left by each of its edges.
+ * Jumps have their own counts. A block that just runs on into the next
+ * passes on however often it ran, which is known by the time the next
+ * block is reached. */
+static void count_blocks(Chunk* chunk, Block* blocks, int count,
+                         BranchProfile* profile) {
+    uint64_t* jumped_in = ALLOCATE(uint64_t, count);
+    memset(jumped_in, 0, sizeof(uint64_t) * count);
+    for (int i = 0; i < count; i++) {
+        Block* block = &blocks[i];
+        if (block->kind == END_FALL || block->kind == END_RETURN)
+            continue;
+        block->target = find_block(blocks, count,
+            jump_target(chunk, block->last));
+        block->taken = profile->taken[block->end];
+        block->fallen = profile->fallen[block->end];
+        jumped_in[block->target] += block->taken;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Block* block = &blocks[i];
+        block->count = jumped_in[i] + (i == 0 ? 1 : blocks[i - 1].fallen);
+        if (block->kind == END_FALL)
+            block->fallen = block->count;
+    }
+    FREE_ARRAY(uint64_t, jumped_in, count);
+}
+
+static int compare_edges(const void* a, const void* b) {
+    const Edge* x = a;
+    const Edge* y = b;
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    if (x->fall != y->fall)
+        return x->fall ? -1 : 1;
+    if (x->from != y->from)
+        return x->from - y->from;
+    return x->to - y->to;
+}
+
+static void add_edge(Edge* edges, int* count, int from, int to,
+                     uint64_t weight, bool fall) {
+    edges[*count].from = from;
+    edges[*count].to = to;
+    edges[*count].weight = weight;
+    edges[*count].fall = fall;
+    (*count)++;
+}
+
+static int chain_head(Block* blocks, int block) {
+    while (blocks[block].prev != -1)
+        block = blocks[block].prev;
+    return block;
+}
+
+/* Links blocks into chains, heaviest edge first. Ties go to the fall
+ * through, so code that never ran keeps its order. */
+static void build_chains(Block* blocks, int count) {
+    Edge* edges = ALLOCATE(Edge, count * 2);
+    int edge_count = 0;
+    for (int i = 0; i < count; i++) {
+        Block* block = &blocks[i];
+        bool has_next = i + 1 < count;
+        switch (block->kind) {
+            case END_FALL:
+            case END_BRANCH:
+                if (has_next)
+                    add_edge(edges, &edge_count, i, i + 1, block->fallen, true);
+                break;
+            case END_FIXED:
+                if (has_next)
+                    add_edge(edges, &edge_count, i, i + 1, UINT64_MAX, true);
+                break;
+            default:
+                break;
+        }
+        if (block->target != -1)
+            add_edge(edges, &edge_count, i, block->target, block->taken, false);
+    }
+    qsort(edges, edge_count, sizeof(Edge), compare_edges);
+
+    for (int i = 0; i < edge_count; i++) {
+        Block* from = &blocks[edges[i].from];
+        Block* to = &blocks[edges[i].to];
+        /* The entry has to stay first. */
+        if (edges[i].to == 0 || from->next != -1 || to->prev != -1 ||
+            chain_head(blocks, edges[i].from) == edges[i].to)
+            continue;
+        from->next = edges[i].to;
+        to->prev = edges[i].from;
+    }
+    FREE_ARRAY(Edge, edges, count * 2);
+}
+
+static bool chain_ran(Block* blocks, int head) {
+    for (int block = head; block != -1; block = blocks[block].next) {
+        if (blocks[block].count > 0)
+            return true;
+    }
+    return false;
+}
+
+/* Lists the blocks in the order they are written out. */
+static void order_chains(Block* blocks, int count, int* order) {
+    int placed = 0;
+    for (int block = 0; block != -1; block = blocks[block].next)
+        order[placed++] = block;
+
+    for (int pass = 0; pass < 2; pass++) {
+        bool ran = pass == 0;
+        for (int head = 1; head < count; head++) {
+            if (blocks[head].prev != -1 || chain_ran(blocks, head) != ran)
+                continue;
+            for (int block = head; block != -1; block = blocks[block].next)
+                order[placed++] = block;
+        }
+    }
+}
+
+static void emit(Instruction* code, int* count, Chunk* chunk, int offset,
+                 int target) {
+    Instruction* instruction = &code[(*count)++];
+    instruction->length = instruction_length(chunk->code[offset]);
+    memcpy(instruction->bytes, &chunk->code[offset], instruction->length);
+    instruction->line = get_line(chunk, offset);
+    instruction->target = target;
+    instruction->landing = -1;
+}
+
+/* Appends an OP_JUMP to block at the end of code, on the line of the
+ * instruction before it. The direction is fixed once offsets are
+ * known. */
+static void emit_jump_to(Instruction* code, int* count, int block) {
+    Instruction* instruction = &code[(*count)++];
+    instruction->bytes[0] = OP_JUMP;
+    instruction->length = 3;
+    instruction->line = code[*count - 2].line;
+    instruction->target = block;
+    instruction->landing = -1;
+}
+
+/* Emits the conditional jump at offset as one that goes to taken and
+ * otherwise on to other. Most jumps can only go forward, so one whose
+ * target now comes first jumps to an OP_JUMP placed right after it
+ * instead, and control that goes on jumps over that. */
+static void emit_branch(Instruction* code, int* count, Chunk* chunk,
+                        int offset, uint8_t op, int taken, int other,
+                        bool taken_ahead, int next) {
+    emit(code, count, chunk, offset, taken);
+    Instruction* branch = &code[*count - 1];
+    branch->bytes[0] = op;
+    if (taken_ahead || is_backward(op)) {
+        if (other != -1 && other != next)
+            emit_jump_to(code, count, other);
+        return;
+    }
+
+    emit_jump_to(code, count, other);
+    branch->target = -1;
+    branch->landing = *count;
+    emit_jump_to(code, count, taken);
+}
+
+/* Writes the blocks out in order. A block whose next block is no
+ * longer next gets a jump to it, or has its final jump inverted if
+ * that jump's target took its place. A jump to the block now next is
+ * dropped. */
+static int emit_blocks(Chunk* chunk, Block* blocks, int count, int* order,
+                       Instruction* code, int* starts) {
+    int* position = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++)
+        position[order[i]] = i;
+
+    int emitted = 0;
+    for (int i = 0; i < count; i++) {
+        int index = order[i];
+        Block* block = &blocks[index];
+        int next = i + 1 < count ? order[i + 1] : -1;
+        int fall = index + 1 < count ? index + 1 : -1;
+        /* A block that ends up empty starts where the next one does,
+         * which is also where control goes on to. */
+        starts[index] = emitted;
+
+        for (int offset = block->start; offset < block->last;
+             offset += instruction_length(chunk->code[offset]))
+            emit(code, &emitted, chunk, offset, -1);
+
+        uint8_t op = chunk->code[block->last];
+        bool target_ahead = block->kind != END_FALL &&
+            block->kind != END_RETURN && position[block->target] > i;
+        bool fall_ahead = fall != -1 && position[fall] > i;
+        switch (block->kind) {
+            case END_FALL:
+                emit(code, &emitted, chunk, block->last, -1);
+                if (fall != -1 && fall != next)
+                    emit_jump_to(code, &emitted, fall);
+                break;
+            case END_RETURN:
+                emit(code, &emitted, chunk, block->last, -1);
+                break;
+            case END_JUMP:
+                if (block->target != next)
+                    emit(code, &emitted, chunk, block->last, block->target);
+                break;
+            case END_BRANCH:
+                /* Turned around if that saves a jump, or makes it go
+                 * forward. */
+                if ((block->target == next && fall != next && fall_ahead) ||
+                    (!target_ahead && fall_ahead)) {
+                    emit_branch(code, &emitted, chunk, block->last,
+                        inverse(op), fall, block->target, fall_ahead, next);
+                    break;
+                }
+                /* Fall through. */
+            case END_FIXED:
+                emit_branch(code, &emitted, chunk, block->last, op,
+                    block->target, fall, target_ahead, next);
+                break;
+        }
+    }
+
+    FREE_ARRAY(int, position, count);
+    return emitted;
+}
+
+/* Turns block targets into offsets, which must fit the direction and
+ * size each jump allows. Returns false if one does not. */
+static bool encode_jumps(Instruction* code, int count, int* starts,
+                         int* offsets) {
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i] = offset;
+        offset += code[i].length;
+    }
+    offsets[count] = offset;
+
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &code[i];
+        int landing;
+        if (instruction->landing != -1)
+            landing = instruction->landing;
+        else if (instruction->target != -1)
+            landing = starts[instruction->target];
+        else
+            continue;
+
+        int jump = offsets[landing] - (offsets[i] + instruction->length);
+        uint8_t op = instruction->bytes[0];
+        if (op == OP_JUMP || op == OP_LOOP) {
+            instruction->bytes[0] = jump < 0 ? OP_LOOP : OP_JUMP;
+        } else if (is_backward(op) != (jump < 0)) {
+            return false;
+        }
+        if (jump < 0)
+            jump = -jump;
+        if (jump > UINT16_MAX)
+            return false;
+
+        uint8_t* operand = &instruction->bytes[instruction->length - 2];
+        operand[0] = (jump >> 8) & 0xff;
+        operand[1] = jump & 0xff;
+    }
+    return true;
+}
+
+void layout_blocks(Chunk* chunk, BranchProfile* profile) {
+    int capacity = chunk->count;
+    Block* blocks = ALLOCATE(Block, capacity);
+    int count = find_blocks(chunk, blocks);
+    if (count <= 0) {
+        FREE_ARRAY(Block, blocks, capacity);
+        return;
+    }
+
+    count_blocks(chunk, blocks, count, profile);
+    build_chains(blocks, count);
+    int* order = ALLOCATE(int, count);
+    order_chains(blocks, count, order);
+
+    /* Each block can gain two jumps. */
+    int code_capacity = capacity + count * 2;
+    Instruction* code = ALLOCATE(Instruction, code_capacity);
+    int* starts = ALLOCATE(int, count);
+    int* offsets = ALLOCATE(int, code_capacity + 1);
+    int emitted = emit_blocks(chunk, blocks, count, order, code, starts);
+
+    if (encode_jumps(code, emitted, starts, offsets)) {
+        truncate_chunk(chunk, 0);
+        for (int i = 0; i < emitted; i++) {
+            for (int byte = 0; byte < code[i].length; byte++)
+                write_chunk(chunk, code[i].bytes[byte], code[i].line);
+        }
+    }
+
+    FREE_ARRAY(Block, blocks, capacity);
+    FREE_ARRAY(int, order, count);
+    FREE_ARRAY(Instruction, code, code_capacity);
+    FREE_ARRAY(int, starts, count);
+    FREE_ARRAY(int, offsets, code_capacity + 1);
+}
@@ -1,5 +1,6 @@
 #include "common.h"
 #include <stdio.h>
+#include <string.h>
 #include "vm.h"
 
 
@@ -60,19 +61,61 @@ static void run_file(const char *path) {
 
 
 
+static void usage() {
+    fprintf(stderr, "Usage: clox [--registers | --jit [--perf-map] |\n"
+        "        --profile-generate file | --profile-use file] [path]\n");
+    exit(64);
+}
+
+
 int main(int argc, const char* argv[])
 {
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
     init_vm();
 
-    if(argc == 1) {
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--registers") == 0) {
+            vm.use_registers = true;
+        } else if (strcmp(argv[arg], "--jit") == 0) {
+            vm.use_jit = true;
+        } else if (strcmp(argv[arg], "--perf-map") == 0) {
+            vm.jit_perf_map = true;
+        } else if (strcmp(argv[arg], "--profile-generate") == 0) {
+            if (++arg == argc)
+                usage();
+            vm.profile_out = argv[arg];
+        } else if (strcmp(argv[arg], "--profile-use") == 0) {
+            if (++arg == argc)
+                usage();
+            vm.profile_in = argv[arg];
+        } else {
+            break;
+        }
+    }
+
+    if (vm.jit_perf_map && !vm.use_jit)
+        usage();
+
+    /* Only the bytecode interpreter records or follows a profile. */
+    bool profiling = vm.profile_out != NULL || vm.profile_in != NULL;
+    if (profiling && (vm.use_registers || vm.use_jit))
+        usage();
+#ifndef PROFILE_BRANCHES
+    if (vm.profile_out != NULL) {
+        fprintf(stderr, "--profile-generate needs a build with "
+            "PROFILE_BRANCHES defined.\n");
+        exit(64);
+    }
+#endif
+
+    if(arg == argc) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    } else if (arg + 1 == argc) {
+        run_file(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
     free_vm();
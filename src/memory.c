@@ -7,14 +7,15 @@
 #include "vm.h"
 
 void *reallocate(void *pointer, size_t old_size, size_t new_size) {
-    if(pointer == NULL)
-        return malloc(new_size);
-
+    /* Freeing an array that never grew must not allocate one. */
     if (new_size == 0) {
         free(pointer);
         return NULL;
     }
 
+    if(pointer == NULL)
+        return malloc(new_size);
+
     void *result = realloc(pointer, new_size);
     if (result == NULL) exit(1);
     return result;
@@ -24,10 +25,15 @@ static void free_object(Obj* object) {
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
             break;
         }
+        case OBJ_ROPE:
+            FREE(ObjRope, object);
+            break;
+        case OBJ_SLICE:
+            FREE(ObjSlice, object);
+            break;
     }
 }
 void free_objects() {
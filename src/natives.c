@@ -0,0 +1,159 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "natives.h"
+#include "object.h"
+
+/* Where needle first starts in haystack, or -1. Sixteen start positions
+ * at a time are filtered on the first and last byte of needle, and only
+ * those matching both are compared in full. SSE2 is part of x86-64, so
+ * this needs no flags or CPU check there; elsewhere memchr finds the
+ * candidates. */
+static int find(const char* haystack, int length,
+                const char* needle, int count) {
+    if (count == 0)
+        return 0;
+    int last = length - count;
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i final = _mm_set1_epi8(needle[count - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i starts = _mm_loadu_si128((const __m128i*)(haystack + i));
+        __m128i ends = _mm_loadu_si128(
+            (const __m128i*)(haystack + i + count - 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, final)));
+        while (mask != 0) {
+            int candidate = i + __builtin_ctz(mask);
+            if (memcmp(haystack + candidate, needle, count) == 0)
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (i <= last) {
+        const char* match = memchr(haystack + i, needle[0], last - i + 1);
+        if (match == NULL)
+            return -1;
+        i = match - haystack;
+        if (memcmp(match, needle, count) == 0)
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* A number argument as an index clamped to 0 through limit. */
+static int clamp_index(Value value, int limit) {
+    double index = AS_NUMBER(value);
+    if (!(index > 0))
+        return 0;
+    return index < limit ? (int)index : limit;
+}
+
+static bool substr_native(Value* args, Value* result) {
+    if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2]))
+        return false;
+    int length = string_length(args[0]);
+    int start = clamp_index(args[1], length);
+    *result = string_slice(args[0], start,
+        clamp_index(args[2], length - start));
+    return true;
+}
+
+static bool index_of_native(Value* args, Value* result) {
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1]))
+        return false;
+    char buffer[SHORT_STRING_MAX];
+    char needle[SHORT_STRING_MAX];
+    *result = NUMBER_VAL(find(string_chars(args[0], buffer),
+        string_length(args[0]), string_chars(args[1], needle),
+        string_length(args[1])));
+    return true;
+}
+
+static bool starts_with_native(Value* args, Value* result) {
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1]))
+        return false;
+    int count = string_length(args[1]);
+    char buffer[SHORT_STRING_MAX];
+    char prefix[SHORT_STRING_MAX];
+    *result = BOOL_VAL(count <= string_length(args[0]) &&
+        memcmp(string_chars(args[0], buffer),
+               string_chars(args[1], prefix), count) == 0);
+    return true;
+}
+
+static bool trim_native(Value* args, Value* result) {
+    if (!IS_STRING(args[0]))
+        return false;
+    char buffer[SHORT_STRING_MAX];
+    const char* chars = string_chars(args[0], buffer);
+    int start = 0;
+    int end = string_length(args[0]);
+    while (start < end && is_space(chars[start]))
+        start++;
+    while (end > start && is_space(chars[end - 1]))
+        end--;
+    *result = string_slice(args[0], start, end - start);
+    return true;
+}
+
+/* Fields are what lies between separators, so "a,,b" has an empty one
+ * in the middle. Each separator is found with find(). */
+static bool split_native(Value* args, Value* result) {
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1]) || !IS_NUMBER(args[2]) ||
+        string_length(args[1]) == 0)
+        return false;
+    char buffer[SHORT_STRING_MAX];
+    char separator[SHORT_STRING_MAX];
+    const char* chars = string_chars(args[0], buffer);
+    const char* sep = string_chars(args[1], separator);
+    int length = string_length(args[0]);
+    int count = string_length(args[1]);
+    double n = AS_NUMBER(args[2]);
+
+    *result = NIL_VAL;
+    int start = 0;
+    for (int field = 0; field <= n; field++) {
+        int found = find(chars + start, length - start, sep, count);
+        int end = found == -1 ? length : start + found;
+        if (field >= n) {
+            *result = string_slice(args[0], start, end - start);
+            break;
+        }
+        if (found == -1)
+            break;
+        start = end + count;
+    }
+    return true;
+}
+
+const Native natives[] = {
+    {"substr", 3, "substr(string, start, length)", substr_native},
+    {"indexOf", 2, "indexOf(string, string)", index_of_native},
+    {"startsWith", 2, "startsWith(string, string)", starts_with_native},
+    {"trim", 1, "trim(string)", trim_native},
+    {"split", 3, "split(string, separator, index)", split_native},
+    {NULL, 0, NULL, NULL},
+};
+
+/* The index of the native called name, or -1. */
+int find_native(const char* name, int length) {
+    for (int i = 0; natives[i].name != NULL; i++) {
+        if ((int)strlen(natives[i].name) == length &&
+            memcmp(natives[i].name, name, length) == 0)
+            return i;
+    }
+    return -1;
+}
@@ -10,7 +10,10 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocate_object(sizeof(type), objectType)
 
-static uint32_t hash_string(const char* key, int length) {
+/* Strings shorter than this are copied rather than built as ropes. */
+#define ROPE_MIN_LENGTH 64
+
+uint32_t hash_string(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= (uint8_t)key[i];
@@ -28,43 +31,348 @@ static Obj* allocate_object(size_t size, ObjType type) {
     return object;
 }
 
-static ObjString* allocate_string(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/* The characters follow the header in the same allocation. The caller
+ * fills them in. Strings the program builds while it runs are neither
+ * hashed nor interned until something asks for it. */
+ObjString* allocate_string(int length) {
+    ObjString* string = (ObjString*)allocate_object(
+        sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->chars[length] = '\0';
+    string->hash = 0;
+    string->hashed = false;
+    string->interned = false;
+    return string;
+}
+
+ObjString* intern_string(ObjString* string) {
+    if (string->interned)
+        return string;
+
+    ObjString* interned = table_find_string(&vm.strings, string->chars,
+        string->length, string_hash(string));
+    if (interned != NULL)
+        return interned;
+
+    string->interned = true;
     table_set(&vm.strings, string, NIL_VAL);
     return string;
 }
 
+/* Identifiers and literals are interned as they are read, which keeps
+ * the copies of a name down to one. */
 ObjString* copy_string(const char* chars, int length) {
     uint32_t hash = hash_string(chars, length);
     ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
     if (interned != NULL)
         return interned;
 
-    char* heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    ObjString* string = allocate_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->hashed = true;
+    return intern_string(string);
 }
 
 void print_object(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+        case OBJ_ROPE:
+        case OBJ_SLICE:
+            printf("%.*s", string_length(value), string_chars(value, NULL));
             break;
     }
 }
 
-ObjString* take_string(char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+/* Two interned strings are equal only if they are the same one. Any
+ * other pair has its characters compared, after the hashes if both are
+ * known already. A slice is compared where it lies. */
+bool objects_equal(Obj* a, Obj* b) {
+    int length = string_length(OBJ_VAL(a));
+    if (length != string_length(OBJ_VAL(b)))
+        return false;
 
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    if (a->type != OBJ_SLICE && b->type != OBJ_SLICE) {
+        ObjString* x = as_string(a);
+        ObjString* y = as_string(b);
+        if (x == y)
+            return true;
+        if (x->interned && y->interned)
+            return false;
+        if (x->hashed && y->hashed && x->hash != y->hash)
+            return false;
+    }
+    return memcmp(string_chars(OBJ_VAL(a), NULL),
+        string_chars(OBJ_VAL(b), NULL), length) == 0;
+}
+
+/* A short string where it fits, an interned copy otherwise. */
+Value string_value(const char* chars, int length) {
+    if (fits_short_string(chars, length))
+        return short_string_val(chars, length);
+    return OBJ_VAL(copy_string(chars, length));
+}
+
+int string_length(Value string) {
+    if (IS_SHORT_STRING(string))
+        return short_string_length(string);
+    switch (OBJ_TYPE(string)) {
+        case OBJ_STRING: return AS_STRING(string)->length;
+        case OBJ_ROPE: return ((ObjRope*)AS_OBJ(string))->length;
+        case OBJ_SLICE: return ((ObjSlice*)AS_OBJ(string))->length;
     }
+    return 0;
+}
+
+/* The characters of string, which need not be terminated, with a rope
+ * flattened. A short string is spelled out in buffer, which needs
+ * SHORT_STRING_MAX bytes. */
+const char* string_chars(Value string, char* buffer) {
+    if (IS_SHORT_STRING(string)) {
+        short_string_chars(string, buffer);
+        return buffer;
+    }
+    if (IS_SLICE(string)) {
+        ObjSlice* slice = (ObjSlice*)AS_OBJ(string);
+        return slice->parent->chars + slice->start;
+    }
+    return AS_STRING(string)->chars;
+}
+
+/* Where a new string of length characters is written: straight into
+ * an ObjString, or into buffer if it may fit in a Value. */
+typedef struct {
+    int length;
+    ObjString* string;
+    char buffer[SHORT_STRING_MAX];
+} StringBuilder;
+
+static char* begin_string(StringBuilder* builder, int length) {
+    builder->length = length;
+    if (length <= SHORT_STRING_MAX) {
+        builder->string = NULL;
+        return builder->buffer;
+    }
+    builder->string = allocate_string(length);
+    return builder->string->chars;
+}
+
+static Value end_string(StringBuilder* builder) {
+    if (builder->string != NULL)
+        return OBJ_VAL(builder->string);
+    return string_value(builder->buffer, builder->length);
+}
+
+static Value allocate_rope(int length, Value left, Value right) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+}
+
+/* Fills length characters with copies of the count in unit, the last
+ * one cut short if it does not fit. */
+static void repeat_chars(char* chars, const char* unit, int count, int length) {
+    for (int i = 0; i < length; i += count) {
+        int copied = length - i < count ? length - i : count;
+        memcpy(chars + i, unit, copied);
+    }
+}
+
+typedef struct {
+    Value string;
+    char* chars;
+} Pending;
+
+/* Copies the characters of string into chars. Concatenations are
+ * walked with a stack of their right halves, so a rope built by a long
+ * loop of s = s + piece cannot overflow the C stack. */
+static void write_string(Value string, char* chars) {
+    char buffer[SHORT_STRING_MAX];
+    Pending* pending = NULL;
+    int count = 0;
+    int capacity = 0;
 
-    return allocate_string(chars, length, hash);
-}
\ No newline at end of file
+    for (;;) {
+        ObjRope* rope = IS_ROPE(string) ? (ObjRope*)AS_OBJ(string) : NULL;
+        if (rope == NULL || rope->flat != NULL) {
+            memcpy(chars, string_chars(string, buffer), string_length(string));
+        } else if (IS_NIL(rope->right)) {
+            repeat_chars(chars, string_chars(rope->left, buffer),
+                string_length(rope->left), rope->length);
+        } else {
+            if (count == capacity) {
+                int old_capacity = capacity;
+                capacity = GROW_CAPACITY(old_capacity);
+                pending = GROW_ARRAY(Pending, pending, old_capacity, capacity);
+            }
+            pending[count].string = rope->right;
+            pending[count].chars = chars + string_length(rope->left);
+            count++;
+            string = rope->left;
+            continue;
+        }
+
+        if (count == 0)
+            break;
+        count--;
+        string = pending[count].string;
+        chars = pending[count].chars;
+    }
+
+    if (pending != NULL)
+        FREE_ARRAY(Pending, pending, capacity);
+}
+
+ObjString* flatten_string(Obj* string) {
+    ObjString** flat = string->type == OBJ_ROPE
+        ? &((ObjRope*)string)->flat
+        : &((ObjSlice*)string)->flat;
+    if (*flat == NULL) {
+        ObjString* copy = allocate_string(string_length(OBJ_VAL(string)));
+        write_string(OBJ_VAL(string), copy->chars);
+        *flat = copy;
+    }
+    return *flat;
+}
+
+/* Characters start to start + length of string, which the caller has
+ * checked are in range. Short results are still made short, so only a
+ * longer one shares its parent's characters. */
+Value string_slice(Value string, int start, int length) {
+    if (start == 0 && length == string_length(string))
+        return string;
+    if (length <= SHORT_STRING_MAX) {
+        char buffer[SHORT_STRING_MAX];
+        return string_value(string_chars(string, buffer) + start, length);
+    }
+
+    ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_SLICE);
+    slice->length = length;
+    slice->start = start;
+    slice->flat = NULL;
+    if (IS_SLICE(string)) {
+        ObjSlice* outer = (ObjSlice*)AS_OBJ(string);
+        slice->parent = outer->parent;
+        slice->start += outer->start;
+    } else {
+        slice->parent = AS_STRING(string);
+    }
+    return OBJ_VAL(slice);
+}
+
+/* Short results are still copied, which is cheaper than a rope over
+ * pieces that small. Longer ones become a rope in O(1). Returns false,
+ * and builds nothing, if the result would be longer than
+ * MAX_STRING_LENGTH. */
+bool concatenate_strings(Value a, Value b, Value* result) {
+    int a_length = string_length(a);
+    int b_length = string_length(b);
+    if ((long long)a_length + b_length > MAX_STRING_LENGTH)
+        return false;
+    if (a_length == 0) {
+        *result = b;
+        return true;
+    }
+    if (b_length == 0) {
+        *result = a;
+        return true;
+    }
+
+    int length = a_length + b_length;
+    if (length >= ROPE_MIN_LENGTH) {
+        *result = allocate_rope(length, a, b);
+        return true;
+    }
+
+    StringBuilder builder;
+    char* chars = begin_string(&builder, length);
+    write_string(a, chars);
+    write_string(b, chars + a_length);
+    *result = end_string(&builder);
+    return true;
+}
+
+/* Writes value as print shows it, unless it is a string. */
+static int format_value(Value value, char* buffer, size_t size) {
+    if (IS_NUMBER(value))
+        return snprintf(buffer, size, "%g", AS_NUMBER(value));
+    if (IS_BOOL(value))
+        return snprintf(buffer, size, "%s", AS_BOOL(value) ? "true" : "false");
+    return snprintf(buffer, size, "nil");
+}
+
+/* Joins values into one string, each spelled as print shows it. The
+ * length is summed first, so the result is allocated and copied once
+ * however many values there are. */
+static Value join_flat(Value* values, int count) {
+    char buffer[32];
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        length += IS_STRING(values[i])
+            ? string_length(values[i])
+            : format_value(values[i], buffer, sizeof(buffer));
+    }
+
+    StringBuilder builder;
+    char* end = begin_string(&builder, length);
+    for (int i = 0; i < count; i++) {
+        if (IS_STRING(values[i])) {
+            write_string(values[i], end);
+            end += string_length(values[i]);
+        } else {
+            int written = format_value(values[i], buffer, sizeof(buffer));
+            memcpy(end, buffer, written);
+            end += written;
+        }
+    }
+
+    return end_string(&builder);
+}
+
+/* Long strings are linked in as they are rather than copied, so a
+ * loop of s = "${s}${piece}" stays linear. Runs of other values
+ * between them are joined flat. Fails as concatenate_strings() does. */
+bool join_values(Value* values, int count, Value* result) {
+    *result = short_string_val("", 0);
+    int start = 0;
+    for (int i = 0; i <= count; i++) {
+        if (i < count && !(IS_STRING(values[i]) &&
+                string_length(values[i]) >= ROPE_MIN_LENGTH))
+            continue;
+        if (i > start &&
+            !concatenate_strings(*result,
+                join_flat(values + start, i - start), result))
+            return false;
+        if (i < count && !concatenate_strings(*result, values[i], result))
+            return false;
+        start = i + 1;
+    }
+    return true;
+}
+
+/* A fractional count keeps the leading part of the last copy, so
+ * "ab" * 2.5 is "ababa". A long result at least twice the original is
+ * left as a rope, which keeps nested repeats shallow. Returns false,
+ * and builds nothing, if the result would be longer than
+ * MAX_STRING_LENGTH. */
+bool repeat_string(Value string, double times, Value* result) {
+    int original = string_length(string);
+    if (original > 0 && times > (double)MAX_STRING_LENGTH / original)
+        return false;
+    /* Also zero for a NaN count. */
+    int length = times > 0 ? times * original : 0;
+    if (length >= ROPE_MIN_LENGTH && length >= 2 * original) {
+        *result = allocate_rope(length, string, NIL_VAL);
+        return true;
+    }
+
+    char buffer[SHORT_STRING_MAX];
+    StringBuilder builder;
+    char* chars = begin_string(&builder, length);
+    repeat_chars(chars, string_chars(string, buffer), original, length);
+    *result = end_string(&builder);
+    return true;
+}
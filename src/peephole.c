@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+/* The chunk is decoded into a list of instructions so that removing or
+ * shrinking one does not disturb the others. Jumps refer to their
+ * target by index, and are kept in their regular form until layout()
+ * finds out which ones need their long form. A removed instruction
+ * stays in the list, and a jump that targets it lands on the next one
+ * still there.
+ */
+typedef struct {
+    uint8_t bytes[7];
+    int length;
+    size_t line;
+    int target;         /* index of the jump target, or -1 */
+    bool removed;
+} Instruction;
+
+typedef struct {
+    Instruction* code;
+    int count;
+    int* labels;        /* jumps landing on each instruction */
+    bool wide;          /* some jump came in its long form */
+} Program;
+
+static bool is_jump(uint8_t opcode) {
+    switch (opcode) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_LESS_UNCHECKED:
+        case OP_JUMP_IF_GREATER_UNCHECKED:
+        case OP_FOR_LOOP:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_long_jump(uint8_t opcode) {
+    return is_jump(opcode) && short_form(opcode) != opcode;
+}
+
+/* OP_JUMP and OP_LOOP only differ in direction, and the layout picks
+ * whichever one the final offsets need. */
+static bool is_unconditional(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP;
+}
+
+/* Jumps whose offset counts back from their end. Every jump keeps its
+ * offset in its last two bytes, or three for the long forms. */
+static bool is_backward(uint8_t opcode) {
+    return opcode == OP_LOOP || opcode == OP_LOOP_LONG ||
+        opcode == OP_FOR_LOOP;
+}
+
+/* The first instruction at or after index that is still there. */
+static int resolve(Program* program, int index) {
+    while (index < program->count && program->code[index].removed)
+        index++;
+    return index;
+}
+
+static bool decode(Chunk* chunk, Program* program) {
+    int* indices = ALLOCATE(int, chunk->count + 1);
+    for (int offset = 0; offset <= chunk->count; offset++)
+        indices[offset] = -1;
+
+    bool valid = true;
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instruction_length(chunk->code[offset]);
+        if (offset + length > chunk->count) {
+            valid = false;
+            break;
+        }
+        indices[offset] = program->count;
+        Instruction* instruction = &program->code[program->count++];
+        memcpy(instruction->bytes, &chunk->code[offset], length);
+        instruction->length = length;
+        instruction->line = get_line(chunk, offset);
+        instruction->target = -1;
+        instruction->removed = false;
+        offset += length;
+    }
+
+    int offset = 0;
+    for (int i = 0; valid && i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        offset += instruction->length;
+        if (!is_jump(instruction->bytes[0]))
+            continue;
+
+        uint8_t opcode = instruction->bytes[0];
+        uint8_t* operand = &instruction->bytes[instruction->length - 2];
+        int jump = (operand[0] << 8) | operand[1];
+        if (is_long_jump(opcode)) {
+            jump |= operand[-1] << 16;
+            instruction->bytes[0] = short_form(opcode);
+            instruction->length = instruction_length(short_form(opcode));
+            program->wide = true;
+        }
+        int target = is_backward(opcode) ? offset - jump : offset + jump;
+        if (target < 0 || target >= chunk->count || indices[target] == -1)
+            valid = false;
+        else
+            instruction->target = indices[target];
+    }
+
+    FREE_ARRAY(int, indices, chunk->count + 1);
+    return valid;
+}
+
+static void count_labels(Program* program) {
+    memset(program->labels, 0, sizeof(int) * program->count);
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (!instruction->removed && instruction->target != -1) {
+            int target = resolve(program, instruction->target);
+            if (target < program->count)
+                program->labels[target]++;
+        }
+    }
+}
+
+/* The label counts are kept up to date as instructions change, since
+ * recounting them after every change makes the pass quadratic. */
+static void count_label(Program* program, int target, int delta) {
+    target = resolve(program, target);
+    if (target < program->count)
+        program->labels[target] += delta;
+}
+
+static void retarget(Program* program, int index, int target) {
+    Instruction* instruction = &program->code[index];
+    if (instruction->target != -1)
+        count_label(program, instruction->target, -1);
+    instruction->target = target;
+    if (target != -1)
+        count_label(program, target, 1);
+}
+
+/* Jumps that landed on a removed instruction now land on the next. */
+static void remove_instruction(Program* program, int index) {
+    retarget(program, index, -1);
+    program->code[index].removed = true;
+    count_label(program, index, program->labels[index]);
+    program->labels[index] = 0;
+}
+
+/* Replaces the instruction at index with a shorter one. */
+static void rewrite(Program* program, int index, uint8_t opcode, int length) {
+    Instruction* instruction = &program->code[index];
+    instruction->bytes[0] = opcode;
+    instruction->length = length;
+}
+
+/* Follows a jump through any unconditional jumps it lands on. */
+static bool thread_jump(Program* program, int index) {
+    Instruction* jump = &program->code[index];
+    int target = resolve(program, jump->target);
+    int hops = 0;
+    if (jump->bytes[0] == OP_FOR_LOOP)
+        return false;
+
+    while (target < program->count && hops++ < program->count &&
+           is_unconditional(program->code[target].bytes[0]) &&
+           target != index) {
+        int next = resolve(program, program->code[target].target);
+        /* Conditional jumps can only go forward. */
+        if (!is_unconditional(jump->bytes[0]) && next <= index)
+            break;
+        target = next;
+    }
+
+    if (target == resolve(program, jump->target))
+        return false;
+    retarget(program, index, target);
+    return true;
+}
+
+static bool is_pure_push(Instruction* instruction) {
+    switch (instruction->bytes[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Rewrites the pair of instructions at index and next, where nothing
+ * jumps to next. Returns true if it changed anything. */
+static bool combine(Program* program, int index, int next) {
+    Instruction* first = &program->code[index];
+    Instruction* second = &program->code[next];
+
+    if (second->bytes[0] == OP_NOT) {
+        switch (first->bytes[0]) {
+            case OP_EQUAL: rewrite(program, index, OP_NOT_EQUAL, 1); break;
+            case OP_LESS: rewrite(program, index, OP_GREATER_EQUAL, 1); break;
+            case OP_GREATER: rewrite(program, index, OP_LESS_EQUAL, 1); break;
+            default: return false;
+        }
+        remove_instruction(program, next);
+        return true;
+    }
+
+    /* The fused jumps have no long form, so they are left out of code
+     * whose jumps may need it. */
+    if (second->bytes[0] == OP_POP_JUMP_IF_FALSE && !program->wide) {
+        switch (first->bytes[0]) {
+            case OP_LESS: first->bytes[0] = OP_JUMP_IF_NOT_LESS; break;
+            case OP_GREATER: first->bytes[0] = OP_JUMP_IF_NOT_GREATER; break;
+            case OP_LESS_UNCHECKED:
+                first->bytes[0] = OP_JUMP_IF_NOT_LESS_UNCHECKED;
+                break;
+            case OP_GREATER_UNCHECKED:
+                first->bytes[0] = OP_JUMP_IF_NOT_GREATER_UNCHECKED;
+                break;
+            default: return false;
+        }
+        first->length = 3;
+        retarget(program, index, second->target);
+        remove_instruction(program, next);
+        return true;
+    }
+
+    if (second->bytes[0] != OP_POP)
+        return false;
+
+    switch (first->bytes[0]) {
+        case OP_SET_LOCAL:
+            rewrite(program, index, OP_SET_LOCAL_POP, 2);
+            break;
+        case OP_SET_GLOBAL:
+            rewrite(program, index, OP_SET_GLOBAL_POP, 2);
+            break;
+        case OP_GET_LOCALS:
+            rewrite(program, index, OP_GET_LOCAL, 2);
+            break;
+        case OP_NOT:
+            remove_instruction(program, index);
+            return true;
+        case OP_JUMP_IF_FALSE: {
+            /* If the jump lands on a pop too, the value is dropped on
+             * both paths. If it lands on another test of the same
+             * value, that test is sure to jump and pop. */
+            int target = resolve(program, first->target);
+            if (target >= program->count)
+                return false;
+            if (program->code[target].bytes[0] == OP_POP)
+                retarget(program, index, target + 1);
+            else if (program->code[target].bytes[0] == OP_POP_JUMP_IF_FALSE)
+                retarget(program, index, program->code[target].target);
+            else
+                return false;
+            rewrite(program, index, OP_POP_JUMP_IF_FALSE, 3);
+            break;
+        }
+        default:
+            if (!is_pure_push(first))
+                return false;
+            remove_instruction(program, index);
+            break;
+    }
+    remove_instruction(program, next);
+    return true;
+}
+
+static bool optimize_pass(Program* program) {
+    bool changed = false;
+    count_labels(program);
+
+    for (int i = resolve(program, 0); i < program->count;
+         i = resolve(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        int next = resolve(program, i + 1);
+
+        if (instruction->target != -1 && thread_jump(program, i))
+            changed = true;
+
+        /* A jump to the next instruction does nothing. */
+        if (instruction->target != -1 &&
+            resolve(program, instruction->target) == next) {
+            if (instruction->bytes[0] == OP_POP_JUMP_IF_FALSE) {
+                rewrite(program, i, OP_POP, 1);
+                retarget(program, i, -1);
+                changed = true;
+            } else if (instruction->bytes[0] == OP_JUMP ||
+                       instruction->bytes[0] == OP_JUMP_IF_FALSE) {
+                remove_instruction(program, i);
+                changed = true;
+                continue;
+            }
+        }
+
+        if (next < program->count && program->labels[next] == 0 &&
+            combine(program, i, next)) {
+            changed = true;
+            continue;
+        }
+
+        /* Nothing reaches code after an unconditional jump until the
+         * next label. */
+        if (is_unconditional(instruction->bytes[0])) {
+            while (next < program->count && program->labels[next] == 0 &&
+                   program->code[next].bytes[0] != OP_RETURN) {
+                remove_instruction(program, next);
+                next = resolve(program, next + 1);
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+static void find_offsets(Program* program, int* offsets) {
+    int offset = 0;
+    for (int i = 0; i < program->count; i++) {
+        offsets[i] = offset;
+        if (!program->code[i].removed)
+            offset += program->code[i].length;
+    }
+    offsets[program->count] = offset;
+}
+
+/* How far the jump at index goes, counted the way its operand does, or
+ * -1 if it goes the wrong way. Picks the direction of OP_JUMP and
+ * OP_LOOP. */
+static int jump_distance(Program* program, int* offsets, int index) {
+    Instruction* instruction = &program->code[index];
+    int end = offsets[index] + instruction->length;
+    int jump = offsets[resolve(program, instruction->target)] - end;
+    uint8_t opcode = short_form(instruction->bytes[0]);
+    if (is_unconditional(opcode)) {
+        opcode = jump < 0 ? OP_LOOP : OP_JUMP;
+        instruction->bytes[0] = is_long_jump(instruction->bytes[0])
+            ? (uint8_t)long_form(opcode)
+            : opcode;
+        return jump < 0 ? -jump : jump;
+    }
+    if (opcode == OP_FOR_LOOP)
+        jump = -jump;
+    return jump < 0 ? -1 : jump;
+}
+
+/* Writes the program back into the chunk. Every jump starts out in its
+ * regular form; one that cannot reach takes its long form, which moves
+ * the code after it, so this repeats until no jump grows. Returns false
+ * without touching the chunk if a jump cannot reach either way. */
+static bool layout(Chunk* chunk, Program* program) {
+    int* offsets = ALLOCATE(int, program->count + 1);
+    bool fits = true;
+    bool grown = true;
+    while (fits && grown) {
+        grown = false;
+        find_offsets(program, offsets);
+        for (int i = 0; i < program->count; i++) {
+            Instruction* instruction = &program->code[i];
+            if (instruction->removed || instruction->target == -1)
+                continue;
+
+            int jump = jump_distance(program, offsets, i);
+            bool is_long = is_long_jump(instruction->bytes[0]);
+            if (jump < 0) {
+                fits = false;
+            } else if (jump > (is_long ? UINT24_MAX : UINT16_MAX)) {
+                int wide = long_form(instruction->bytes[0]);
+                if (is_long || wide == -1) {
+                    fits = false;
+                } else {
+                    instruction->bytes[0] = wide;
+                    instruction->length = instruction_length(wide);
+                    grown = true;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; fits && i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->removed || instruction->target == -1)
+            continue;
+
+        int jump = jump_distance(program, offsets, i);
+        uint8_t* operand = &instruction->bytes[instruction->length - 2];
+        if (is_long_jump(instruction->bytes[0]))
+            operand[-1] = (jump >> 16) & 0xff;
+        operand[0] = (jump >> 8) & 0xff;
+        operand[1] = jump & 0xff;
+    }
+
+    if (fits) {
+        truncate_chunk(chunk, 0);
+        for (int i = 0; i < program->count; i++) {
+            Instruction* instruction = &program->code[i];
+            if (instruction->removed)
+                continue;
+            for (int byte = 0; byte < instruction->length; byte++)
+                write_chunk(chunk, instruction->bytes[byte], instruction->line);
+        }
+    }
+
+    FREE_ARRAY(int, offsets, program->count + 1);
+    return fits;
+}
+
+void optimize_peephole(Chunk* chunk) {
+    int count = chunk->count;
+    Program program;
+    program.code = ALLOCATE(Instruction, count);
+    program.labels = ALLOCATE(int, count);
+    program.count = 0;
+    program.wide = false;
+
+    if (decode(chunk, &program)) {
+        while (optimize_pass(&program))
+            ;
+        layout(chunk, &program);
+    }
+
+    FREE_ARRAY(Instruction, program.code, count);
+    FREE_ARRAY(int, program.labels, count);
+}
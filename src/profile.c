@@ -0,0 +1,244 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "profile.h"
+
+#define BRANCH_PROFILE_HEADER "grino branch profile 1"
+
+/* FNV-1a over the code bytes. */
+static uint32_t hash_code(Chunk* chunk) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < chunk->count; i++) {
+        hash ^= chunk->code[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Starts empty counts for chunk. It must not have run yet, since run()
+ * rewrites quickened instructions in place. */
+void init_branch_profile(BranchProfile* profile, Chunk* chunk) {
+    profile->hash = hash_code(chunk);
+    profile->count = chunk->count;
+    profile->taken = ALLOCATE(uint64_t, chunk->count + 1);
+    profile->fallen = ALLOCATE(uint64_t, chunk->count + 1);
+    memset(profile->taken, 0, sizeof(uint64_t) * (chunk->count + 1));
+    memset(profile->fallen, 0, sizeof(uint64_t) * (chunk->count + 1));
+}
+
+void free_branch_profile(BranchProfile* profile) {
+    FREE_ARRAY(uint64_t, profile->taken, profile->count + 1);
+    FREE_ARRAY(uint64_t, profile->fallen, profile->count + 1);
+    profile->taken = profile->fallen = NULL;
+    profile->count = 0;
+}
+
+void count_branch(BranchProfile* profile, int offset, bool taken) {
+    if (taken)
+        profile->taken[offset]++;
+    else
+        profile->fallen[offset]++;
+}
+
+/* Writes the header, then one line of offset, taken and fallen counts
+ * per jump that ran. */
+bool write_branch_profile(BranchProfile* profile, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "%s\n%08" PRIx32 " %d\n", BRANCH_PROFILE_HEADER,
+        profile->hash, profile->count);
+    for (int offset = 0; offset <= profile->count; offset++) {
+        if (profile->taken[offset] == 0 && profile->fallen[offset] == 0)
+            continue;
+        fprintf(file, "%d %" PRIu64 " %" PRIu64 "\n", offset,
+            profile->taken[offset], profile->fallen[offset]);
+    }
+    return fclose(file) == 0;
+}
+
+/* Adds the counts saved at path to profile, which init_branch_profile()
+ * set up for the code about to run. Returns false if the file cannot
+ * be read or was recorded on other code, and the counts should then
+ * not be used. */
+bool read_branch_profile(BranchProfile* profile, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    char header[sizeof(BRANCH_PROFILE_HEADER) + 1];
+    uint32_t hash;
+    int count;
+    bool valid = fgets(header, sizeof(header), file) != NULL &&
+        strcmp(header, BRANCH_PROFILE_HEADER "\n") == 0 &&
+        fscanf(file, "%" SCNx32 " %d", &hash, &count) == 2 &&
+        hash == profile->hash && count == profile->count;
+
+    int offset;
+    uint64_t taken, fallen;
+    while (valid && fscanf(file, "%d %" SCNu64 " %" SCNu64,
+                           &offset, &taken, &fallen) == 3) {
+        if (offset < 0 || offset > count) {
+            valid = false;
+            break;
+        }
+        profile->taken[offset] += taken;
+        profile->fallen[offset] += fallen;
+    }
+    valid = valid && feof(file);
+    fclose(file);
+    return valid;
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+/* Counts every run of 2..PROFILE_MAX_NGRAM opcodes that executed back
+ * to back without a taken jump between them. Only such straight-line
+ * runs can be fused into a superinstruction, so a jump that lands
+ * somewhere else starts the history over.
+ */
+
+typedef struct {
+    uint32_t key;
+    int length;
+    uint64_t count;
+} NGram;
+
+static NGram ngrams[PROFILE_TABLE_SIZE];
+static int ngram_count = 0;
+static uint64_t dropped = 0;
+static uint64_t instructions = 0;
+
+static uint8_t history[PROFILE_MAX_NGRAM];
+static int history_length = 0;
+static uint8_t* previous_ip = NULL;
+
+static uint32_t pack(int length) {
+    uint32_t key = 0;
+    for (int i = history_length - length; i < history_length; i++)
+        key = (key << 8) | history[i];
+    return key;
+}
+
+static void count_ngram(int length) {
+    uint32_t key = pack(length);
+    uint32_t index = (key * 2654435761u + length) % PROFILE_TABLE_SIZE;
+
+    for (int probes = 0; probes < PROFILE_TABLE_SIZE; probes++) {
+        NGram* ngram = &ngrams[index];
+        if (ngram->length == 0) {
+            if (ngram_count >= PROFILE_TABLE_SIZE * 3 / 4)
+                break;
+            ngram->key = key;
+            ngram->length = length;
+            ngram_count++;
+        }
+        if (ngram->key == key && ngram->length == length) {
+            ngram->count++;
+            return;
+        }
+        index = (index + 1) % PROFILE_TABLE_SIZE;
+    }
+    dropped++;
+}
+
+static bool is_jump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_FOR_LOOP:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_LESS_UNCHECKED:
+        case OP_JUMP_IF_GREATER_UNCHECKED:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void profile_instruction(uint8_t* code, uint8_t* ip) {
+    instructions++;
+
+    /* A jump is only straight-line if it fell through to the next
+     * instruction. */
+    uint8_t last = history_length > 0 ? history[history_length - 1] : OP_RETURN;
+    if (history_length > 0 && (ip < code ||
+        (is_jump(last) && ip != previous_ip + instruction_length(last)))) {
+        history_length = 0;
+    }
+    previous_ip = ip;
+
+    if (history_length == PROFILE_MAX_NGRAM) {
+        memmove(history, history + 1, PROFILE_MAX_NGRAM - 1);
+        history_length--;
+    }
+    history[history_length++] = *ip;
+
+    for (int length = 2; length <= history_length; length++)
+        count_ngram(length);
+}
+
+/* Ranks n-grams by the dispatches a superinstruction would save,
+ * which is the execution count times the number of opcodes fused away.
+ */
+static uint64_t savings(NGram* ngram) {
+    return ngram->count * (uint64_t)(ngram->length - 1);
+}
+
+void print_profile() {
+    fprintf(stderr, "===== opcode profile =====\n");
+    fprintf(stderr, "%llu instructions executed\n",
+        (unsigned long long)instructions);
+
+    for (int length = 2; length <= PROFILE_MAX_NGRAM; length++) {
+        fprintf(stderr, "-- top %d-grams by dispatches saved --\n", length);
+
+        bool reported[PROFILE_TABLE_SIZE] = { false };
+        for (int rank = 0; rank < PROFILE_REPORT_COUNT; rank++) {
+            NGram* best = NULL;
+            int best_index = -1;
+            for (int i = 0; i < PROFILE_TABLE_SIZE; i++) {
+                NGram* ngram = &ngrams[i];
+                if (ngram->length != length || reported[i])
+                    continue;
+                if (best == NULL || savings(ngram) > savings(best)) {
+                    best = ngram;
+                    best_index = i;
+                }
+            }
+            if (best == NULL)
+                break;
+            reported[best_index] = true;
+
+            fprintf(stderr, "%12llu ", (unsigned long long)savings(best));
+            for (int i = length - 1; i >= 0; i--) {
+                fprintf(stderr, " %s", opcode_name((best->key >> (8 * i)) & 0xff));
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    if (dropped > 0) {
+        fprintf(stderr, "(%llu n-grams not counted: table full)\n",
+            (unsigned long long)dropped);
+    }
+}
+
+#endif
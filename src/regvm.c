@@ -0,0 +1,762 @@
+#include <stdio.h>
+
+#include "common.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "regvm.h"
+#include "vm.h"
+
+/* State of the translation from stack bytecode to register code.
+ *
+ * Without calls the stack depth at every instruction is known
+ * statically, so stack slot n simply becomes register n. The
+ * translator runs the bytecode abstractly over that stack, and for
+ * each slot keeps the frame index its value can be read from. Loading
+ * a constant or a local then costs nothing: the slot just names the
+ * constant or the local's register, and consumers read it from there.
+ * A slot whose value lives in its own register is "in place"; any
+ * other slot is materialized with a ROP_MOVE before its source
+ * register is overwritten and before control flow merges.
+ */
+typedef struct {
+    Chunk* chunk;
+    RegChunk* out;
+    int* slots;
+    int slot_capacity;
+    int depth;
+    bool* labels;           /* per bytecode offset: a jump lands here */
+    int* label_depths;      /* stack depth expected at each label */
+    int* index;             /* bytecode offset -> first instruction */
+    int* fixups;            /* jumps whose targets are still offsets */
+    int fixup_count;
+    int fixup_capacity;
+    int producer;           /* last instruction, if it wrote the top */
+    int offset;             /* bytecode offset being translated */
+} Translator;
+
+#define REGISTER(slot) (t->out->constant_count + (slot))
+#define MAX_FRAME UINT16_COUNT
+
+
+void init_reg_chunk(RegChunk* chunk) {
+    chunk->count = 0;
+    chunk->capacity = 0;
+    chunk->source = NULL;
+    chunk->code = NULL;
+    chunk->offsets = NULL;
+    chunk->constant_count = 0;
+    chunk->register_count = 0;
+}
+
+void free_reg_chunk(RegChunk* chunk) {
+    FREE_ARRAY(RegInstruction, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->offsets, chunk->capacity);
+    init_reg_chunk(chunk);
+}
+
+/* The value of a frame slot below the first register: a constant of
+ * the source chunk, or one of nil, true and false after them. */
+Value frame_constant(RegChunk* chunk, int index) {
+    ValueArray* constants = &chunk->source->constants;
+    if (index < constants->count)
+        return constants->values[index];
+    switch (index - constants->count) {
+        case 0:  return NIL_VAL;
+        case 1:  return BOOL_VAL(true);
+        default: return BOOL_VAL(false);
+    }
+}
+
+static void emit(Translator* t, RegOpCode op, int a, int b, int c) {
+    RegChunk* out = t->out;
+    if (out->capacity < out->count + 1) {
+        int old_capacity = out->capacity;
+        out->capacity = GROW_CAPACITY(old_capacity);
+        out->code = GROW_ARRAY(RegInstruction, out->code,
+            old_capacity, out->capacity);
+        out->offsets = GROW_ARRAY(int, out->offsets,
+            old_capacity, out->capacity);
+    }
+
+    RegInstruction* instruction = &out->code[out->count];
+    instruction->op = op;
+    instruction->a = a;
+    instruction->b = b;
+    instruction->c = c;
+    out->offsets[out->count] = t->offset;
+    out->count++;
+}
+
+static void emit_jump(Translator* t, RegOpCode op, int target, int b, int c) {
+    if (t->fixup_capacity < t->fixup_count + 2) {
+        int old_capacity = t->fixup_capacity;
+        t->fixup_capacity = GROW_CAPACITY(old_capacity);
+        t->fixups = GROW_ARRAY(int, t->fixups, old_capacity, t->fixup_capacity);
+    }
+    t->fixups[t->fixup_count++] = t->out->count;
+    t->fixups[t->fixup_count++] = target;
+    emit(t, op, 0, b, c);
+}
+
+static bool push_slot(Translator* t, int source) {
+    if (REGISTER(t->depth) >= MAX_FRAME)
+        return false;
+    if (t->slot_capacity < t->depth + 1) {
+        int old_capacity = t->slot_capacity;
+        t->slot_capacity = GROW_CAPACITY(old_capacity);
+        t->slots = GROW_ARRAY(int, t->slots, old_capacity, t->slot_capacity);
+    }
+    t->slots[t->depth++] = source;
+    if (t->depth > t->out->register_count)
+        t->out->register_count = t->depth;
+    return true;
+}
+
+static void materialize(Translator* t, int slot) {
+    if (t->slots[slot] != REGISTER(slot)) {
+        emit(t, ROP_MOVE, REGISTER(slot), t->slots[slot], 0);
+        t->slots[slot] = REGISTER(slot);
+    }
+}
+
+static bool is_read(Translator* t, int reg, int below) {
+    for (int slot = 0; slot < below; slot++) {
+        if (t->slots[slot] == reg && REGISTER(slot) != reg)
+            return true;
+    }
+    return false;
+}
+
+/* Saves every slot that still reads reg before reg is overwritten. */
+static void before_write(Translator* t, int reg) {
+    for (int slot = 0; slot < t->depth; slot++) {
+        if (t->slots[slot] == reg && REGISTER(slot) != reg)
+            materialize(t, slot);
+    }
+}
+
+static void flush(Translator* t) {
+    for (int slot = 0; slot < t->depth; slot++)
+        materialize(t, slot);
+}
+
+/* Emits an instruction that pushes its result. The operands must
+ * already have been popped. */
+static bool emit_result(Translator* t, RegOpCode op, int b, int c) {
+    int dest = REGISTER(t->depth);
+    if (!push_slot(t, dest))
+        return false;
+    before_write(t, dest);
+    emit(t, op, dest, b, c);
+    t->producer = t->out->count - 1;
+    return true;
+}
+
+static void set_local(Translator* t, int local, bool pop) {
+    int top = t->depth - 1;
+    int source = t->slots[top];
+    int reg = REGISTER(local);
+
+    if (source == REGISTER(top) && t->producer == t->out->count - 1 &&
+        !is_read(t, reg, top)) {
+        /* The value was computed by the previous instruction, so it can
+         * write the local directly. */
+        t->out->code[t->producer].a = reg;
+        t->slots[top] = reg;
+    } else if (source != reg) {
+        before_write(t, reg);
+        emit(t, ROP_MOVE, reg, source, 0);
+    }
+    t->slots[local] = reg;
+    if (pop)
+        t->depth--;
+}
+
+/* Records the depth a jump arrives with at its target. */
+static bool jump_to(Translator* t, int target) {
+    if (target < 0 || target >= t->chunk->count || !t->labels[target])
+        return false;
+    if (t->label_depths[target] == -1)
+        t->label_depths[target] = t->depth;
+    return t->label_depths[target] == t->depth;
+}
+
+static bool find_labels(Translator* t) {
+    Chunk* chunk = t->chunk;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t opcode = chunk->code[offset];
+        int length = instruction_length(opcode);
+        if (offset + length > chunk->count)
+            return false;
+
+        if (length == 3 && opcode != OP_GET_LOCALS) {
+            uint16_t jump = (chunk->code[offset + 1] << 8) |
+                chunk->code[offset + 2];
+            int target = opcode == OP_LOOP
+                ? offset + 3 - jump
+                : offset + 3 + jump;
+            if (target < 0 || target >= chunk->count)
+                return false;
+            t->labels[target] = true;
+        } else if (opcode == OP_FOR_LOOP) {
+            uint16_t jump = (chunk->code[offset + 5] << 8) |
+                chunk->code[offset + 6];
+            if (offset + length - jump < 0)
+                return false;
+            t->labels[offset + length - jump] = true;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+static bool translate_instruction(Translator* t) {
+    Chunk* chunk = t->chunk;
+    uint8_t* code = &chunk->code[t->offset];
+    int top = t->depth - 1;
+    int nil = chunk->constants.count;
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            return push_slot(t, code[1]);
+        case OP_CONSTANT_LONG:
+            return push_slot(t, (code[1] << 16) | (code[2] << 8) | code[3]);
+        case OP_NIL:
+            return push_slot(t, nil);
+        case OP_TRUE:
+            return push_slot(t, nil + 1);
+        case OP_FALSE:
+            return push_slot(t, nil + 2);
+        case OP_GET_LOCAL:
+            return push_slot(t, t->slots[code[1]]);
+        case OP_GET_LOCALS:
+            return push_slot(t, t->slots[code[1]]) && push_slot(t, t->slots[code[2]]);
+        case OP_SET_LOCAL:
+            set_local(t, code[1], false);
+            return true;
+        case OP_SET_LOCAL_POP:
+            set_local(t, code[1], true);
+            return true;
+        case OP_POP:
+            t->depth--;
+            return true;
+
+        case OP_NEGATE:
+        case OP_NEGATE_UNCHECKED:
+        case OP_NOT: {
+            int operand = t->slots[top];
+            t->depth--;
+            return emit_result(t,
+                code[0] == OP_NOT ? ROP_NOT : ROP_NEGATE, operand, 0);
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD_UNCHECKED:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_DIVIDE_UNCHECKED:
+        case OP_LESS_UNCHECKED:
+        case OP_GREATER_UNCHECKED: {
+            static const RegOpCode binary[] = {
+                [OP_ADD] = ROP_ADD,
+                [OP_ADD_NUM] = ROP_ADD,
+                [OP_ADD_STR] = ROP_ADD,
+                [OP_SUBTRACT] = ROP_SUBTRACT,
+                [OP_MULTIPLY] = ROP_MULTIPLY,
+                [OP_MULTIPLY_NUM] = ROP_MULTIPLY,
+                [OP_DIVIDE] = ROP_DIVIDE,
+                [OP_EQUAL] = ROP_EQUAL,
+                [OP_GREATER] = ROP_GREATER,
+                [OP_LESS] = ROP_LESS,
+                [OP_NOT_EQUAL] = ROP_NOT_EQUAL,
+                [OP_GREATER_EQUAL] = ROP_GREATER_EQUAL,
+                [OP_LESS_EQUAL] = ROP_LESS_EQUAL,
+                [OP_ADD_UNCHECKED] = ROP_ADD,
+                [OP_SUBTRACT_UNCHECKED] = ROP_SUBTRACT,
+                [OP_MULTIPLY_UNCHECKED] = ROP_MULTIPLY,
+                [OP_DIVIDE_UNCHECKED] = ROP_DIVIDE,
+                [OP_LESS_UNCHECKED] = ROP_LESS,
+                [OP_GREATER_UNCHECKED] = ROP_GREATER,
+            };
+            int left = t->slots[top - 1];
+            int right = t->slots[top];
+            t->depth -= 2;
+            return emit_result(t, binary[code[0]], left, right);
+        }
+        case OP_ADD_N: {
+            /* Adds left to right into the first operand's register, as
+             * a chain of OP_ADD would. */
+            int first = t->depth - code[1];
+            int left = t->slots[first];
+            for (int i = 1; i < code[1]; i++) {
+                int right = t->slots[first + i];
+                if (i > 1 && right == REGISTER(first))
+                    return false;
+                t->depth = first;
+                if (!emit_result(t, ROP_ADD, left, right))
+                    return false;
+                left = REGISTER(first);
+            }
+            return true;
+        }
+
+        case OP_GET_GLOBAL:
+            return emit_result(t, ROP_GET_GLOBAL, code[1], 0);
+        case OP_SET_GLOBAL:
+            emit(t, ROP_SET_GLOBAL, code[1], t->slots[top], 0);
+            return true;
+        case OP_SET_GLOBAL_POP:
+            emit(t, ROP_SET_GLOBAL, code[1], t->slots[top], 0);
+            t->depth--;
+            return true;
+        case OP_DEFINE_GLOBAL:
+            emit(t, ROP_DEFINE_GLOBAL, code[1], t->slots[top], 0);
+            t->depth--;
+            return true;
+        case OP_PRINT:
+            emit(t, ROP_PRINT, 0, t->slots[top], 0);
+            t->depth--;
+            return true;
+
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED: {
+            uint16_t jump = (code[1] << 8) | code[2];
+            int target = code[0] == OP_LOOP
+                ? t->offset + 3 - jump
+                : t->offset + 3 + jump;
+            int left = 0;
+            int right = 0;
+            RegOpCode op = ROP_JUMP;
+
+            if (code[0] == OP_JUMP_IF_FALSE) {
+                op = ROP_JUMP_IF_FALSE;
+                left = REGISTER(top);
+            } else if (code[0] == OP_POP_JUMP_IF_FALSE) {
+                op = ROP_JUMP_IF_FALSE;
+                left = t->slots[top];
+                t->depth--;
+            } else if (code[0] != OP_JUMP && code[0] != OP_LOOP) {
+                op = code[0] == OP_JUMP_IF_NOT_LESS ||
+                        code[0] == OP_JUMP_IF_NOT_LESS_UNCHECKED
+                    ? ROP_JUMP_IF_NOT_LESS
+                    : ROP_JUMP_IF_NOT_GREATER;
+                left = t->slots[top - 1];
+                right = t->slots[top];
+                t->depth -= 2;
+            }
+            /* Materializing the rest of the stack only writes registers
+             * that nothing reads, so the operands stay valid. */
+            flush(t);
+            if (!jump_to(t, target))
+                return false;
+            emit_jump(t, op, target, left, right);
+            return true;
+        }
+
+        case OP_FOR_LOOP: {
+            /* Adds the step into the counter's register, then tests it
+             * the way the unfused condition would and jumps back while
+             * the test holds. */
+            uint16_t jump = (code[5] << 8) | code[6];
+            int target = t->offset + 7 - jump;
+            int counter = REGISTER(code[1]);
+            before_write(t, counter);
+            emit(t, ROP_ADD, counter, t->slots[code[1]], code[2]);
+            t->slots[code[1]] = counter;
+
+            int limit;
+            switch (code[3] & ~FOR_INCLUSIVE) {
+                case FOR_CONSTANT:
+                    limit = code[4];
+                    break;
+                case FOR_LOCAL:
+                    limit = t->slots[code[4]];
+                    break;
+                default:
+                    if (!emit_result(t, ROP_GET_GLOBAL, code[4], 0))
+                        return false;
+                    limit = REGISTER(t->depth - 1);
+                    t->depth--;
+                    break;
+            }
+            if (!emit_result(t, code[3] & FOR_INCLUSIVE
+                    ? ROP_GREATER : ROP_GREATER_EQUAL, counter, limit))
+                return false;
+            int test = REGISTER(t->depth - 1);
+            t->depth--;
+            flush(t);
+            if (!jump_to(t, target))
+                return false;
+            emit_jump(t, ROP_JUMP_IF_FALSE, target, test, 0);
+            return true;
+        }
+
+        case OP_RETURN:
+            emit(t, ROP_RETURN, 0, 0, 0);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ends_block(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP || opcode == OP_RETURN;
+}
+
+static bool translate(Translator* t) {
+    Chunk* chunk = t->chunk;
+    if (!find_labels(t))
+        return false;
+
+    bool reachable = true;
+    for (t->offset = 0; t->offset < chunk->count;) {
+        if (t->labels[t->offset]) {
+            /* Every path into a label has its stack in place. */
+            if (reachable)
+                flush(t);
+            else if (t->label_depths[t->offset] != -1)
+                t->depth = t->label_depths[t->offset];
+            for (int slot = 0; slot < t->depth; slot++)
+                t->slots[slot] = REGISTER(slot);
+            if (!jump_to(t, t->offset))
+                return false;
+            reachable = true;
+            t->producer = -1;
+        }
+        t->index[t->offset] = t->out->count;
+
+        uint8_t opcode = chunk->code[t->offset];
+        if (reachable) {
+            if (!translate_instruction(t) || t->depth < 0)
+                return false;
+            if (ends_block(opcode))
+                reachable = false;
+        }
+        t->offset += instruction_length(opcode);
+    }
+
+    if (t->out->count > MAX_FRAME)
+        return false;
+    for (int i = 0; i < t->fixup_count; i += 2)
+        t->out->code[t->fixups[i]].a = t->index[t->fixups[i + 1]];
+    return true;
+}
+
+/* Translates chunk into register code. Returns false for bytecode the
+ * register backend does not handle, in which case the chunk should be
+ * run by the stack VM instead.
+ */
+bool compile_registers(Chunk* chunk, RegChunk* reg_chunk) {
+    Translator translator;
+    Translator* t = &translator;
+    t->chunk = chunk;
+    t->out = reg_chunk;
+    t->slots = NULL;
+    t->slot_capacity = 0;
+    t->depth = 0;
+    t->labels = ALLOCATE(bool, chunk->count);
+    t->label_depths = ALLOCATE(int, chunk->count);
+    t->index = ALLOCATE(int, chunk->count);
+    t->fixups = NULL;
+    t->fixup_count = 0;
+    t->fixup_capacity = 0;
+    t->producer = -1;
+    for (int offset = 0; offset < chunk->count; offset++) {
+        t->labels[offset] = false;
+        t->label_depths[offset] = -1;
+    }
+
+    free_reg_chunk(reg_chunk);
+    reg_chunk->source = chunk;
+    /* Constants, then nil, true and false. */
+    reg_chunk->constant_count = chunk->constants.count + 3;
+
+    bool success = translate(t);
+
+    FREE_ARRAY(int, t->slots, t->slot_capacity);
+    FREE_ARRAY(bool, t->labels, chunk->count);
+    FREE_ARRAY(int, t->label_depths, chunk->count);
+    FREE_ARRAY(int, t->index, chunk->count);
+    FREE_ARRAY(int, t->fixups, t->fixup_capacity);
+
+    if (!success) {
+        free_reg_chunk(reg_chunk);
+        return false;
+    }
+#ifdef DEBUG_PRINT_CODE
+    disassemble_reg_chunk(reg_chunk, "registers");
+#endif
+    return true;
+}
+
+#undef MAX_FRAME
+#undef REGISTER
+
+
+#define RA (frame[instruction->a])
+#define RB (frame[instruction->b])
+#define RC (frame[instruction->c])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.global_names.values[slot])
+
+/* runtime_error() takes the line from vm.ip, so point it just past the
+ * bytecode instruction this one was translated from. */
+#define RUNTIME_ERROR(...) \
+    do { \
+        vm.ip = chunk->source->code + \
+            chunk->offsets[instruction - chunk->code] + 1; \
+        runtime_error(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#define BINARY_OP(valueType, op) \
+    do { \
+        Value b = RB; \
+        Value c = RC; \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c)) \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        RA = valueType(AS_NUMBER(b) op AS_NUMBER(c)); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() trace_instruction(chunk, frame, ip)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#if defined(COMPUTED_GOTO) && defined(__GNUC__)
+#define USE_COMPUTED_GOTO
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+#define TARGET(op) L_##op
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        instruction = ip++; \
+        goto *dispatch_table[instruction->op]; \
+    } while (false)
+#else
+#define TARGET(op) case op
+#define DISPATCH() break
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instruction(RegChunk* chunk, Value* frame,
+                              RegInstruction* ip) {
+    printf("    ");
+    for (int reg = 0; reg < chunk->register_count; reg++) {
+        printf("[ ");
+        print_value(frame[chunk->constant_count + reg]);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_reg_instruction(chunk, (int)(ip - chunk->code));
+}
+#endif
+
+
+static InterpretResult execute(RegChunk* chunk, Value* frame) {
+    register RegInstruction* ip = chunk->code;
+    register RegInstruction* instruction;
+
+    #ifdef DEBUG_TRACE_EXECUTION
+        printf("\n===== register trace =====");
+    #endif
+
+#ifdef USE_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        [ROP_MOVE] = &&L_ROP_MOVE,
+        [ROP_NEGATE] = &&L_ROP_NEGATE,
+        [ROP_NOT] = &&L_ROP_NOT,
+        [ROP_ADD] = &&L_ROP_ADD,
+        [ROP_SUBTRACT] = &&L_ROP_SUBTRACT,
+        [ROP_MULTIPLY] = &&L_ROP_MULTIPLY,
+        [ROP_DIVIDE] = &&L_ROP_DIVIDE,
+        [ROP_EQUAL] = &&L_ROP_EQUAL,
+        [ROP_GREATER] = &&L_ROP_GREATER,
+        [ROP_LESS] = &&L_ROP_LESS,
+        [ROP_NOT_EQUAL] = &&L_ROP_NOT_EQUAL,
+        [ROP_GREATER_EQUAL] = &&L_ROP_GREATER_EQUAL,
+        [ROP_LESS_EQUAL] = &&L_ROP_LESS_EQUAL,
+        [ROP_GET_GLOBAL] = &&L_ROP_GET_GLOBAL,
+        [ROP_SET_GLOBAL] = &&L_ROP_SET_GLOBAL,
+        [ROP_DEFINE_GLOBAL] = &&L_ROP_DEFINE_GLOBAL,
+        [ROP_PRINT] = &&L_ROP_PRINT,
+        [ROP_JUMP] = &&L_ROP_JUMP,
+        [ROP_JUMP_IF_FALSE] = &&L_ROP_JUMP_IF_FALSE,
+        [ROP_JUMP_IF_NOT_LESS] = &&L_ROP_JUMP_IF_NOT_LESS,
+        [ROP_JUMP_IF_NOT_GREATER] = &&L_ROP_JUMP_IF_NOT_GREATER,
+        [ROP_RETURN] = &&L_ROP_RETURN,
+    };
+
+    DISPATCH();
+#else
+    for (;;) {
+        TRACE_INSTRUCTION();
+        instruction = ip++;
+        switch (instruction->op) {
+#endif
+            TARGET(ROP_MOVE): {
+                RA = RB;
+                DISPATCH();
+            }
+            TARGET(ROP_NEGATE): {
+                Value b = RB;
+                if (!IS_NUMBER(b))
+                    RUNTIME_ERROR("Operand must be a number.");
+                RA = NUMBER_VAL(-AS_NUMBER(b));
+                DISPATCH();
+            }
+            TARGET(ROP_NOT): {
+                RA = BOOL_VAL(is_falsey(RB));
+                DISPATCH();
+            }
+            TARGET(ROP_ADD): {
+                Value b = RB;
+                Value c = RC;
+                if (IS_NUMBER(b) && IS_NUMBER(c)) {
+                    RA = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+                } else if (IS_STRING(b) && IS_STRING(c)) {
+                    if (!concatenate_strings(b, c, &RA))
+                        RUNTIME_ERROR("String too long.");
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                DISPATCH();
+            }
+            TARGET(ROP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+            TARGET(ROP_MULTIPLY): {
+                Value b = RB;
+                Value c = RC;
+                if (IS_NUMBER(b) && IS_NUMBER(c)) {
+                    RA = NUMBER_VAL(AS_NUMBER(b) * AS_NUMBER(c));
+                } else if (IS_STRING(b) && IS_NUMBER(c)) {
+                    if (!repeat_string(b, AS_NUMBER(c), &RA))
+                        RUNTIME_ERROR("String too long.");
+                } else if (IS_NUMBER(b) && IS_STRING(c)) {
+                    if (!repeat_string(c, AS_NUMBER(b), &RA))
+                        RUNTIME_ERROR("String too long.");
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or a string and a number.");
+                }
+                DISPATCH();
+            }
+            TARGET(ROP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+            TARGET(ROP_EQUAL): {
+                RA = BOOL_VAL(values_equal(RB, RC));
+                DISPATCH();
+            }
+            TARGET(ROP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+            TARGET(ROP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+            TARGET(ROP_NOT_EQUAL): {
+                RA = BOOL_VAL(!values_equal(RB, RC));
+                DISPATCH();
+            }
+            TARGET(ROP_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <); DISPATCH();
+            TARGET(ROP_LESS_EQUAL): BINARY_OP(NOT_BOOL_VAL, >); DISPATCH();
+            TARGET(ROP_GET_GLOBAL): {
+                Value value = vm.globals.values[instruction->b];
+                if (IS_UNDEFINED(value))
+                    RUNTIME_ERROR("Undefined variable '%s'.",
+                        GLOBAL_NAME(instruction->b));
+                RA = value;
+                DISPATCH();
+            }
+            TARGET(ROP_SET_GLOBAL): {
+                Value* global = &vm.globals.values[instruction->a];
+                if (IS_UNDEFINED(*global))
+                    RUNTIME_ERROR("Undefined variable '%s'.",
+                        GLOBAL_NAME(instruction->a));
+                *global = RB;
+                DISPATCH();
+            }
+            TARGET(ROP_DEFINE_GLOBAL): {
+                vm.globals.values[instruction->a] = RB;
+                DISPATCH();
+            }
+            TARGET(ROP_PRINT): {
+                print_value(RB);
+                printf("\n");
+                DISPATCH();
+            }
+            TARGET(ROP_JUMP): {
+                ip = chunk->code + instruction->a;
+                DISPATCH();
+            }
+            TARGET(ROP_JUMP_IF_FALSE): {
+                if (is_falsey(RB))
+                    ip = chunk->code + instruction->a;
+                DISPATCH();
+            }
+            TARGET(ROP_JUMP_IF_NOT_LESS): {
+                Value b = RB;
+                Value c = RC;
+                if (!IS_NUMBER(b) || !IS_NUMBER(c))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                if (!(AS_NUMBER(b) < AS_NUMBER(c)))
+                    ip = chunk->code + instruction->a;
+                DISPATCH();
+            }
+            TARGET(ROP_JUMP_IF_NOT_GREATER): {
+                Value b = RB;
+                Value c = RC;
+                if (!IS_NUMBER(b) || !IS_NUMBER(c))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                if (!(AS_NUMBER(b) > AS_NUMBER(c)))
+                    ip = chunk->code + instruction->a;
+                DISPATCH();
+            }
+            TARGET(ROP_RETURN): {
+                return INTERPRET_OK;
+            }
+#ifndef USE_COMPUTED_GOTO
+        }
+    }
+#endif
+}
+
+#undef DISPATCH
+#undef TARGET
+#undef TRACE_INSTRUCTION
+#undef BINARY_OP
+#undef RUNTIME_ERROR
+#undef GLOBAL_NAME
+#undef RC
+#undef RB
+#undef RA
+
+
+/* Runs register code in a fresh frame. The frame is sized from the
+ * translation, so unlike run() this cannot overflow. */
+InterpretResult run_registers(RegChunk* chunk) {
+    int size = chunk->constant_count + chunk->register_count;
+    Value* frame = ALLOCATE(Value, size);
+    for (int index = 0; index < chunk->constant_count; index++)
+        frame[index] = frame_constant(chunk, index);
+    for (int index = chunk->constant_count; index < size; index++)
+        frame[index] = NIL_VAL;
+
+    InterpretResult result = execute(chunk, frame);
+    FREE_ARRAY(Value, frame, size);
+    return result;
+}
@@ -22,6 +22,7 @@ void init_scanner(const char *source) {
     scanner.start = source;
     scanner.current = source;
     scanner.line = 1;
+    scanner.interpolations = 0;
 }
 
 
@@ -100,7 +101,14 @@ Token scan_token() {
         case '(': return make_token(TOKEN_LEFT_PAREN);
         case ')': return make_token(TOKEN_RIGHT_PAREN);
         case '{': return make_token(TOKEN_LEFT_BRACE);
-        case '}': return make_token(TOKEN_RIGHT_BRACE);
+        case '}':
+            /* Expressions hold no braces, so this ends the innermost
+             * interpolation, if any. */
+            if(scanner.interpolations > 0) {
+                scanner.interpolations -= 1;
+                return string();
+            }
+            return make_token(TOKEN_RIGHT_BRACE);
         case ';': return make_token(TOKEN_SEMICOLON);
         case ',': return make_token(TOKEN_COMMA);
         case '.': return make_token(TOKEN_DOT);
@@ -131,7 +139,14 @@ Token scan_token() {
 static TokenType identifier_type() {
     switch(scanner.start[0]) {
         case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
+        case 'c':
+            if(scanner.current - scanner.start > 1) {
+                switch(scanner.start[1]) {
+                    case 'l': return check_keyword(2, 3, "ass", TOKEN_CLASS);
+                    case 'o': return check_keyword(2, 3, "nst", TOKEN_CONST);
+                }
+            }
+            break;
         case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
         case 'f': {
             if(scanner.current - scanner.start > 1) {
@@ -202,6 +217,12 @@ static Token number() {
 
 static Token string() {
     while(peek() != '"' && !is_at_end()) {
+        if(peek() == '$' && peek_next() == '{') {
+            advance();
+            advance();
+            scanner.interpolations += 1;
+            return make_token(TOKEN_INTERPOLATION);
+        }
         if(peek() == '\n') scanner.line += 1;
         advance();
     }
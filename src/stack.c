@@ -1,36 +1,116 @@
+#ifdef __unix__
+#define _DEFAULT_SOURCE
+#endif
+
 #include "stack.h"
 #include "memory.h"
 
-void init_stack(Stack* stack) {
-    stack->data = reallocate(NULL, 0, DEFAULT_STACK_SIZE * sizeof(Value));
-    stack->top = stack->data;
-    stack->size = DEFAULT_STACK_SIZE;
-}
+#include <setjmp.h>
+
+#ifdef STACK_GUARD_PAGE
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+static Stack* guarded_stack = NULL;
+static sigjmp_buf overflow_jump;
+/* Set by init_stack(), since handle_fault() cannot call sysconf(). */
+static size_t page_size = 0;
 
-void push(Stack* stack, Value value) {
-    int used = stack->top - stack->data;
-    if(stack->size < used + 1) {
-        stack->size *= STACK_GROWTH_FACTOR;
-        stack->data = reallocate(stack->data, used * sizeof(Value), stack->size * sizeof(Value));
-        stack->top = stack->data + used;
+static char* guard_page(Stack* stack) {
+    return (char*)(stack->data - 1) + stack->reserved;
+}
+
+/* Any other fault is not ours: put the default action back and return,
+ * so the faulting instruction runs again and takes the normal crash. */
+static void handle_fault(int signal, siginfo_t* info, void* context) {
+    (void)signal;
+    (void)context;
+    char* address = (char*)info->si_addr;
+    if (guarded_stack != NULL && address >= guard_page(guarded_stack) &&
+        address < guard_page(guarded_stack) + page_size) {
+        siglongjmp(overflow_jump, 1);
     }
 
-    *(stack->top) = value;
-    stack->top += 1;
+    struct sigaction action;
+    action.sa_handler = SIG_DFL;
+    action.sa_flags = 0;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
 }
+#else
+static jmp_buf overflow_jump;
+
+/* Called by push() on a full stack, in place of the fault. */
+void stack_overflow() {
+    longjmp(overflow_jump, 1);
+}
+#endif
+
+void init_stack(Stack* stack) {
+#ifdef STACK_GUARD_PAGE
+    /* Round up to whole pages so the guard starts right after the last
+     * usable slot. Pages are only committed once they are touched. */
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    stack->reserved = ((STACK_MAX + 1) * sizeof(Value) + page_size - 1) /
+        page_size * page_size;
 
+    char* region = mmap(NULL, stack->reserved + page_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) exit(1);
+    mprotect(region + stack->reserved, page_size, PROT_NONE);
+    stack->data = (Value*)region + 1;
 
-Value pop(Stack* stack) {
-    stack->top -= 1;
-    return *(stack->top);
+    struct sigaction action;
+    action.sa_sigaction = handle_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+#else
+    stack->reserved = (STACK_MAX + 1) * sizeof(Value);
+    stack->data = (Value*)reallocate(NULL, 0, stack->reserved) + 1;
+#endif
+    stack->top = stack->data;
 }
 
 void free_stack(Stack* stack) {
-    stack->data = reallocate(stack->data, stack->size * sizeof(Value), 0);
+#ifdef STACK_GUARD_PAGE
+    munmap(stack->data - 1, stack->reserved + page_size);
+#else
+    reallocate(stack->data - 1, stack->reserved, 0);
+#endif
+    stack->data = NULL;
     stack->top = NULL;
 }
 
-Value peek(Stack* stack, int depth) {
-    return stack->top[-1 - depth];
-}
\ No newline at end of file
+void reset_stack(Stack* stack) {
+    stack->top = stack->data;
+}
+
+/* How many values fit before a push overflows: STACK_MAX, or a few more
+ * where the reservation was rounded up to whole pages. */
+int stack_capacity(Stack* stack) {
+    return (int)(stack->reserved / sizeof(Value)) - 1;
+}
+
+/* Calls body and stores what it returns in result. Returns false
+ * instead if body overflowed the stack, in which case body was
+ * abandoned mid-way and the stack is left as it was at the fault.
+ */
+bool stack_guarded_call(Stack* stack, StackBody body, int* result) {
+#ifdef STACK_GUARD_PAGE
+    if (sigsetjmp(overflow_jump, 1) != 0) {
+        guarded_stack = NULL;
+        return false;
+    }
+
+    guarded_stack = stack;
+    *result = body();
+    guarded_stack = NULL;
+#else
+    if (setjmp(overflow_jump) != 0)
+        return false;
+    *result = body();
+#endif
+    return true;
+}
@@ -8,7 +8,7 @@
 #include "value.h"
 
 static Entry* find_entry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
+    uint32_t index = string_hash(key) % capacity;
     Entry* tombstone = NULL;
 
     for (;;) {
@@ -71,7 +71,10 @@ void free_table(Table* table) {
     table->capacity = 0;
 }
 
+/* Keys are compared by pointer, so a string the program built is
+ * interned the first time it is used as one. */
 bool table_set(Table* table, ObjString* key, Value value) {
+    key = intern_string(key);
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjust_capacity(table, capacity);
@@ -100,6 +103,7 @@ bool table_get(Table* table, ObjString* key, Value* value) {
     if (table->count == 0)
         return false;
 
+    key = intern_string(key);
     Entry* entry = find_entry(table->entries, table->capacity, key);
     if (entry->key == NULL)
         return false;
@@ -112,6 +116,7 @@ bool table_delete(Table* table, ObjString* key) {
     if (table->count == 0)
         return false;
 
+    key = intern_string(key);
     Entry* entry = find_entry(table->entries, table->capacity, key);
     if (entry->key == NULL)
         return false;
@@ -0,0 +1,1182 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+#ifdef TRACING_SUPPORTED
+
+#include "debug.h"
+#include "memory.h"
+#include "vm.h"
+
+#define HOT_LOOP 50             /* back-edges before a loop is recorded */
+#define MAX_ATTEMPTS 3          /* failed recordings before giving up */
+#define HOT_EXIT 50             /* branch exits before a loop is re-recorded */
+#define MAX_TRACE 512           /* instructions in one trace */
+#define MAX_TEMPS 6             /* stack values, held in xmm2-xmm7 */
+#define VAR_REGISTERS 8         /* variables held in xmm8-xmm15 */
+
+typedef enum {
+    TYPE_NUMBER,
+    TYPE_BOOL,
+} TraceType;
+
+typedef struct {
+    int offset;
+    bool taken;                 /* whether a conditional jump jumped */
+} TraceStep;
+
+typedef struct {
+    TraceStep steps[MAX_TRACE];
+    int count;
+} Recording;
+
+/* A local below the loop or a global that the trace reads or writes.
+ * Inside the trace it is an unboxed double (bools are 0 and 1). */
+typedef struct {
+    bool global;
+    uint8_t slot;
+    TraceType type;             /* on entry, and so at the back-edge */
+} TraceVar;
+
+/* Where a side exit resumes, and the types of what it leaves in the
+ * spill area: depth stack values, then every variable. A branch exit
+ * resumes inside the loop, so the recorded path has gone cold. */
+typedef struct {
+    int offset;
+    int depth;
+    int types;                  /* index into Trace.exit_types */
+    bool branch;
+    int hits;
+} TraceExit;
+
+typedef struct {
+    int entry_depth;            /* stack depth at the loop header */
+    TraceVar* vars;
+    int var_count;
+    TraceExit* exits;
+    int exit_count;
+    int exit_capacity;
+    uint8_t* exit_types;
+    int exit_types_count;
+    int exit_types_capacity;
+    double* spill;              /* variables, then exit stack values */
+    uint8_t* code;
+    size_t code_size;
+} Trace;
+
+typedef struct {
+    uint16_t hotness;
+    uint8_t attempts;
+    bool blacklisted;
+    Trace* trace;
+} LoopState;
+
+typedef int (*TraceFunction)(double* spill);
+
+static LoopState* loops = NULL;
+static int loop_count = 0;
+
+
+static bool is_traceable(Value value) {
+    return IS_NUMBER(value) || IS_BOOL(value);
+}
+
+static uint16_t read_short(uint8_t* ip) {
+    return (uint16_t)((ip[1] << 8) | ip[2]);
+}
+
+static uint32_t read_long(uint8_t* ip) {
+    return (uint32_t)((ip[1] << 16) | (ip[2] << 8) | ip[3]);
+}
+
+/* How far the jump at ip goes from the end of the instruction, in its
+ * short or its long form. Back-edges go a negative distance. */
+static int jump_distance(uint8_t* ip) {
+    switch (*ip) {
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return (int)read_long(ip);
+        case OP_LOOP_LONG:
+            return -(int)read_long(ip);
+        case OP_LOOP:
+            return -read_short(ip);
+        case OP_FOR_LOOP:
+            return -((ip[5] << 8) | ip[6]);
+        default:
+            return read_short(ip);
+    }
+}
+
+/* The limit OP_FOR_LOOP at ip tests its counter against. */
+static Value for_limit(uint8_t* ip) {
+    switch (ip[3] & ~FOR_INCLUSIVE) {
+        case FOR_CONSTANT: return vm.chunk->constants.values[ip[4]];
+        case FOR_LOCAL:    return vm.stack.data[ip[4]];
+        default:           return vm.globals.values[ip[4]];
+    }
+}
+
+/* Runs one iteration of the loop starting at header exactly as run()
+ * would, writing down the path it takes until it is back at the
+ * header. Inner loops are unrolled into the recording. Stops in front
+ * of anything a trace cannot hold, such as strings, or of a push that
+ * would overflow the stack, and returns where the interpreter should
+ * carry on: the header again if the iteration was recorded completely.
+ */
+static uint8_t* record(uint8_t* header, Recording* recording, bool* complete) {
+    Stack* stack = &vm.stack;
+    uint8_t* ip = header;
+    *complete = false;
+    recording->count = 0;
+
+    while (recording->count < MAX_TRACE) {
+        TraceStep* step = &recording->steps[recording->count];
+        step->offset = (int)(ip - vm.chunk->code);
+        step->taken = false;
+        uint8_t* next = ip + instruction_length(*ip);
+        /* The interpreter reports the overflow, from where it resumes. */
+        if (stack->top - stack->data + stack_effect(ip) >
+            stack_capacity(stack))
+            return ip;
+
+        switch (*ip) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG: {
+                int index = *ip == OP_CONSTANT ? ip[1] : read_long(ip);
+                Value value = vm.chunk->constants.values[index];
+                if (!is_traceable(value))
+                    return ip;
+                push(stack, value);
+                break;
+            }
+            case OP_TRUE:
+                push(stack, BOOL_VAL(true));
+                break;
+            case OP_FALSE:
+                push(stack, BOOL_VAL(false));
+                break;
+            case OP_POP:
+                stack->top--;
+                break;
+            case OP_GET_LOCAL:
+                if (!is_traceable(stack->data[ip[1]]))
+                    return ip;
+                push(stack, stack->data[ip[1]]);
+                break;
+            case OP_GET_LOCALS:
+                if (!is_traceable(stack->data[ip[1]]) ||
+                    !is_traceable(stack->data[ip[2]]))
+                    return ip;
+                push(stack, stack->data[ip[1]]);
+                push(stack, stack->data[ip[2]]);
+                break;
+            case OP_SET_LOCAL:
+                stack->data[ip[1]] = peek(stack, 0);
+                break;
+            case OP_SET_LOCAL_POP:
+                stack->data[ip[1]] = pop(stack);
+                break;
+            case OP_GET_GLOBAL:
+                if (!is_traceable(vm.globals.values[ip[1]]))
+                    return ip;
+                push(stack, vm.globals.values[ip[1]]);
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_POP:
+                if (IS_UNDEFINED(vm.globals.values[ip[1]]))
+                    return ip;
+                vm.globals.values[ip[1]] = peek(stack, 0);
+                if (*ip == OP_SET_GLOBAL_POP)
+                    stack->top--;
+                break;
+
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_MULTIPLY_NUM:
+            case OP_DIVIDE:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_ADD_UNCHECKED:
+            case OP_SUBTRACT_UNCHECKED:
+            case OP_MULTIPLY_UNCHECKED:
+            case OP_DIVIDE_UNCHECKED:
+            case OP_GREATER_UNCHECKED:
+            case OP_LESS_UNCHECKED: {
+                if (!IS_NUMBER(peek(stack, 0)) || !IS_NUMBER(peek(stack, 1)))
+                    return ip;
+                double b = AS_NUMBER(pop(stack));
+                double a = AS_NUMBER(pop(stack));
+                switch (*ip) {
+                    case OP_SUBTRACT:
+                    case OP_SUBTRACT_UNCHECKED: push(stack, NUMBER_VAL(a - b)); break;
+                    case OP_MULTIPLY:
+                    case OP_MULTIPLY_NUM:
+                    case OP_MULTIPLY_UNCHECKED: push(stack, NUMBER_VAL(a * b)); break;
+                    case OP_DIVIDE:
+                    case OP_DIVIDE_UNCHECKED: push(stack, NUMBER_VAL(a / b)); break;
+                    case OP_GREATER:
+                    case OP_GREATER_UNCHECKED: push(stack, BOOL_VAL(a > b)); break;
+                    case OP_LESS:
+                    case OP_LESS_UNCHECKED: push(stack, BOOL_VAL(a < b)); break;
+                    case OP_GREATER_EQUAL: push(stack, BOOL_VAL(!(a < b))); break;
+                    case OP_LESS_EQUAL: push(stack, BOOL_VAL(!(a > b))); break;
+                    default: push(stack, NUMBER_VAL(a + b)); break;
+                }
+                break;
+            }
+            case OP_EQUAL:
+            case OP_NOT_EQUAL: {
+                Value b = pop(stack);
+                Value a = pop(stack);
+                push(stack, BOOL_VAL(values_equal(a, b) == (*ip == OP_EQUAL)));
+                break;
+            }
+            case OP_NOT:
+                stack->top[-1] = BOOL_VAL(is_falsey(stack->top[-1]));
+                break;
+            case OP_NEGATE:
+            case OP_NEGATE_UNCHECKED:
+                if (!IS_NUMBER(peek(stack, 0)))
+                    return ip;
+                stack->top[-1] = NUMBER_VAL(-AS_NUMBER(stack->top[-1]));
+                break;
+            case OP_PRINT:
+                print_value(pop(stack));
+                printf("\n");
+                break;
+
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+                next += jump_distance(ip);
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_LONG:
+                step->taken = is_falsey(peek(stack, 0));
+                break;
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_POP_JUMP_IF_FALSE_LONG:
+                step->taken = is_falsey(pop(stack));
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+            case OP_JUMP_IF_NOT_GREATER_UNCHECKED: {
+                if (!IS_NUMBER(peek(stack, 0)) || !IS_NUMBER(peek(stack, 1)))
+                    return ip;
+                double b = AS_NUMBER(pop(stack));
+                double a = AS_NUMBER(pop(stack));
+                bool less = *ip == OP_JUMP_IF_NOT_LESS ||
+                    *ip == OP_JUMP_IF_NOT_LESS_UNCHECKED;
+                step->taken = less ? !(a < b) : !(a > b);
+                break;
+            }
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                next += jump_distance(ip);
+                break;
+            case OP_FOR_LOOP: {
+                /* A limit in the counter's own slot is a number if the
+                 * counter is, so both can be checked up front. */
+                if (!IS_NUMBER(stack->data[ip[1]]) ||
+                    !IS_NUMBER(for_limit(ip)))
+                    return ip;
+                double value = AS_NUMBER(stack->data[ip[1]]) +
+                    AS_NUMBER(vm.chunk->constants.values[ip[2]]);
+                stack->data[ip[1]] = NUMBER_VAL(value);
+                double limit = AS_NUMBER(for_limit(ip));
+                step->taken = ip[3] & FOR_INCLUSIVE
+                    ? !(value > limit)
+                    : value < limit;
+                break;
+            }
+            default:
+                return ip;
+        }
+        if (step->taken)
+            next += jump_distance(ip);
+        recording->count++;
+        ip = next;
+        if (ip == header) {
+            *complete = true;
+            break;
+        }
+    }
+    return ip;
+}
+
+
+/* Where a value sits while the trace is compiled. A constant or a
+ * variable is only referenced, and loaded by whatever consumes it; a
+ * temp is in the register of its own stack position. */
+typedef enum {
+    OPERAND_CONSTANT,
+    OPERAND_VAR,
+    OPERAND_TEMP,
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    TraceType type;
+    int index;                  /* of the variable */
+    uint64_t bits;              /* of the constant */
+} Operand;
+
+typedef struct {
+    Trace* trace;
+    Chunk* chunk;
+    CodeBuffer code;
+    CodeBuffer exits;           /* side exit stubs, placed after code */
+    int* guards;                /* jcc rel32 in code, stub in exits */
+    int guard_count;
+    int guard_capacity;
+    Operand stack[MAX_TEMPS];
+    int depth;
+    int first;                  /* lowest and highest recorded offsets */
+    int last;
+    TraceType* types;           /* current type of each variable */
+    int local_vars[UINT8_COUNT];
+    int global_vars[UINT8_COUNT];
+} TraceCompiler;
+
+#define TEMP(depth) (2 + (depth))
+#define VAR_REGISTER(index) (8 + (index))
+#define SPILL(index) ((int32_t)((index) * sizeof(double)))
+
+/* SSE2 opcodes as prefix and second opcode byte. */
+#define MOVSD_LOAD  0xF2, 0x10
+#define MOVSD_STORE 0xF2, 0x11
+#define MOVAPD      0x66, 0x28
+#define ADDSD       0xF2, 0x58
+#define MULSD       0xF2, 0x59
+#define SUBSD       0xF2, 0x5C
+#define DIVSD       0xF2, 0x5E
+#define UCOMISD     0x66, 0x2E
+#define XORPD       0x66, 0x57
+#define CVTSI2SD    0xF2, 0x2A
+
+/* op xmm, rm with rm a register. */
+static void emit_sse(CodeBuffer* code, uint8_t prefix, uint8_t op,
+                     int reg, int rm) {
+    uint8_t rex = 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+    EMIT(code, prefix);
+    if (rex != 0x40)
+        EMIT(code, rex);
+    EMIT(code, 0x0F, op, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op xmm, [rbx + disp] */
+static void emit_sse_spill(CodeBuffer* code, uint8_t prefix, uint8_t op,
+                           int reg, int32_t disp) {
+    EMIT(code, prefix);
+    if (reg >= 8)
+        EMIT(code, 0x44);
+    EMIT(code, 0x0F, op, 0x80 | ((reg & 7) << 3) | RBX);
+    emit_u32(code, (uint32_t)disp);
+}
+
+/* movq xmm, rax */
+static void emit_movq_from_rax(CodeBuffer* code, int xmm) {
+    EMIT(code, 0x66, 0x48 | (xmm >= 8 ? 4 : 0), 0x0F, 0x6E,
+        0xC0 | ((xmm & 7) << 3) | RAX);
+}
+
+static bool var_in_register(int index) {
+    return index < VAR_REGISTERS;
+}
+
+static void load(CodeBuffer* code, int xmm, Operand operand) {
+    switch (operand.kind) {
+        case OPERAND_CONSTANT:
+            emit_mov_imm64(code, RAX, operand.bits);
+            emit_movq_from_rax(code, xmm);
+            break;
+        case OPERAND_VAR:
+            if (!var_in_register(operand.index))
+                emit_sse_spill(code, MOVSD_LOAD, xmm, SPILL(operand.index));
+            else if (VAR_REGISTER(operand.index) != xmm)
+                emit_sse(code, MOVAPD, xmm, VAR_REGISTER(operand.index));
+            break;
+        case OPERAND_TEMP:
+            if (TEMP(operand.index) != xmm)
+                emit_sse(code, MOVAPD, xmm, TEMP(operand.index));
+            break;
+    }
+}
+
+/* Stores operand into spill slot index, using xmm0 if it has to. */
+static void spill(CodeBuffer* code, int index, Operand operand) {
+    int xmm = 0;
+    if (operand.kind == OPERAND_TEMP)
+        xmm = TEMP(operand.index);
+    else if (operand.kind == OPERAND_VAR && var_in_register(operand.index))
+        xmm = VAR_REGISTER(operand.index);
+    else
+        load(code, 0, operand);
+    emit_sse_spill(code, MOVSD_STORE, xmm, SPILL(index));
+}
+
+/* op temp, operand for the arithmetic SSE2 opcode op. */
+static void emit_arithmetic(TraceCompiler* c, uint8_t prefix, uint8_t op,
+                            int temp, Operand operand) {
+    switch (operand.kind) {
+        case OPERAND_CONSTANT:
+            load(&c->code, 0, operand);
+            emit_sse(&c->code, prefix, op, TEMP(temp), 0);
+            break;
+        case OPERAND_VAR:
+            if (var_in_register(operand.index))
+                emit_sse(&c->code, prefix, op, TEMP(temp),
+                    VAR_REGISTER(operand.index));
+            else
+                emit_sse_spill(&c->code, prefix, op, TEMP(temp),
+                    SPILL(operand.index));
+            break;
+        case OPERAND_TEMP:
+            emit_sse(&c->code, prefix, op, TEMP(temp), TEMP(operand.index));
+            break;
+    }
+}
+
+static Operand temp_operand(int depth, TraceType type) {
+    Operand operand;
+    operand.kind = OPERAND_TEMP;
+    operand.type = type;
+    operand.index = depth;
+    operand.bits = 0;
+    return operand;
+}
+
+static bool push_operand(TraceCompiler* c, Operand operand) {
+    if (c->depth == MAX_TEMPS)
+        return false;
+    c->stack[c->depth++] = operand;
+    return true;
+}
+
+/* Turns the flag in al into a bool in temp. */
+static void emit_flag_to_bool(TraceCompiler* c, int temp) {
+    EMIT(&c->code, 0x0F, 0xB6, 0xC0);       /* movzx eax, al */
+    emit_sse(&c->code, CVTSI2SD, TEMP(temp), RAX);
+}
+
+/* Sets al to whether xmm0 holds a falsey value: a false bool or a
+ * zero. NaN is unordered, not equal, so it stays truthy. */
+static void emit_falsey(TraceCompiler* c) {
+    emit_sse(&c->code, XORPD, 1, 1);
+    emit_sse(&c->code, UCOMISD, 0, 1);
+    EMIT(&c->code, 0x0F, 0x94, 0xC0);       /* sete al */
+    EMIT(&c->code, 0x0F, 0x9B, 0xC1);       /* setnp cl */
+    EMIT(&c->code, 0x20, 0xC8);             /* and al, cl */
+}
+
+static int find_var(TraceCompiler* c, bool global, uint8_t slot) {
+    int* vars = global ? c->global_vars : c->local_vars;
+    return vars[slot];
+}
+
+/* Materializes every stack value that still refers to variable index,
+ * before the variable is overwritten. */
+static void before_write(TraceCompiler* c, int index) {
+    for (int depth = 0; depth < c->depth; depth++) {
+        Operand* operand = &c->stack[depth];
+        if (operand->kind == OPERAND_VAR && operand->index == index) {
+            load(&c->code, TEMP(depth), *operand);
+            *operand = temp_operand(depth, operand->type);
+        }
+    }
+}
+
+static void write_var(TraceCompiler* c, int index, Operand value) {
+    if (value.kind == OPERAND_VAR && value.index == index)
+        return;
+    before_write(c, index);
+    if (var_in_register(index))
+        load(&c->code, VAR_REGISTER(index), value);
+    else
+        spill(&c->code, index, value);
+    c->types[index] = value.type;
+}
+
+/* Reads a stack slot at or above the loop's entry depth. */
+static bool get_stack_slot(TraceCompiler* c, int depth) {
+    Operand operand = c->stack[depth];
+    if (operand.kind != OPERAND_TEMP)
+        return push_operand(c, operand);
+    if (!push_operand(c, temp_operand(c->depth, operand.type)))
+        return false;
+    load(&c->code, TEMP(c->depth - 1), operand);
+    return true;
+}
+
+static void set_stack_slot(TraceCompiler* c, int depth) {
+    Operand value = c->stack[c->depth - 1];
+    if (value.kind == OPERAND_TEMP) {
+        load(&c->code, TEMP(depth), value);
+        value = temp_operand(depth, value.type);
+    }
+    c->stack[depth] = value;
+}
+
+static bool get_local(TraceCompiler* c, uint8_t slot) {
+    int entry_depth = c->trace->entry_depth;
+    if (slot >= entry_depth)
+        return slot - entry_depth < c->depth &&
+            get_stack_slot(c, slot - entry_depth);
+
+    int index = find_var(c, false, slot);
+    Operand operand = { OPERAND_VAR, c->types[index], index, 0 };
+    return push_operand(c, operand);
+}
+
+static bool set_local(TraceCompiler* c, uint8_t slot) {
+    int entry_depth = c->trace->entry_depth;
+    if (slot >= entry_depth) {
+        if (slot - entry_depth >= c->depth - 1)
+            return false;
+        set_stack_slot(c, slot - entry_depth);
+    } else {
+        write_var(c, find_var(c, false, slot), c->stack[c->depth - 1]);
+    }
+    return true;
+}
+
+static void add_guard(TraceCompiler* c, int position, int stub) {
+    if (c->guard_capacity < c->guard_count + 2) {
+        int old_capacity = c->guard_capacity;
+        c->guard_capacity = GROW_CAPACITY(old_capacity);
+        c->guards = GROW_ARRAY(int, c->guards, old_capacity, c->guard_capacity);
+    }
+    c->guards[c->guard_count++] = position;
+    c->guards[c->guard_count++] = stub;
+}
+
+static void add_exit_types(Trace* trace, uint8_t type) {
+    if (trace->exit_types_capacity < trace->exit_types_count + 1) {
+        int old_capacity = trace->exit_types_capacity;
+        trace->exit_types_capacity = GROW_CAPACITY(old_capacity);
+        trace->exit_types = GROW_ARRAY(uint8_t, trace->exit_types,
+            old_capacity, trace->exit_types_capacity);
+    }
+    trace->exit_types[trace->exit_types_count++] = type;
+}
+
+/* Emits a jcc that leaves the trace for bytecode offset resume, with
+ * the stub that stores the current stack and variables for the exit
+ * handler. */
+static void emit_side_exit(TraceCompiler* c, uint8_t condition, int resume) {
+    Trace* trace = c->trace;
+    if (trace->exit_capacity < trace->exit_count + 1) {
+        int old_capacity = trace->exit_capacity;
+        trace->exit_capacity = GROW_CAPACITY(old_capacity);
+        trace->exits = GROW_ARRAY(TraceExit, trace->exits,
+            old_capacity, trace->exit_capacity);
+    }
+    TraceExit* exit = &trace->exits[trace->exit_count];
+    exit->offset = resume;
+    exit->depth = c->depth;
+    exit->types = trace->exit_types_count;
+    exit->branch = resume >= c->first && resume <= c->last;
+    exit->hits = 0;
+
+    add_guard(c, emit_jcc(&c->code, condition), c->exits.count);
+    for (int depth = 0; depth < c->depth; depth++) {
+        spill(&c->exits, trace->var_count + depth, c->stack[depth]);
+        add_exit_types(trace, c->stack[depth].type);
+    }
+    for (int index = 0; index < trace->var_count; index++) {
+        if (var_in_register(index))
+            emit_sse_spill(&c->exits, MOVSD_STORE, VAR_REGISTER(index),
+                SPILL(index));
+        add_exit_types(trace, c->types[index]);
+    }
+    EMIT(&c->exits, 0xB8);                  /* mov eax, exit */
+    emit_u32(&c->exits, trace->exit_count);
+    EMIT(&c->exits, 0x5B);                  /* pop rbx */
+    EMIT(&c->exits, 0xC3);                  /* ret */
+    trace->exit_count++;
+}
+
+static Value box(double value, TraceType type) {
+    return type == TYPE_BOOL ? BOOL_VAL(value != 0) : NUMBER_VAL(value);
+}
+
+/* Called from a trace, with the trace's registers saved around it. */
+static void print_traced(double value, int type) {
+    print_value(box(value, (TraceType)type));
+    printf("\n");
+}
+
+static void emit_print(TraceCompiler* c) {
+    Trace* trace = c->trace;
+    Operand value = c->stack[--c->depth];
+    load(&c->code, 0, value);
+
+    /* Every xmm register is caller-saved. */
+    for (int index = 0; index < trace->var_count && var_in_register(index);
+         index++)
+        emit_sse_spill(&c->code, MOVSD_STORE, VAR_REGISTER(index),
+            SPILL(index));
+    for (int depth = 0; depth < c->depth; depth++) {
+        if (c->stack[depth].kind == OPERAND_TEMP)
+            emit_sse_spill(&c->code, MOVSD_STORE, TEMP(depth),
+                SPILL(trace->var_count + depth));
+    }
+
+    EMIT(&c->code, 0xBF);                   /* mov edi, type */
+    emit_u32(&c->code, value.type);
+    emit_mov_imm64(&c->code, RAX, (uint64_t)(uintptr_t)print_traced);
+    EMIT(&c->code, 0xFF, 0xD0);             /* call rax */
+
+    for (int index = 0; index < trace->var_count && var_in_register(index);
+         index++)
+        emit_sse_spill(&c->code, MOVSD_LOAD, VAR_REGISTER(index),
+            SPILL(index));
+    for (int depth = 0; depth < c->depth; depth++) {
+        if (c->stack[depth].kind == OPERAND_TEMP)
+            emit_sse_spill(&c->code, MOVSD_LOAD, TEMP(depth),
+                SPILL(trace->var_count + depth));
+    }
+}
+
+/* Adds the step to the counter, then leaves the trace wherever the test
+ * would not send the recorded way. */
+static bool compile_for_loop(TraceCompiler* c, TraceStep* step) {
+    uint8_t* ip = &c->chunk->code[step->offset];
+    int a = c->depth;
+    if (!get_local(c, ip[1]) || c->stack[a].type != TYPE_NUMBER)
+        return false;
+    load(&c->code, TEMP(a), c->stack[a]);
+    Operand increment = { OPERAND_CONSTANT, TYPE_NUMBER, 0, 0 };
+    double number = AS_NUMBER(c->chunk->constants.values[ip[2]]);
+    memcpy(&increment.bits, &number, sizeof(number));
+    emit_arithmetic(c, ADDSD, a, increment);
+    c->stack[a] = temp_operand(a, TYPE_NUMBER);
+    if (!set_local(c, ip[1]))
+        return false;
+
+    switch (ip[3] & ~FOR_INCLUSIVE) {
+        case FOR_CONSTANT: {
+            Operand limit = { OPERAND_CONSTANT, TYPE_NUMBER, 0, 0 };
+            number = AS_NUMBER(c->chunk->constants.values[ip[4]]);
+            memcpy(&limit.bits, &number, sizeof(number));
+            if (!push_operand(c, limit))
+                return false;
+            break;
+        }
+        case FOR_LOCAL:
+            if (!get_local(c, ip[4]))
+                return false;
+            break;
+        default: {
+            int index = find_var(c, true, ip[4]);
+            Operand limit = { OPERAND_VAR, c->types[index], index, 0 };
+            if (!push_operand(c, limit))
+                return false;
+            break;
+        }
+    }
+    if (c->stack[a + 1].type != TYPE_NUMBER)
+        return false;
+    load(&c->code, 0, c->stack[a]);
+    load(&c->code, 1, c->stack[a + 1]);
+    c->depth = a;
+
+    /* "above" means the counter is past an inclusive limit, or not
+     * yet at an exclusive one. */
+    int end = step->offset + instruction_length(ip[0]);
+    bool inclusive = ip[3] & FOR_INCLUSIVE;
+    if (inclusive)
+        emit_sse(&c->code, UCOMISD, 0, 1);
+    else
+        emit_sse(&c->code, UCOMISD, 1, 0);
+    if (step->taken)
+        emit_side_exit(c, inclusive ? JA : JBE, end);
+    else
+        emit_side_exit(c, inclusive ? JBE : JA, end + jump_distance(ip));
+    return true;
+}
+
+static bool compile_step(TraceCompiler* c, TraceStep* step) {
+    uint8_t* ip = &c->chunk->code[step->offset];
+
+    switch (ip[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: {
+            int index = ip[0] == OP_CONSTANT ? ip[1] : read_long(ip);
+            Value value = c->chunk->constants.values[index];
+            Operand operand = { OPERAND_CONSTANT, TYPE_NUMBER, 0, 0 };
+            double number = IS_BOOL(value) ? AS_BOOL(value) : AS_NUMBER(value);
+            if (IS_BOOL(value))
+                operand.type = TYPE_BOOL;
+            memcpy(&operand.bits, &number, sizeof(number));
+            return push_operand(c, operand);
+        }
+        case OP_TRUE:
+        case OP_FALSE: {
+            Operand operand = { OPERAND_CONSTANT, TYPE_BOOL, 0, 0 };
+            double number = ip[0] == OP_TRUE;
+            memcpy(&operand.bits, &number, sizeof(number));
+            return push_operand(c, operand);
+        }
+        case OP_POP:
+            c->depth--;
+            return true;
+        case OP_GET_LOCAL:
+            return get_local(c, ip[1]);
+        case OP_GET_LOCALS:
+            return get_local(c, ip[1]) && get_local(c, ip[2]);
+        case OP_SET_LOCAL:
+            return set_local(c, ip[1]);
+        case OP_SET_LOCAL_POP:
+            if (!set_local(c, ip[1]))
+                return false;
+            c->depth--;
+            return true;
+        case OP_GET_GLOBAL: {
+            int index = find_var(c, true, ip[1]);
+            Operand operand = { OPERAND_VAR, c->types[index], index, 0 };
+            return push_operand(c, operand);
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            write_var(c, find_var(c, true, ip[1]), c->stack[c->depth - 1]);
+            if (ip[0] == OP_SET_GLOBAL_POP)
+                c->depth--;
+            return true;
+
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE:
+        case OP_ADD_UNCHECKED:
+        case OP_SUBTRACT_UNCHECKED:
+        case OP_MULTIPLY_UNCHECKED:
+        case OP_DIVIDE_UNCHECKED: {
+            int a = c->depth - 2;
+            if (c->stack[a].type != TYPE_NUMBER ||
+                c->stack[a + 1].type != TYPE_NUMBER)
+                return false;
+            load(&c->code, TEMP(a), c->stack[a]);
+            switch (ip[0]) {
+                case OP_SUBTRACT:
+                case OP_SUBTRACT_UNCHECKED:
+                    emit_arithmetic(c, SUBSD, a, c->stack[a + 1]);
+                    break;
+                case OP_MULTIPLY:
+                case OP_MULTIPLY_NUM:
+                case OP_MULTIPLY_UNCHECKED:
+                    emit_arithmetic(c, MULSD, a, c->stack[a + 1]);
+                    break;
+                case OP_DIVIDE:
+                case OP_DIVIDE_UNCHECKED:
+                    emit_arithmetic(c, DIVSD, a, c->stack[a + 1]);
+                    break;
+                default:
+                    emit_arithmetic(c, ADDSD, a, c->stack[a + 1]);
+                    break;
+            }
+            c->stack[a] = temp_operand(a, TYPE_NUMBER);
+            c->depth--;
+            return true;
+        }
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_UNCHECKED:
+        case OP_LESS_UNCHECKED: {
+            int a = c->depth - 2;
+            Operand left = c->stack[a];
+            Operand right = c->stack[a + 1];
+            bool equality = ip[0] == OP_EQUAL || ip[0] == OP_NOT_EQUAL;
+            c->depth -= 2;
+            if (equality && left.type != right.type) {
+                Operand result = { OPERAND_CONSTANT, TYPE_BOOL, 0, 0 };
+                double number = ip[0] == OP_NOT_EQUAL;
+                memcpy(&result.bits, &number, sizeof(number));
+                return push_operand(c, result);
+            }
+            if (!equality &&
+                (left.type != TYPE_NUMBER || right.type != TYPE_NUMBER))
+                return false;
+
+            load(&c->code, 0, left);
+            load(&c->code, 1, right);
+            switch (ip[0]) {
+                case OP_LESS:
+                case OP_LESS_UNCHECKED:
+                case OP_GREATER_EQUAL:
+                    emit_sse(&c->code, UCOMISD, 1, 0);
+                    break;
+                default:
+                    emit_sse(&c->code, UCOMISD, 0, 1);
+                    break;
+            }
+            switch (ip[0]) {
+                case OP_LESS:
+                case OP_GREATER:
+                case OP_LESS_UNCHECKED:
+                case OP_GREATER_UNCHECKED:
+                    EMIT(&c->code, 0x0F, 0x97, 0xC0);   /* seta al */
+                    break;
+                case OP_GREATER_EQUAL:
+                case OP_LESS_EQUAL:
+                    EMIT(&c->code, 0x0F, 0x96, 0xC0);   /* setbe al */
+                    break;
+                default:
+                    EMIT(&c->code, 0x0F, 0x94, 0xC0);   /* sete al */
+                    EMIT(&c->code, 0x0F, 0x9B, 0xC1);   /* setnp cl */
+                    EMIT(&c->code, 0x20, 0xC8);         /* and al, cl */
+                    if (ip[0] == OP_NOT_EQUAL)
+                        EMIT(&c->code, 0x34, 0x01);     /* xor al, 1 */
+                    break;
+            }
+            emit_flag_to_bool(c, a);
+            return push_operand(c, temp_operand(a, TYPE_BOOL));
+        }
+        case OP_NOT: {
+            int a = c->depth - 1;
+            load(&c->code, 0, c->stack[a]);
+            emit_falsey(c);
+            emit_flag_to_bool(c, a);
+            c->stack[a] = temp_operand(a, TYPE_BOOL);
+            return true;
+        }
+        case OP_NEGATE:
+        case OP_NEGATE_UNCHECKED: {
+            int a = c->depth - 1;
+            if (c->stack[a].type != TYPE_NUMBER)
+                return false;
+            load(&c->code, TEMP(a), c->stack[a]);
+            emit_mov_imm64(&c->code, RAX, (uint64_t)1 << 63);
+            emit_movq_from_rax(&c->code, 0);
+            emit_sse(&c->code, XORPD, TEMP(a), 0);
+            c->stack[a] = temp_operand(a, TYPE_NUMBER);
+            return true;
+        }
+        case OP_PRINT:
+            emit_print(c);
+            return true;
+
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+            return true;
+        case OP_FOR_LOOP:
+            return compile_for_loop(c, step);
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG: {
+            int end = step->offset + instruction_length(ip[0]);
+            load(&c->code, 0, c->stack[c->depth - 1]);
+            if (ip[0] == OP_POP_JUMP_IF_FALSE ||
+                ip[0] == OP_POP_JUMP_IF_FALSE_LONG)
+                c->depth--;
+            emit_falsey(c);
+            EMIT(&c->code, 0x84, 0xC0);             /* test al, al */
+            if (step->taken)
+                emit_side_exit(c, JE, end);
+            else
+                emit_side_exit(c, JNE, end + jump_distance(ip));
+            return true;
+        }
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED: {
+            Operand left = c->stack[c->depth - 2];
+            Operand right = c->stack[c->depth - 1];
+            if (left.type != TYPE_NUMBER || right.type != TYPE_NUMBER)
+                return false;
+            c->depth -= 2;
+            load(&c->code, 0, left);
+            load(&c->code, 1, right);
+            /* "above" means the comparison holds; unordered is not. */
+            if (ip[0] == OP_JUMP_IF_NOT_LESS ||
+                ip[0] == OP_JUMP_IF_NOT_LESS_UNCHECKED)
+                emit_sse(&c->code, UCOMISD, 1, 0);
+            else
+                emit_sse(&c->code, UCOMISD, 0, 1);
+            if (step->taken)
+                emit_side_exit(c, JA, step->offset + 3);
+            else
+                emit_side_exit(c, JBE, step->offset + 3 + read_short(ip));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/* Gives every local below the loop and every global the recording
+ * touches a variable, typed from its current value. */
+static bool collect_vars(TraceCompiler* c, Recording* recording) {
+    Trace* trace = c->trace;
+    for (int slot = 0; slot < UINT8_COUNT; slot++) {
+        c->local_vars[slot] = -1;
+        c->global_vars[slot] = -1;
+    }
+
+    for (int i = 0; i < recording->count; i++) {
+        uint8_t* ip = &c->chunk->code[recording->steps[i].offset];
+        int slots[2];
+        bool globals[2] = { false, false };
+        int slot_count = 0;
+
+        switch (ip[0]) {
+            case OP_GET_LOCALS:
+                slots[slot_count++] = ip[2];
+                /* Fall through. */
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+                slots[slot_count++] = ip[1];
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_POP:
+                globals[slot_count] = true;
+                slots[slot_count++] = ip[1];
+                break;
+            case OP_FOR_LOOP:
+                slots[slot_count++] = ip[1];
+                if ((ip[3] & ~FOR_INCLUSIVE) != FOR_CONSTANT) {
+                    globals[slot_count] =
+                        (ip[3] & ~FOR_INCLUSIVE) == FOR_GLOBAL;
+                    slots[slot_count++] = ip[4];
+                }
+                break;
+        }
+
+        for (int j = 0; j < slot_count; j++) {
+            int slot = slots[j];
+            bool global = globals[j];
+            int* vars = global ? c->global_vars : c->local_vars;
+            if ((!global && slot >= trace->entry_depth) || vars[slot] != -1)
+                continue;
+
+            Value value = global ? vm.globals.values[slot] : vm.stack.data[slot];
+            if (!is_traceable(value))
+                return false;
+            trace->vars = GROW_ARRAY(TraceVar, trace->vars,
+                trace->var_count, trace->var_count + 1);
+            TraceVar* var = &trace->vars[trace->var_count];
+            var->global = global;
+            var->slot = slot;
+            var->type = IS_BOOL(value) ? TYPE_BOOL : TYPE_NUMBER;
+            vars[slot] = trace->var_count++;
+        }
+    }
+    return true;
+}
+
+static bool compile_trace(TraceCompiler* c, Recording* recording) {
+    Trace* trace = c->trace;
+    if (!collect_vars(c, recording))
+        return false;
+    c->types = ALLOCATE(TraceType, trace->var_count);
+    for (int index = 0; index < trace->var_count; index++)
+        c->types[index] = trace->vars[index].type;
+
+    EMIT(&c->code, 0x53);                   /* push rbx */
+    EMIT(&c->code, 0x48, 0x89, 0xFB);       /* mov rbx, rdi */
+    for (int index = 0; index < trace->var_count && var_in_register(index);
+         index++)
+        emit_sse_spill(&c->code, MOVSD_LOAD, VAR_REGISTER(index),
+            SPILL(index));
+    int loop_start = c->code.count;
+
+    c->first = c->last = recording->steps[0].offset;
+    for (int i = 0; i < recording->count; i++) {
+        int offset = recording->steps[i].offset;
+        if (offset < c->first) c->first = offset;
+        if (offset > c->last) c->last = offset;
+    }
+
+    for (int i = 0; i < recording->count; i++) {
+        TraceStep* step = &recording->steps[i];
+        if (c->depth < 0 || !compile_step(c, step))
+            return false;
+    }
+
+    /* The next iteration must start out like this one did. */
+    if (c->depth != 0)
+        return false;
+    for (int index = 0; index < trace->var_count; index++) {
+        if (c->types[index] != trace->vars[index].type)
+            return false;
+    }
+    patch_rel32(&c->code, emit_jmp(&c->code), loop_start);
+
+    int exits_start = c->code.count;
+    emit_code(&c->code, c->exits.bytes, c->exits.count);
+    for (int i = 0; i < c->guard_count; i += 2)
+        patch_rel32(&c->code, c->guards[i], exits_start + c->guards[i + 1]);
+
+    trace->spill = ALLOCATE(double, trace->var_count + MAX_TEMPS);
+    trace->code = map_code(&c->code, &trace->code_size);
+    return trace->code != NULL;
+}
+
+static void free_trace(Trace* trace) {
+    FREE_ARRAY(TraceVar, trace->vars, trace->var_count);
+    FREE_ARRAY(TraceExit, trace->exits, trace->exit_capacity);
+    FREE_ARRAY(uint8_t, trace->exit_types, trace->exit_types_capacity);
+    if (trace->spill != NULL)
+        FREE_ARRAY(double, trace->spill, trace->var_count + MAX_TEMPS);
+    if (trace->code != NULL)
+        unmap_code(trace->code, trace->code_size);
+    FREE(Trace, trace);
+}
+
+static Trace* compile(Recording* recording, int entry_depth) {
+    Trace* trace = ALLOCATE(Trace, 1);
+    memset(trace, 0, sizeof(Trace));
+    trace->entry_depth = entry_depth;
+
+    TraceCompiler compiler;
+    TraceCompiler* c = &compiler;
+    c->trace = trace;
+    c->chunk = vm.chunk;
+    init_code_buffer(&c->code);
+    init_code_buffer(&c->exits);
+    c->guards = NULL;
+    c->guard_count = 0;
+    c->guard_capacity = 0;
+    c->depth = 0;
+    c->types = NULL;
+
+    bool success = compile_trace(c, recording);
+
+    FREE_ARRAY(TraceType, c->types, c->types == NULL ? 0 : trace->var_count);
+    FREE_ARRAY(int, c->guards, c->guard_capacity);
+    free_code_buffer(&c->code);
+    free_code_buffer(&c->exits);
+    if (!success) {
+        free_trace(trace);
+        return NULL;
+    }
+
+#ifdef DEBUG_PRINT_CODE
+    printf("===== trace @%04d =====\n", recording->steps[0].offset);
+    for (int i = 0; i < recording->count; i++) {
+        disassemble_instruction(vm.chunk, recording->steps[i].offset);
+    }
+#endif
+    return trace;
+}
+
+
+static Value* var_home(TraceVar* var) {
+    return var->global ? &vm.globals.values[var->slot]
+                       : &vm.stack.data[var->slot];
+}
+
+/* The C entry and exit handlers. Entry checks that every variable
+ * still has the type the trace was compiled for and unboxes it; exit
+ * boxes the variables and the side exit's stack back into Values. */
+static uint8_t* run_trace(LoopState* loop, uint8_t* header) {
+    Trace* trace = loop->trace;
+    for (int index = 0; index < trace->var_count; index++) {
+        TraceVar* var = &trace->vars[index];
+        Value value = *var_home(var);
+        if (var->type == TYPE_BOOL ? !IS_BOOL(value) : !IS_NUMBER(value))
+            return header;
+        trace->spill[index] = var->type == TYPE_BOOL
+            ? AS_BOOL(value)
+            : AS_NUMBER(value);
+    }
+
+    int exit_index = ((TraceFunction)trace->code)(trace->spill);
+
+    TraceExit* exit = &trace->exits[exit_index];
+    uint8_t* types = &trace->exit_types[exit->types];
+    Value* base = vm.stack.data + trace->entry_depth;
+    for (int depth = 0; depth < exit->depth; depth++)
+        base[depth] = box(trace->spill[trace->var_count + depth], types[depth]);
+    vm.stack.top = base + exit->depth;
+    for (int index = 0; index < trace->var_count; index++) {
+        *var_home(&trace->vars[index]) =
+            box(trace->spill[index], types[exit->depth + index]);
+    }
+    uint8_t* resume = vm.chunk->code + exit->offset;
+
+    /* Record the loop again once it keeps leaving the trace halfway. */
+    if (exit->branch && ++exit->hits == HOT_EXIT) {
+        free_trace(trace);
+        loop->trace = NULL;
+        loop->hotness = 0;
+        loop->blacklisted = ++loop->attempts >= MAX_ATTEMPTS;
+    }
+    return resume;
+}
+
+/* Called on every OP_LOOP, OP_LOOP_LONG or OP_FOR_LOOP back-edge with the ip of the
+ * loop header and vm.stack up to date. Returns the ip to continue from,
+ * which is the header unless a trace ran.
+ */
+uint8_t* trace_loop(uint8_t* header) {
+    if (loops == NULL) {
+        loop_count = vm.chunk->count;
+        loops = ALLOCATE(LoopState, loop_count);
+        memset(loops, 0, sizeof(LoopState) * loop_count);
+    }
+
+    LoopState* loop = &loops[header - vm.chunk->code];
+    if (loop->trace != NULL)
+        return run_trace(loop, header);
+    if (loop->blacklisted || ++loop->hotness < HOT_LOOP)
+        return header;
+
+    Recording recording;
+    bool complete;
+    int entry_depth = (int)(vm.stack.top - vm.stack.data);
+    uint8_t* ip = record(header, &recording, &complete);
+    if (!complete) {
+        loop->hotness = 0;
+        loop->blacklisted = ++loop->attempts >= MAX_ATTEMPTS;
+        return ip;
+    }
+
+    loop->trace = compile(&recording, entry_depth);
+    if (loop->trace == NULL) {
+        loop->blacklisted = true;
+        return header;
+    }
+    return run_trace(loop, header);
+}
+
+void trace_free() {
+    for (int offset = 0; offset < loop_count; offset++) {
+        if (loops[offset].trace != NULL)
+            free_trace(loops[offset].trace);
+    }
+    FREE_ARRAY(LoopState, loops, loop_count);
+    loops = NULL;
+    loop_count = 0;
+}
+
+#else
+
+uint8_t* trace_loop(uint8_t* header) {
+    return header;
+}
+
+void trace_free() {
+}
+
+#endif
@@ -29,7 +29,28 @@ void write_value_array(ValueArray *array, Value value) {
     array->count++;
 }
 
+static void print_short_string(Value value) {
+    char chars[SHORT_STRING_MAX];
+    short_string_chars(value, chars);
+    printf("%.*s", short_string_length(value), chars);
+}
+
 void print_value(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        print_object(value);
+    } else if (IS_SHORT_STRING(value)) {
+        print_short_string(value);
+    } else if (IS_UNDEFINED(value)) {
+        printf("<undefined>");
+    }
+#else
     switch(value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -43,30 +64,12 @@ void print_value(Value value) {
         case VAL_OBJ:
             print_object(value);
             break;
+        case VAL_SHORT_STRING:
+            print_short_string(value);
+            break;
+        case VAL_UNDEFINED:
+            printf("<undefined>");
+            break;
     }
-    
-}
-
-bool values_equal(Value a, Value b) {
-    if (a.type != b.type)
-        return false;
-    
-    switch (a.type) {
-        case VAL_BOOL:
-            return AS_BOOL(a) == AS_BOOL(b);
-        case VAL_NIL:
-            return true;
-        case VAL_NUMBER:
-            return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
-        default:
-            return false;
-    }
+#endif
 }
-
-bool is_falsey(Value value) {
-    return IS_NIL(value) || 
-        (IS_BOOL(value) && !AS_BOOL(value)) ||
-        (IS_NUMBER(value) && AS_NUMBER(value) == 0);
-}
\ No newline at end of file
@@ -6,35 +6,197 @@
 #include "compiler.h"
 #include "debug.h"
 #include "object.h"
+#include "jit.h"
+#include "layout.h"
 #include "memory.h"
+#include "natives.h"
+#include "profile.h"
+#include "regvm.h"
+#include "trace.h"
 #include "vm.h"
 
 VM vm;
-static uint8_t read_byte();
-static Value read_constant();
-static Value read_constant_long();
 static InterpretResult run();
-static void runtime_error(const char* format, ...);
-static void concatenate();
-static void string_multiply();
+static int run_guarded();
+static void report_overflow(int held);
+static bool concatenate();
+static const char* add_many(int count);
+static bool interpolate(int count);
+static bool call_native(const Native* native);
+static bool string_multiply();
 
 
+#define READ_BYTE() (*ip++)
+
 #define READ_SHORT() \
-    (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
-#define BINARY_OP(valueType, op) \
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+
+#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (vm.chunk->constants.values[READ_LONG()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.global_names.values[slot])
+
+/* The instruction pointer lives in a local inside run() so the
+ * compiler can keep it in a register. It is written back to vm.ip
+ * only when something outside run() needs to see it.
+ */
+#define SAVE_IP() (vm.ip = ip)
+
+#define RUNTIME_ERROR(...) \
     do { \
-      if (!IS_NUMBER(peek(&vm.stack, 0)) || !IS_NUMBER(peek(&vm.stack, 1))) { \
-        runtime_error("Operands must be numbers."); \
+        SAVE_IP(); \
+        runtime_error(__VA_ARGS__); \
         return INTERPRET_RUNTIME_ERROR; \
-      } \
-      double b = AS_NUMBER(pop(&vm.stack)); \
-      double a = AS_NUMBER(pop(&vm.stack)); \
-      push(&vm.stack, valueType(a op b)); \
     } while (false)
 
-#define READ_CONSTANT() (vm.chunk->constants.values[read_byte()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+/* Stack access inside run(). With TOS_CACHING the top value lives in
+ * the local tos rather than in memory, and sp points at the slot it
+ * would be stored in; data[-1] absorbs the spill of an empty cache.
+ * Without it these are the plain stack.h operations.
+ *
+ * TOP is an lvalue, so handlers that consume operands and produce one
+ * result overwrite it in place instead of popping and pushing.
+ * LOCAL() and STORE_LOCAL() must check whether the local is the
+ * cached top.
+ */
+#ifdef TOS_CACHING
+#define CACHED_VALUES 1
+#ifdef STACK_GUARD_PAGE
+#define PUSH(value) (*sp++ = tos, tos = (value))
+#else
+#define PUSH(value) \
+    (sp == vm.stack.data + STACK_MAX ? stack_overflow() : (void)0, \
+     *sp++ = tos, tos = (value))
+#endif
+#define POP() (popped = tos, tos = *--sp, popped)
+#define DROP() (tos = *--sp)
+#define PEEK(depth) ((depth) == 0 ? tos : sp[-(depth)])
+#define TOP tos
+#define LOCAL(slot) \
+    (vm.stack.data + (slot) == sp ? tos : vm.stack.data[slot])
+#define STORE_LOCAL(slot, value) \
+    do { \
+        if (vm.stack.data + (slot) == sp) \
+            tos = (value); \
+        else \
+            vm.stack.data[slot] = (value); \
+    } while (false)
+
+/* Spill the cache to memory and publish sp in vm.stack for code outside
+ * run(), and take them back afterwards. */
+#define FLUSH_STACK() (*sp++ = tos, vm.stack.top = sp)
+#define RELOAD_STACK() (sp = vm.stack.top, tos = *--sp)
+#else
+#define CACHED_VALUES 0
+#define PUSH(value) push(&vm.stack, value)
+#define POP() pop(&vm.stack)
+#define DROP() (vm.stack.top--)
+#define PEEK(depth) peek(&vm.stack, depth)
+#define TOP (vm.stack.top[-1])
+#define LOCAL(slot) (vm.stack.data[slot])
+#define STORE_LOCAL(slot, value) (vm.stack.data[slot] = (value))
+
+#define FLUSH_STACK() do { } while (false)
+#define RELOAD_STACK() do { } while (false)
+#endif
+
+#define CALL_WITH_STACK(call) \
+    do { \
+        FLUSH_STACK(); \
+        call; \
+        RELOAD_STACK(); \
+    } while (false)
+
+#define BINARY_OP(valueType, op) \
+    do { \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      double b = AS_NUMBER(POP()); \
+      TOP = valueType(AS_NUMBER(TOP) op b); \
+    } while (false)
+
+/* BINARY_OP for operands the compiler has proven to be numbers. */
+#define NUMBER_OP(valueType, op) \
+    do { \
+      double b = AS_NUMBER(POP()); \
+      TOP = valueType(AS_NUMBER(TOP) op b); \
+    } while (false)
+
+/* For the fused negated comparisons: !(a < b) rather than a >= b, so
+ * NaN behaves as it does in OP_LESS; OP_NOT. */
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+/* Rewrites the instruction that was just read into another form. */
+#define QUICKEN(op) (ip[-1] = (op))
+
+/* Undoes a quickening whose guard failed and re-runs the instruction
+ * in its generic form, which will pick a new specialization. Not
+ * wrapped in do/while: DISPATCH() may be a break out of the switch. */
+#define DESPECIALIZE(op) \
+    { \
+        *--ip = (op); \
+        DISPATCH(); \
+    }
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() CALL_WITH_STACK(trace_instruction(ip))
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profile_instruction(vm.chunk->code, ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+/* Jumps by offset if condition holds. Either way it saves where the
+ * code goes on, so that after a stack overflow report_overflow() only
+ * has straight-line code to search. With PROFILE_BRANCHES, while
+ * --profile-generate is on, it also counts which way the jump went, by
+ * the offset just past it. */
+#ifdef PROFILE_BRANCHES
+#define JUMP_IF(condition, offset) \
+    do { \
+        bool taken = (condition); \
+        if (vm.branches != NULL) \
+            count_branch(vm.branches, (int)(ip - vm.chunk->code), taken); \
+        if (taken) \
+            ip += (offset); \
+        SAVE_IP(); \
+    } while (false)
+#else
+#define JUMP_IF(condition, offset) \
+    do { \
+        if (condition) \
+            ip += (offset); \
+        SAVE_IP(); \
+    } while (false)
+#endif
+
+/* With threaded dispatch every handler ends in its own indirect jump
+ * through dispatch_table, giving the branch predictor one site per
+ * opcode instead of the single shared jump at the top of a switch.
+ */
+#if defined(COMPUTED_GOTO) && defined(__GNUC__)
+#define USE_COMPUTED_GOTO
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+#define TARGET(op) L_##op
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        PROFILE_INSTRUCTION(); \
+        goto *dispatch_table[READ_BYTE()]; \
+    } while (false)
+#else
+#define TARGET(op) case op
+#define DISPATCH() break
+#endif
 
 /* Starts up the virtual machine.
  * First it creates a chunk and then writes bytecode
@@ -50,189 +212,703 @@ InterpretResult interpret(const char* source) {
         return INTERPRET_COMPILE_ERROR;
     }
     
+    /* Profiles are recorded and used by run() alone; main() turns away
+     * the other backends. */
+    BranchProfile profile;
+    if (vm.profile_in != NULL) {
+        init_branch_profile(&profile, &chunk);
+        if (read_branch_profile(&profile, vm.profile_in)) {
+            layout_blocks(&chunk, &profile);
+#ifdef DEBUG_PRINT_CODE
+            disassemble_chunk(&chunk, "laid out");
+#endif
+        } else {
+            fprintf(stderr, "Ignoring profile \"%s\": it could not be read "
+                "or is for other code.\n", vm.profile_in);
+        }
+        free_branch_profile(&profile);
+    } else if (vm.profile_out != NULL) {
+        init_branch_profile(&profile, &chunk);
+        vm.branches = &profile;
+    }
+
     vm.chunk = &chunk;
     vm.ip = vm.chunk->code;
 
-    InterpretResult result = run();
+    int result;
+    RegChunk reg_chunk;
+    init_reg_chunk(&reg_chunk);
+    StackBody body = run_guarded;
+
+    if (vm.use_registers && compile_registers(&chunk, &reg_chunk)) {
+        result = run_registers(&reg_chunk);
+    } else {
+        if (vm.use_jit && (body = jit_compile(&chunk)) == NULL)
+            body = run_guarded;
+        if (!stack_guarded_call(&vm.stack, body, &result)) {
+            report_overflow(body == run_guarded ? CACHED_VALUES : 0);
+            result = INTERPRET_RUNTIME_ERROR;
+        }
+    }
+    if (vm.branches != NULL) {
+        if (!write_branch_profile(vm.branches, vm.profile_out))
+            fprintf(stderr, "Could not write profile \"%s\".\n", vm.profile_out);
+        free_branch_profile(vm.branches);
+        vm.branches = NULL;
+    }
+    free_reg_chunk(&reg_chunk);
+    jit_free();
+    trace_free();
     free_chunk(&chunk);
+    vm.chunk = NULL;
     return result;
 }
 
 
+/* Returns the slot holding the global called name, handing out a new,
+ * still undefined slot the first time a name is seen. Slots persist
+ * across interpret() calls so REPL lines share their globals.
+ */
+int global_slot(ObjString* name) {
+    Value slot;
+    if (table_get(&vm.global_slots, name, &slot))
+        return (int)AS_NUMBER(slot);
+
+    int index = vm.globals.count;
+    write_value_array(&vm.globals, UNDEFINED_VAL);
+    write_value_array(&vm.global_names, OBJ_VAL(name));
+    table_set(&vm.global_slots, name, NUMBER_VAL(index));
+    return index;
+}
+
+
+/* Adapts run() to the callback type stack_guarded_call() expects. */
+static int run_guarded() {
+    return run();
+}
+
+
+/* The offset a forward jump at offset goes to, or -1 for any other
+ * instruction. */
+static int forward_target(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    int end = offset + instruction_length(code[0]);
+    switch (code[0]) {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_UNCHECKED:
+        case OP_JUMP_IF_NOT_GREATER_UNCHECKED:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_LESS_UNCHECKED:
+        case OP_JUMP_IF_GREATER_UNCHECKED:
+            return end + ((chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_LONG:
+        case OP_POP_JUMP_IF_FALSE_LONG:
+            return end + ((chunk->code[end - 3] << 16) |
+                (chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+        default:
+            return -1;
+    }
+}
+
+/* The first instruction at or after from that takes the stack deeper
+ * than limit, or -1. Without calls the depth at every instruction
+ * follows from the code alone: it is carried down the chunk, and to the
+ * target of each forward jump for the code after an unconditional one.
+ */
+static int find_overflow(Chunk* chunk, int from, int limit) {
+    int* label_depths = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++)
+        label_depths[i] = -1;
+
+    int depth = 0;
+    int found = -1;
+    for (int offset = 0; offset < chunk->count && found == -1;
+         offset += instruction_length(chunk->code[offset])) {
+        if (depth == -1)
+            depth = label_depths[offset];
+        if (depth == -1)
+            continue;
+
+        uint8_t op = chunk->code[offset];
+        depth += stack_effect(chunk->code + offset);
+        if (offset >= from && depth > limit)
+            found = offset;
+        int target = forward_target(chunk, offset);
+        if (target != -1)
+            label_depths[target] = depth;
+        if (op == OP_RETURN || op == OP_JUMP || op == OP_JUMP_LONG ||
+            op == OP_LOOP || op == OP_LOOP_LONG)
+            depth = -1;
+    }
+    FREE_ARRAY(int, label_depths, chunk->count + 1);
+    return found;
+}
+
+/* Reports an overflow that abandoned run() or JIT code mid-instruction.
+ * Every jump saves where it went on to in vm.ip, so the code run since
+ * then is straight-line, and the instruction that overflowed is the
+ * first one in it to take the stack past its capacity, plus the values
+ * held has kept out of memory, like a cached top. */
+static void report_overflow(int held) {
+    int offset = find_overflow(vm.chunk, (int)(vm.ip - vm.chunk->code),
+        stack_capacity(&vm.stack) + held);
+    vm.ip = vm.chunk->code + (offset == -1 ? 0 : offset) + 1;
+    runtime_error("Stack overflow.");
+}
+
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instruction(uint8_t* ip) {
+    printf("    ");
+    for(Value *slot = vm.stack.data; slot < vm.stack.top; slot++) {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(vm.chunk, (int)(ip - vm.chunk->code));
+}
+#endif
+
+
 /* The heart of the virtual machine.
  * Reads the instruction byte code byte-by-byte
  * and evaluates using a stack.
  */
 static InterpretResult run() {
+    register uint8_t* ip = vm.ip;
+#ifdef TOS_CACHING
+    register Value* sp;
+    register Value tos;
+    Value popped;
+    RELOAD_STACK();
+#endif
+
     #ifdef DEBUG_TRACE_EXECUTION
         printf("\n===== stack trace =====");
     #endif
+
+#ifdef USE_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_NEGATE] = &&L_OP_NEGATE,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_ADD_N] = &&L_OP_ADD_N,
+        [OP_INTERPOLATE] = &&L_OP_INTERPOLATE,
+        [OP_NATIVE] = &&L_OP_NATIVE,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_GREATER] = &&L_OP_GREATER,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_POP] = &&L_OP_POP,
+        [OP_NIL] = &&L_OP_NIL,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_LOOP] = &&L_OP_LOOP,
+        [OP_GET_LOCALS] = &&L_OP_GET_LOCALS,
+        [OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&L_OP_SET_GLOBAL_POP,
+        [OP_POP_JUMP_IF_FALSE] = &&L_OP_POP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_NOT_LESS] = &&L_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_GREATER] = &&L_OP_JUMP_IF_NOT_GREATER,
+        [OP_FOR_LOOP] = &&L_OP_FOR_LOOP,
+        [OP_NOT_EQUAL] = &&L_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&L_OP_LESS_EQUAL,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_ADD_STR] = &&L_OP_ADD_STR,
+        [OP_MULTIPLY_NUM] = &&L_OP_MULTIPLY_NUM,
+        [OP_NEGATE_UNCHECKED] = &&L_OP_NEGATE_UNCHECKED,
+        [OP_ADD_UNCHECKED] = &&L_OP_ADD_UNCHECKED,
+        [OP_SUBTRACT_UNCHECKED] = &&L_OP_SUBTRACT_UNCHECKED,
+        [OP_MULTIPLY_UNCHECKED] = &&L_OP_MULTIPLY_UNCHECKED,
+        [OP_DIVIDE_UNCHECKED] = &&L_OP_DIVIDE_UNCHECKED,
+        [OP_LESS_UNCHECKED] = &&L_OP_LESS_UNCHECKED,
+        [OP_GREATER_UNCHECKED] = &&L_OP_GREATER_UNCHECKED,
+        [OP_JUMP_IF_NOT_LESS_UNCHECKED] = &&L_OP_JUMP_IF_NOT_LESS_UNCHECKED,
+        [OP_JUMP_IF_NOT_GREATER_UNCHECKED] = &&L_OP_JUMP_IF_NOT_GREATER_UNCHECKED,
+        [OP_POP_JUMP_IF_TRUE] = &&L_OP_POP_JUMP_IF_TRUE,
+        [OP_JUMP_IF_LESS] = &&L_OP_JUMP_IF_LESS,
+        [OP_JUMP_IF_GREATER] = &&L_OP_JUMP_IF_GREATER,
+        [OP_JUMP_IF_LESS_UNCHECKED] = &&L_OP_JUMP_IF_LESS_UNCHECKED,
+        [OP_JUMP_IF_GREATER_UNCHECKED] = &&L_OP_JUMP_IF_GREATER_UNCHECKED,
+        [OP_DEFINE_GLOBAL_LONG] = &&L_OP_DEFINE_GLOBAL_LONG,
+        [OP_GET_GLOBAL_LONG] = &&L_OP_GET_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG] = &&L_OP_SET_GLOBAL_LONG,
+        [OP_SET_LOCAL_LONG] = &&L_OP_SET_LOCAL_LONG,
+        [OP_GET_LOCAL_LONG] = &&L_OP_GET_LOCAL_LONG,
+        [OP_JUMP_IF_FALSE_LONG] = &&L_OP_JUMP_IF_FALSE_LONG,
+        [OP_JUMP_LONG] = &&L_OP_JUMP_LONG,
+        [OP_LOOP_LONG] = &&L_OP_LOOP_LONG,
+        [OP_POP_JUMP_IF_FALSE_LONG] = &&L_OP_POP_JUMP_IF_FALSE_LONG,
+    };
+
+    DISPATCH();
+#else
     for(;;) {
-        #ifdef DEBUG_TRACE_EXECUTION
-        printf("    ");
-        for(Value *slot = vm.stack.data; slot < vm.stack.top; slot++) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-        #endif
-
-        uint8_t instruction;
-        switch(instruction = read_byte()) {
-            case OP_CONSTANT: {
-                Value constant = read_constant();
-                push(&vm.stack, constant);
-                break;
-            }
-            case OP_CONSTANT_LONG: {
-                Value constant = read_constant_long();
-                push(&vm.stack, constant);
-                break;
-            }
-            case OP_NEGATE: {
-                if(!IS_NUMBER(peek(&vm.stack, 0))) {
-                    runtime_error("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(&vm.stack, NUMBER_VAL(-AS_NUMBER(pop(&vm.stack))));
-                break;
+        TRACE_INSTRUCTION();
+        PROFILE_INSTRUCTION();
+        switch(READ_BYTE()) {
+#endif
+            TARGET(OP_CONSTANT): {
+                Value constant = READ_CONSTANT();
+                PUSH(constant);
+                DISPATCH();
+            }
+            TARGET(OP_CONSTANT_LONG): {
+                Value constant = READ_CONSTANT_LONG();
+                PUSH(constant);
+                DISPATCH();
+            }
+            TARGET(OP_NEGATE): {
+                if(!IS_NUMBER(PEEK(0)))
+                    RUNTIME_ERROR("Operand must be a number.");
+                TOP = NUMBER_VAL(-AS_NUMBER(TOP));
+                DISPATCH();
             }
 
-            case OP_ADD: {
-                Value b = peek(&vm.stack, 0);
-                Value a = peek(&vm.stack, 1);
+            TARGET(OP_ADD): {
+                Value b = PEEK(0);
+                Value a = PEEK(1);
 
                 if (IS_STRING(a) && IS_STRING(b)) {
-                    concatenate();
+                    QUICKEN(OP_ADD_STR);
+                    bool joined;
+                    CALL_WITH_STACK(joined = concatenate());
+                    if (!joined)
+                        RUNTIME_ERROR("String too long.");
                 } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
-                    double b_num = AS_NUMBER(pop(&vm.stack));
-                    double a_num = AS_NUMBER(pop(&vm.stack));
-                    push(&vm.stack, NUMBER_VAL(a_num + b_num));
+                    QUICKEN(OP_ADD_NUM);
+                    double b_num = AS_NUMBER(POP());
+                    TOP = NUMBER_VAL(AS_NUMBER(TOP) + b_num);
                 } else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                break;
+                DISPATCH();
+            }
+            TARGET(OP_ADD_NUM): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                    DESPECIALIZE(OP_ADD);
+                double b_num = AS_NUMBER(POP());
+                TOP = NUMBER_VAL(AS_NUMBER(TOP) + b_num);
+                DISPATCH();
+            }
+            TARGET(OP_ADD_STR): {
+                if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1)))
+                    DESPECIALIZE(OP_ADD);
+                bool joined;
+                CALL_WITH_STACK(joined = concatenate());
+                if (!joined)
+                    RUNTIME_ERROR("String too long.");
+                DISPATCH();
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: {
-                Value b = peek(&vm.stack, 0);
-                Value a = peek(&vm.stack, 1);
+            TARGET(OP_ADD_N): {
+                uint8_t count = READ_BYTE();
+                const char* error;
+                CALL_WITH_STACK(error = add_many(count));
+                if (error != NULL)
+                    RUNTIME_ERROR("%s", error);
+                DISPATCH();
+            }
+            TARGET(OP_INTERPOLATE): {
+                uint8_t count = READ_BYTE();
+                bool joined;
+                CALL_WITH_STACK(joined = interpolate(count));
+                if (!joined)
+                    RUNTIME_ERROR("String too long.");
+                DISPATCH();
+            }
+            TARGET(OP_NATIVE): {
+                const Native* native = &natives[READ_BYTE()];
+                bool called;
+                CALL_WITH_STACK(called = call_native(native));
+                if (!called)
+                    RUNTIME_ERROR("Arguments must match %s.", native->signature);
+                DISPATCH();
+            }
+            TARGET(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+            TARGET(OP_MULTIPLY): {
+                Value b = PEEK(0);
+                Value a = PEEK(1);
 
-                if (IS_STRING(a) && IS_NUMBER(b)) {
-                    string_multiply();
-                } else if (IS_NUMBER(a) && IS_STRING(b)) {
-                    string_multiply();
+                if (IS_STRING(a) != IS_STRING(b) &&
+                    (IS_NUMBER(a) || IS_NUMBER(b))) {
+                    bool repeated;
+                    CALL_WITH_STACK(repeated = string_multiply());
+                    if (!repeated)
+                        RUNTIME_ERROR("String too long.");
                 } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
-                    double b_num = AS_NUMBER(pop(&vm.stack));
-                    double a_num = AS_NUMBER(pop(&vm.stack));
-                    push(&vm.stack, NUMBER_VAL(a_num * b_num));
+                    QUICKEN(OP_MULTIPLY_NUM);
+                    double b_num = AS_NUMBER(POP());
+                    TOP = NUMBER_VAL(AS_NUMBER(TOP) * b_num);
                 } else {
-                    runtime_error("Operands must be two numbers or a string and a number.");
+                    RUNTIME_ERROR("Operands must be two numbers or a string and a number.");
                 }
-                break;
+                DISPATCH();
             }
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
+            TARGET(OP_MULTIPLY_NUM): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                    DESPECIALIZE(OP_MULTIPLY);
+                double b_num = AS_NUMBER(POP());
+                TOP = NUMBER_VAL(AS_NUMBER(TOP) * b_num);
+                DISPATCH();
+            }
+            TARGET(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+            TARGET(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+            TARGET(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+            TARGET(OP_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <); DISPATCH();
+            TARGET(OP_LESS_EQUAL): BINARY_OP(NOT_BOOL_VAL, >); DISPATCH();
 
-            case OP_NIL: {
-                push(&vm.stack, NIL_VAL);
-                break;
+            TARGET(OP_NEGATE_UNCHECKED): {
+                TOP = NUMBER_VAL(-AS_NUMBER(TOP));
+                DISPATCH();
             }
-            case OP_TRUE: {
-                push(&vm.stack, BOOL_VAL(true));
-                break;
+            TARGET(OP_ADD_UNCHECKED): NUMBER_OP(NUMBER_VAL, +); DISPATCH();
+            TARGET(OP_SUBTRACT_UNCHECKED): NUMBER_OP(NUMBER_VAL, -); DISPATCH();
+            TARGET(OP_MULTIPLY_UNCHECKED): NUMBER_OP(NUMBER_VAL, *); DISPATCH();
+            TARGET(OP_DIVIDE_UNCHECKED): NUMBER_OP(NUMBER_VAL, /); DISPATCH();
+            TARGET(OP_LESS_UNCHECKED): NUMBER_OP(BOOL_VAL, <); DISPATCH();
+            TARGET(OP_GREATER_UNCHECKED): NUMBER_OP(BOOL_VAL, >); DISPATCH();
+
+            TARGET(OP_NIL): {
+                PUSH(NIL_VAL);
+                DISPATCH();
             }
-            case OP_FALSE: {
-                push(&vm.stack, BOOL_VAL(false));
-                break;
+            TARGET(OP_TRUE): {
+                PUSH(BOOL_VAL(true));
+                DISPATCH();
             }
-            case OP_NOT: {
-                push(&vm.stack, BOOL_VAL(is_falsey(pop(&vm.stack))));
-                break;
+            TARGET(OP_FALSE): {
+                PUSH(BOOL_VAL(false));
+                DISPATCH();
             }
-            case OP_EQUAL: {
-                Value b = pop(&vm.stack);
-                Value a = pop(&vm.stack);
-                push(&vm.stack, BOOL_VAL(values_equal(a, b)));
-                break;
+            TARGET(OP_NOT): {
+                TOP = BOOL_VAL(is_falsey(TOP));
+                DISPATCH();
             }
-            case OP_POP: {
-                pop(&vm.stack);
-                break;
+            TARGET(OP_EQUAL): {
+                Value b = POP();
+                TOP = BOOL_VAL(values_equal(TOP, b));
+                DISPATCH();
             }
-            case OP_PRINT: {
-                print_value(pop(&vm.stack));
+            TARGET(OP_NOT_EQUAL): {
+                Value b = POP();
+                TOP = BOOL_VAL(!values_equal(TOP, b));
+                DISPATCH();
+            }
+            TARGET(OP_POP): {
+                DROP();
+                DISPATCH();
+            }
+            TARGET(OP_PRINT): {
+                print_value(TOP);
+                DROP();
                 printf("\n");
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                table_set(&vm.globals, name, peek(&vm.stack, 0));
-                pop(&vm.stack);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                DISPATCH();
+            }
+            TARGET(OP_DEFINE_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                vm.globals.values[slot] = TOP;
+                DROP();
+                DISPATCH();
+            }
+            TARGET(OP_GET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                Value value = vm.globals.values[slot];
+                if (IS_UNDEFINED(value))
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+                PUSH(value);
+                DISPATCH();
+            }
+            TARGET(OP_SET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                if (IS_UNDEFINED(vm.globals.values[slot]))
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+                vm.globals.values[slot] = TOP;
+                DISPATCH();
+            }
+            TARGET(OP_SET_LOCAL): {
+                uint8_t slot = READ_BYTE();
+                vm.stack.data[slot] = TOP;
+                DISPATCH();
+            }
+            TARGET(OP_GET_LOCAL): {
+                uint8_t slot = READ_BYTE();
+                PUSH(LOCAL(slot));
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(is_falsey(TOP), offset);
+                DISPATCH();
+            }
+            TARGET(OP_JUMP): {
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(true, offset);
+                DISPATCH();
+            }
+            TARGET(OP_LOOP): {
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(true, -offset);
+#ifdef TRACING_SUPPORTED
+                if (vm.use_jit) {
+                    CALL_WITH_STACK(ip = trace_loop(ip));
+                    SAVE_IP();
+                }
+#endif
+                DISPATCH();
+            }
+            TARGET(OP_GET_LOCALS): {
+                uint8_t first = READ_BYTE();
+                uint8_t second = READ_BYTE();
+                PUSH(LOCAL(first));
+                PUSH(LOCAL(second));
+                DISPATCH();
+            }
+            TARGET(OP_SET_LOCAL_POP): {
+                uint8_t slot = READ_BYTE();
+                vm.stack.data[slot] = TOP;
+                DROP();
+                DISPATCH();
+            }
+            TARGET(OP_SET_GLOBAL_POP): {
+                uint8_t slot = READ_BYTE();
+                if (IS_UNDEFINED(vm.globals.values[slot]))
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+                vm.globals.values[slot] = TOP;
+                DROP();
+                DISPATCH();
+            }
+            TARGET(OP_POP_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                Value condition = TOP;
+                DROP();
+                JUMP_IF(is_falsey(condition), offset);
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_IF_NOT_LESS): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(!(a < b), offset);
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_IF_NOT_GREATER): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(!(a > b), offset);
+                DISPATCH();
+            }
+            TARGET(OP_FOR_LOOP): {
+                uint8_t slot = READ_BYTE();
+                Value step = READ_CONSTANT();
+                uint8_t kind = READ_BYTE();
+                uint8_t operand = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+
+                /* The same checks, in the same order, as the
+                 * instructions this replaces. */
+                Value counter = LOCAL(slot);
+                if (!IS_NUMBER(counter))
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                double value = AS_NUMBER(counter) + AS_NUMBER(step);
+                STORE_LOCAL(slot, NUMBER_VAL(value));
+
+                Value limit;
+                switch (kind & ~FOR_INCLUSIVE) {
+                    case FOR_CONSTANT:
+                        limit = vm.chunk->constants.values[operand];
+                        break;
+                    case FOR_LOCAL:
+                        limit = LOCAL(operand);
+                        break;
+                    default:
+                        limit = vm.globals.values[operand];
+                        if (IS_UNDEFINED(limit))
+                            RUNTIME_ERROR("Undefined variable '%s'.",
+                                GLOBAL_NAME(operand));
+                        break;
                 }
-                push(&vm.stack, value);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(&vm.stack, 0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!IS_NUMBER(limit))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                bool looped = kind & FOR_INCLUSIVE
+                    ? !(value > AS_NUMBER(limit))
+                    : value < AS_NUMBER(limit);
+                JUMP_IF(looped, -offset);
+#ifdef TRACING_SUPPORTED
+                if (looped && vm.use_jit) {
+                    CALL_WITH_STACK(ip = trace_loop(ip));
+                    SAVE_IP();
                 }
-                break;
+#endif
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_IF_NOT_LESS_UNCHECKED): {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(!(a < b), offset);
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_IF_NOT_GREATER_UNCHECKED): {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(!(a > b), offset);
+                DISPATCH();
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = read_byte();
-                vm.stack.data[slot] = peek(&vm.stack, 0);
-                break;
+            TARGET(OP_POP_JUMP_IF_TRUE): {
+                uint16_t offset = READ_SHORT();
+                Value condition = TOP;
+                DROP();
+                JUMP_IF(!is_falsey(condition), offset);
+                DISPATCH();
             }
-            case OP_GET_LOCAL: {
-                uint8_t slot = read_byte();
-                push(&vm.stack, vm.stack.data[slot]);
-                break;
+            TARGET(OP_JUMP_IF_LESS): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
+                uint16_t offset = READ_SHORT();
+                JUMP_IF(a < b, offset);
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
+            TARGET(OP_JUMP_IF_GREATER): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+                    RUNTIME_ERROR("Operands must be numbers.");
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
                 uint16_t offset = READ_SHORT();
-                if (is_falsey(peek(&vm.stack, 0)))
-                    vm.ip += offset;
-                break;
+                JUMP_IF(a > b, offset);
+                DISPATCH();
             }
-            case OP_JUMP: {
+            TARGET(OP_JUMP_IF_LESS_UNCHECKED): {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
                 uint16_t offset = READ_SHORT();
-                vm.ip += offset;
-                break;
+                JUMP_IF(a < b, offset);
+                DISPATCH();
             }
-            case OP_LOOP: {
+            TARGET(OP_JUMP_IF_GREATER_UNCHECKED): {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(TOP);
+                DROP();
                 uint16_t offset = READ_SHORT();
-                vm.ip -= offset;
-                break;
+                JUMP_IF(a > b, offset);
+                DISPATCH();
+            }
+            TARGET(OP_DEFINE_GLOBAL_LONG): {
+                uint16_t slot = READ_SHORT();
+                vm.globals.values[slot] = TOP;
+                DROP();
+                DISPATCH();
+            }
+            TARGET(OP_GET_GLOBAL_LONG): {
+                uint16_t slot = READ_SHORT();
+                Value value = vm.globals.values[slot];
+                if (IS_UNDEFINED(value))
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+                PUSH(value);
+                DISPATCH();
+            }
+            TARGET(OP_SET_GLOBAL_LONG): {
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(vm.globals.values[slot]))
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+                vm.globals.values[slot] = TOP;
+                DISPATCH();
+            }
+            TARGET(OP_SET_LOCAL_LONG): {
+                uint16_t slot = READ_SHORT();
+                vm.stack.data[slot] = TOP;
+                DISPATCH();
+            }
+            TARGET(OP_GET_LOCAL_LONG): {
+                uint16_t slot = READ_SHORT();
+                PUSH(LOCAL(slot));
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_IF_FALSE_LONG): {
+                uint32_t offset = READ_LONG();
+                JUMP_IF(is_falsey(TOP), offset);
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_LONG): {
+                uint32_t offset = READ_LONG();
+                JUMP_IF(true, offset);
+                DISPATCH();
             }
-            case OP_RETURN: {
+            TARGET(OP_LOOP_LONG): {
+                uint32_t offset = READ_LONG();
+                JUMP_IF(true, -(int)offset);
+#ifdef TRACING_SUPPORTED
+                if (vm.use_jit) {
+                    CALL_WITH_STACK(ip = trace_loop(ip));
+                    SAVE_IP();
+                }
+#endif
+                DISPATCH();
+            }
+            TARGET(OP_POP_JUMP_IF_FALSE_LONG): {
+                uint32_t offset = READ_LONG();
+                Value condition = TOP;
+                DROP();
+                JUMP_IF(is_falsey(condition), offset);
+                DISPATCH();
+            }
+            TARGET(OP_RETURN): {
+                SAVE_IP();
+                FLUSH_STACK();
                 return INTERPRET_OK;
             }
+#ifndef USE_COMPUTED_GOTO
         }
     }
+#endif
 
+#undef GLOBAL_NAME
 #undef READ_STRING
+#undef READ_CONSTANT_LONG
 #undef READ_CONSTANT
+#undef READ_LONG
 #undef READ_SHORT
+#undef READ_BYTE
 }
 
 
-static void runtime_error(const char* format, ...) {
+void runtime_error(const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -242,80 +918,113 @@ static void runtime_error(const char* format, ...) {
     size_t instruction = vm.ip - vm.chunk->code - 1;
     int line = get_line(vm.chunk, instruction);
     fprintf(stderr, "[line %d] in script\n", line);
-    free_stack(&vm.stack);
-    init_stack(&vm.stack);
+    reset_stack(&vm.stack);
 }
 
 void init_vm() {
     init_stack(&vm.stack);
     init_table(&vm.strings);
-    init_table(&vm.globals);
+    init_table(&vm.global_slots);
+    init_value_array(&vm.global_names);
+    init_value_array(&vm.globals);
+    init_table(&vm.global_constants);
     vm.chunk = NULL;
     vm.objects = NULL;
+    vm.use_registers = false;
+    vm.use_jit = false;
+    vm.jit_perf_map = false;
+    vm.profile_out = NULL;
+    vm.profile_in = NULL;
+    vm.branches = NULL;
 }
 
 
 void free_vm() {
+#ifdef DEBUG_PROFILE_OPCODES
+    print_profile();
+#endif
     free_stack(&vm.stack);
     free_table(&vm.strings);
-    free_table(&vm.globals);
+    free_table(&vm.global_slots);
+    free_value_array(&vm.global_names);
+    free_value_array(&vm.globals);
+    free_table(&vm.global_constants);
     free_objects();
-    if(vm.chunk == NULL) return;
-    free_chunk(vm.chunk);
 }
 
 
-static uint8_t read_byte() {
-    return *vm.ip++;
+static bool concatenate() {
+    Value result;
+    if (!concatenate_strings(peek(&vm.stack, 1), peek(&vm.stack, 0), &result))
+        return false;
+    vm.stack.top -= 2;
+    push(&vm.stack, result);
+    return true;
 }
 
+/* Adds the top count values as a chain of OP_ADD would, and fails on
+ * the first pair it would fail on, returning the error to report.
+ * Strings throughout are joined in one go instead of a new string per
+ * step. */
+static const char* add_many(int count) {
+    Value* values = vm.stack.top - count;
+    int strings = 0;
+    while (strings < count && IS_STRING(values[strings]))
+        strings++;
 
-static Value read_constant() {
-    uint8_t index = read_byte();
-    return vm.chunk->constants.values[index];
-}
-
+    Value result;
+    if (strings == count) {
+        if (!join_values(values, count, &result))
+            return "String too long.";
+    } else {
+        result = values[0];
+        for (int i = 1; i < count; i++) {
+            Value b = values[i];
+            if (IS_NUMBER(result) && IS_NUMBER(b)) {
+                result = NUMBER_VAL(AS_NUMBER(result) + AS_NUMBER(b));
+            } else if (IS_STRING(result) && IS_STRING(b)) {
+                if (!concatenate_strings(result, b, &result))
+                    return "String too long.";
+            } else {
+                return "Operands must be two numbers or two strings.";
+            }
+        }
+    }
 
-static Value read_constant_long() {
-    uint16_t index = (read_byte() << 8) | read_byte();
-    return vm.chunk->constants.values[index];
+    vm.stack.top -= count;
+    push(&vm.stack, result);
+    return NULL;
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(pop(&vm.stack));
-    ObjString* a = AS_STRING(pop(&vm.stack));
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString* result = take_string(chars, length);
-    push(&vm.stack, OBJ_VAL(result));
+static bool interpolate(int count) {
+    Value result;
+    if (!join_values(vm.stack.top - count, count, &result))
+        return false;
+    vm.stack.top -= count;
+    push(&vm.stack, result);
+    return true;
 }
 
-static void string_multiply() {
-    double b_num;
-    ObjString* a_str;
-    Value b_val = pop(&vm.stack);
-    Value a_val = pop(&vm.stack);
-    if(IS_NUMBER(b_val)) {
-        b_num = AS_NUMBER(b_val);
-        a_str = AS_STRING(a_val);
-    } else {
-        b_num = AS_NUMBER(a_val);
-        a_str = AS_STRING(b_val);
-    }
-
-    int length = b_num * a_str->length;
-    char* chars = ALLOCATE(char, length + 1);
-    int i = 0;
-    for (i = 0; i < b_num; i++) {
-        memcpy(chars + (a_str->length * i), a_str->chars, a_str->length);
-    }
-    chars[length] = '\0';
+static bool call_native(const Native* native) {
+    Value* args = vm.stack.top - native->arity;
+    Value result;
+    if (!native->function(args, &result))
+        return false;
+    vm.stack.top = args;
+    push(&vm.stack, result);
+    return true;
+}
 
-    ObjString* result = take_string(chars, length);
-    push(&vm.stack, OBJ_VAL(result));
+static bool string_multiply() {
+    Value b = peek(&vm.stack, 0);
+    Value a = peek(&vm.stack, 1);
+    Value result;
+    bool repeated = IS_NUMBER(b)
+        ? repeat_string(a, AS_NUMBER(b), &result)
+        : repeat_string(b, AS_NUMBER(a), &result);
+    if (!repeated)
+        return false;
+    vm.stack.top -= 2;
+    push(&vm.stack, result);
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,114 @@
+#ifdef __unix__
+#define _DEFAULT_SOURCE
+#endif
+
+#include "x64.h"
+
+#ifdef X64_NATIVE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+void init_code_buffer(CodeBuffer* buffer) {
+    buffer->bytes = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+}
+
+void free_code_buffer(CodeBuffer* buffer) {
+    FREE_ARRAY(uint8_t, buffer->bytes, buffer->capacity);
+    init_code_buffer(buffer);
+}
+
+void emit_code(CodeBuffer* buffer, const uint8_t* bytes, int count) {
+    if (buffer->capacity < buffer->count + count) {
+        int old_capacity = buffer->capacity;
+        while (buffer->capacity < buffer->count + count)
+            buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        buffer->bytes = GROW_ARRAY(uint8_t, buffer->bytes,
+            old_capacity, buffer->capacity);
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+void emit_u32(CodeBuffer* buffer, uint32_t value) {
+    EMIT(buffer, value & 0xff, (value >> 8) & 0xff,
+        (value >> 16) & 0xff, value >> 24);
+}
+
+void emit_u64(CodeBuffer* buffer, uint64_t value) {
+    emit_u32(buffer, (uint32_t)value);
+    emit_u32(buffer, (uint32_t)(value >> 32));
+}
+
+/* mov reg, imm64 */
+void emit_mov_imm64(CodeBuffer* buffer, int reg, uint64_t value) {
+    EMIT(buffer, 0x48, 0xB8 + reg);
+    emit_u64(buffer, value);
+}
+
+/* Emits a jump with an empty rel32 and returns where the rel32 is. */
+int emit_jcc(CodeBuffer* buffer, uint8_t condition) {
+    EMIT(buffer, 0x0F, condition);
+    emit_u32(buffer, 0);
+    return buffer->count - 4;
+}
+
+int emit_jmp(CodeBuffer* buffer) {
+    EMIT(buffer, 0xE9);
+    emit_u32(buffer, 0);
+    return buffer->count - 4;
+}
+
+void patch_rel32(CodeBuffer* buffer, int position, int target) {
+    int32_t rel = target - (position + 4);
+    memcpy(&buffer->bytes[position], &rel, sizeof(rel));
+}
+
+void patch_here(CodeBuffer* buffer, int position) {
+    patch_rel32(buffer, position, buffer->count);
+}
+
+/* Says once why native code is not being used. Later attempts would
+ * fail the same way. */
+static void report_map_error(const char* message) {
+    static bool reported = false;
+    if (!reported)
+        fprintf(stderr, "%s: %s.\n", message, strerror(errno));
+    reported = true;
+}
+
+/* Copies the code into fresh executable pages. Returns NULL after
+ * reporting why if they could not be mapped, so the caller can run
+ * the bytecode instead. */
+uint8_t* map_code(CodeBuffer* buffer, size_t* size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *size = (buffer->count + page - 1) / page * page;
+    uint8_t* code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        report_map_error("Could not map native code");
+        return NULL;
+    }
+
+    memcpy(code, buffer->bytes, buffer->count);
+    /* A system that forbids executable mappings refuses here. */
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+        report_map_error("Could not make native code executable");
+        munmap(code, *size);
+        return NULL;
+    }
+    return code;
+}
+
+void unmap_code(uint8_t* code, size_t size) {
+    munmap(code, size);
+}
+
+#endif
@@ -0,0 +1,14 @@
+#!/bin/bash
+# Prints a script adding more operands than one OP_ADD_N can take.
+
+awk 'BEGIN {
+    printf "var one = 1;\nvar dot = \".\";\nprint one"
+    for (i = 1; i < 600; i++)
+        printf " + one"
+    print "; // expect: 600"
+    printf "var dots = dot"
+    for (i = 1; i < 300; i++)
+        printf " + dot"
+    print ";"
+    print "print dots == \".\" * 300; // expect: true"
+}'
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Prints a script whose constant pool needs deduplicating: one constant
+# used 70000 times among 70000 distinct ones, which takes the pool past
+# 65536 entries, then 0 and -0 and NaNs, which must not be confused
+# with each other when they are looked up by their bits.
+
+awk 'BEGIN {
+    print "var sum = 0;"
+    print "var other = 0;"
+    for (i = 0; i < 70000; i++) {
+        print "sum = sum + 7;"
+        print "other = other + " i ".25;"
+    }
+    print "print sum; // expect: 490000"
+    print "print other == 2449982500; // expect: true"
+    print "print 7; // expect: 7"
+    print "print 69999.25; // expect: 69999.2"
+    print "var zero = 0;"
+    print "var negative = -0;"
+    print "print zero; // expect: 0"
+    print "print negative; // expect: -0"
+    print "print 1 / zero; // expect: inf"
+    print "print 1 / negative; // expect: -inf"
+    print "print 1 / -0; // expect: -inf"
+    print "print 1 / 0; // expect: inf"
+    print "var nan = 0 / 0;"
+    print "var another = 0 / 0;"
+    print "print nan == nan; // expect: false"
+    print "print nan != another; // expect: true"
+    print "print nan == 0; // expect: false"
+}'
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Prints a script past the limits of the short instruction forms: a
+# loop body of 70000 statements holds more than 65536 constants and
+# needs jumps longer than 64 KiB, and a block declares 300 locals.
+
+awk 'BEGIN {
+    print "var sum = 0;"
+    print "var round = 0;"
+    print "while (round < 2) {"
+    print "    round = round + 1;"
+    for (i = 0; i < 70000; i++)
+        print "    sum = sum + " i ";"
+    print "}"
+    print "print round; // expect: 2"
+    print "print sum == 4899930000; // expect: true"
+    print "print 69999; // expect: 69999"
+    print "{"
+    for (i = 0; i < 300; i++)
+        print "    var local" i " = " i " + 0.5;"
+    print "    print local0 + local299; // expect: 300"
+    print "    local256 = local256 * 2;"
+    print "    print local256; // expect: 513"
+    print "}"
+}'
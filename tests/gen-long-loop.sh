@@ -0,0 +1,21 @@
+#!/bin/bash
+# Prints a script with a hot loop too long for OP_LOOP: the body skips
+# more than 64 KiB of code behind a long conditional jump on every
+# iteration but the last, so under --jit the loop is traced through
+# OP_LOOP_LONG and leaves the trace at the long jump.
+
+awk 'BEGIN {
+    print "var sum = 0;"
+    print "var extra = 0;"
+    print "var i = 0;"
+    print "while (i < 300000) {"
+    print "    i = i + 1;"
+    print "    sum = sum + i;"
+    print "    if (i > 299999) {"
+    for (k = 0; k < 12000; k++)
+        print "        extra = extra + 1;"
+    print "    }"
+    print "}"
+    print "print sum == 45000150000; // expect: true"
+    print "print extra; // expect: 12000"
+}'
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Prints a script whose stack overflows in the else branch of an if,
+# with an overflowing then branch before it that does not run. The
+# overflow is reported on the line in the branch that ran.
+
+awk 'BEGIN {
+    print "{"
+    for (i = 0; i < 60000; i++)
+        print "    var local" i " = " i ";"
+    print "    var flag = false;"
+    for (branch = 0; branch < 2; branch++) {
+        print branch == 0 ? "    if (flag) {" : "    } else {"
+        print "        print local0 + (local0 + (local0 + ("
+        for (i = 0; i < 1000; i++)
+            print "            local0 + (local0 + (local0 + (local0 + (local0 + (local0 + (local0 + (local0 + ("
+        line = "            local0"
+        for (i = 0; i < 8003; i++)
+            line = line ")"
+        print line ";"
+    }
+    print "    }"
+    print "}"
+    print "// stderr: Stack overflow."
+    print "// stderr: [line 61699] in script"
+}'
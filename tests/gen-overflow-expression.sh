@@ -0,0 +1,21 @@
+#!/bin/bash
+# Prints a script whose stack overflows in the middle of an expression:
+# 60000 locals, then an expression nested deep enough to push the stack
+# past its 65535 values. Each line pushes eight values, so the overflow
+# falls inside a line whether or not the top of the stack is cached.
+
+awk 'BEGIN {
+    print "{"
+    for (i = 0; i < 60000; i++)
+        print "    var local" i " = " i ";"
+    print "    print local0 + (local0 + (local0 + ("
+    for (i = 0; i < 1000; i++)
+        print "        local0 + (local0 + (local0 + (local0 + (local0 + (local0 + (local0 + (local0 + ("
+    line = "        local0"
+    for (i = 0; i < 8003; i++)
+        line = line ")"
+    print line ";"
+    print "}"
+    print "// stderr: Stack overflow."
+    print "// stderr: [line 60694] in script"
+}'
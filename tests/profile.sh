@@ -0,0 +1,82 @@
+#!/bin/bash
+# Checks profile-guided layout end to end. Each script in tests/ is
+# trained on with the first interpreter, which must be built with
+# PROFILE_BRANCHES, and run again by the second with --profile-use; it
+# must print exactly what it prints without the profile. A profile of
+# other code, a damaged one or a missing one must be ignored with a
+# warning, and --profile-generate must be refused by a build that does
+# not count branches.
+#
+#   tests/profile.sh bin/pgo/grino bin/stack/grino
+
+if [ $# -ne 2 ]; then
+    echo "Usage: tests/profile.sh training-interpreter interpreter" >&2
+    exit 64
+fi
+
+dir=$(dirname "$0")
+training=$1
+interpreter=$2
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+failed=0
+fail() {
+    echo "FAIL $*"
+    failed=$((failed + 1))
+}
+
+# Runs the interpreter with the given arguments, keeping its output and
+# status in $scratch/$name.*.
+capture() {
+    local name=$1
+    shift
+    "$@" > "$scratch/$name.out" 2> "$scratch/$name.err"
+    echo $? > "$scratch/$name.status"
+}
+
+same() {
+    cmp -s "$scratch/$1.out" "$scratch/$2.out" &&
+        cmp -s "$scratch/$1.status" "$scratch/$2.status"
+}
+
+for script in "$dir"/*.lox; do
+    capture plain "$interpreter" "$script"
+    rm -f "$scratch/branches.prof"
+    "$training" --profile-generate "$scratch/branches.prof" "$script" \
+        > /dev/null 2>&1
+    capture guided "$interpreter" --profile-use "$scratch/branches.prof" "$script"
+    if ! same plain guided || ! cmp -s "$scratch/plain.err" "$scratch/guided.err"; then
+        fail "$script with its own profile"
+        diff "$scratch/plain.out" "$scratch/guided.out" | head -n 10
+        diff "$scratch/plain.err" "$scratch/guided.err" | head -n 10
+    fi
+done
+
+# Profiles that do not fit: one of another script, one cut short and
+# one that is not there.
+trained="$dir/fib.lox"
+script="$dir/const.lox"
+"$training" --profile-generate "$scratch/other.prof" "$trained" > /dev/null 2>&1
+head -c 20 "$scratch/other.prof" > "$scratch/short.prof"
+capture plain "$interpreter" "$script"
+for profile in other short missing; do
+    capture stale "$interpreter" --profile-use "$scratch/$profile.prof" "$script"
+    if ! same plain stale ||
+       ! grep -q "^Ignoring profile \"$scratch/$profile.prof\"" "$scratch/stale.err"; then
+        fail "$script with the $profile profile"
+        cat "$scratch/stale.err" | head -n 10
+    fi
+done
+
+capture refused "$interpreter" --profile-generate "$scratch/refused.prof" "$script"
+if [ "$(cat "$scratch/refused.status")" -ne 64 ] || [ -s "$scratch/refused.out" ] ||
+   ! grep -q "PROFILE_BRANCHES" "$scratch/refused.err"; then
+    fail "--profile-generate without PROFILE_BRANCHES"
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "$failed failed (profiles)"
+    exit 1
+fi
+echo "all passed (profiles)"
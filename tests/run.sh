@@ -0,0 +1,49 @@
+#!/bin/bash
+# Runs every script in tests/ through the interpreter given as the first
+# argument, passing it any further arguments, and compares what it
+# prints with the script's comments: each `// expect: text` is a line
+# of standard output and each `// stderr: text` a line of standard
+# error, in order. The output of each tests/gen-*.sh is run the same
+# way, for scripts too large to keep in the tree.
+#
+#   tests/run.sh bin/stack/grino --registers
+
+if [ $# -lt 1 ]; then
+    echo "Usage: tests/run.sh interpreter [options]" >&2
+    exit 64
+fi
+
+dir=$(dirname "$0")
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+failed=0
+run() {
+    local name=$1 script=$2
+    shift 2
+    awk -F '// expect: ' 'NF > 1 { print $2 }' "$script" > "$scratch/expected.out"
+    awk -F '// stderr: ' 'NF > 1 { print $2 }' "$script" > "$scratch/expected.err"
+    "$@" "$script" > "$scratch/actual.out" 2> "$scratch/actual.err"
+    if ! cmp -s "$scratch/expected.out" "$scratch/actual.out" ||
+       ! cmp -s "$scratch/expected.err" "$scratch/actual.err"; then
+        echo "FAIL $name"
+        diff "$scratch/expected.out" "$scratch/actual.out" | head -n 10
+        diff "$scratch/expected.err" "$scratch/actual.err" | head -n 10
+        failed=$((failed + 1))
+    fi
+}
+
+for script in "$dir"/*.lox; do
+    run "$script" "$script" "$@"
+done
+for generator in "$dir"/gen-*.sh; do
+    [ -e "$generator" ] || continue
+    bash "$generator" > "$scratch/generated.lox"
+    run "$generator" "$scratch/generated.lox" "$@"
+done
+
+if [ $failed -ne 0 ]; then
+    echo "$failed failed ($*)"
+    exit 1
+fi
+echo "all passed ($*)"